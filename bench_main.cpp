@@ -0,0 +1,19 @@
+#include "benchmarks/b-index.h"
+
+#include <stdio.h>
+
+i32 main(i32, char const**) {
+    if (!asm8086::initLoggingSystem(asm8086::LogLevel::L_INFO)) {
+        fprintf(stderr, "Failed to initialize the logging system.\n");
+        return -1;
+    }
+
+    if (!initCore()) {
+        logErr("Failed to initialize.");
+        return -1;
+    }
+
+    i32 exitCode = runAllBenchmarks();
+
+    return exitCode;
+}
@@ -0,0 +1,81 @@
+#include "b-index.h"
+
+#include <chrono>
+
+namespace {
+
+// Decoder test programs, concatenated until the input reaches the size of a large dump.
+constexpr const char* DECODER_CORPUS[] = {
+    "02_multiple_move_inst.asm.o",
+    "03_more_complicated_move_inst.asm.o",
+    "04_challenge_move_inst.asm.o",
+    "05_add_sub_cmp_jnz.asm.o",
+};
+
+bool buildDecoderInput(addr_size size, core::Arr<u8>& input) {
+    while (input.len() < size) {
+        for (const char* name : DECODER_CORPUS) {
+            core::StrBuilder<> path;
+            path.append(EMULATOR_DATA_PATH);
+            path.append(name);
+            core::Arr<u8> binaryData;
+            if (core::fileReadEntire(path.view().data(), binaryData).hasErr()) {
+                logErr("Failed to read %s", name);
+                return false;
+            }
+            for (addr_size i = 0; i < binaryData.len(); i++) input.append(binaryData[i]);
+        }
+    }
+    return true;
+}
+
+template <typename TFn>
+f64 timeMilliseconds(TFn&& fn) {
+    auto start = std::chrono::steady_clock::now();
+    fn();
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<f64>(end - start).count() * 1000.0;
+}
+
+} // namespace
+
+i32 runDecoderBenchmarks() {
+    constexpr u32 threadCounts[] = { 2, 4, 8 };
+
+    core::Arr<u8> input;
+    if (!buildDecoderInput(core::MEGABYTE, input)) return -1;
+
+    DecodingContext sequential;
+    f64 sequentialMs = timeMilliseconds([&]() { decodeAsm8086(input, sequential); });
+
+    writeLineBold("Decoding %llu bytes in milliseconds (%u hardware threads):",
+                  u64(input.len()), std::thread::hardware_concurrency());
+    writeLine("  sequential     %10.3f", sequentialMs);
+
+    core::Arr<addr_size> offsets;
+    f64 scanMs = timeMilliseconds([&]() { scanInstructionLengths(input.data(), input.len(), offsets); });
+    if (offsets.len() != sequential.instructions.len()) {
+        logErr("The length scan does not match the sequential decode.");
+        return -1;
+    }
+    writeLine("  length scan    %10.3f", scanMs);
+
+    core::StrBuilder<> asmOut;
+    f64 encodeMs = timeMilliseconds([&]() { encodeAsm8086(asmOut, sequential); });
+    writeLine("  disassembly    %10.3f (%llu labels)", encodeMs, u64(sequential.jmpLabels.len()));
+    for (u32 threadCount : threadCounts) {
+        ThreadPool pool(threadCount);
+        DecodingContext parallel;
+        f64 parallelMs = timeMilliseconds([&]() {
+            decodeAsm8086Parallel(input.data(), input.len(), parallel, pool);
+        });
+        if (parallel.instructions.len() != sequential.instructions.len() ||
+            parallel.jmpLabels.len() != sequential.jmpLabels.len()) {
+            logErr("The parallel decode does not match the sequential decode.");
+            return -1;
+        }
+        writeLine("  %u threads      %10.3f", threadCount, parallelMs);
+    }
+
+    return 0;
+}
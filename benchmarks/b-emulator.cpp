@@ -0,0 +1,190 @@
+#include "b-index.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+
+namespace {
+
+constexpr i32 ITERATIONS_PER_PROGRAM = 200;
+
+struct EngineBenchmark {
+    const char* name;
+    EmulationOpts options;
+    u64 instructions;
+    f64 seconds;
+};
+
+bool loadProgram(const char* name, core::Arr<u8>& binaryData) {
+    core::StrBuilder<> path;
+    path.append(EMULATOR_DATA_PATH);
+    path.append(name);
+    return !core::fileReadEntire(path.view().data(), binaryData).hasErr();
+}
+
+EmulationContext createContext(core::Arr<u8>& binaryData, EmulationOpts options) {
+    return createEmulationCtx(binaryData.data(), binaryData.len(), options);
+}
+
+// The block engine's hit counters give the number of executed instructions for free.
+u64 countExecutedInstructions(core::Arr<u8>& binaryData) {
+    EmulationContext ectx = createContext(binaryData, EMU_OPT_BLOCK_ENGINE);
+    emulate(ectx);
+    u64 count = 0;
+    for (addr_size i = 0; i < ectx.blocks.len(); i++) {
+        count += ectx.blocks[i].hitCount * u64(ectx.blocks[i].instCount);
+    }
+    return count;
+}
+
+f64 timeEmulation(core::Arr<u8>& binaryData, EmulationOpts options) {
+    f64 seconds = 0;
+    for (i32 i = 0; i < ITERATIONS_PER_PROGRAM; i++) {
+        // Only the emulation is measured. It includes decoding each instruction on its first fetch, which every engine
+        // does the same way.
+        EmulationContext ectx = createContext(binaryData, options);
+        auto start = std::chrono::steady_clock::now();
+        emulate(ectx);
+        auto end = std::chrono::steady_clock::now();
+        seconds += std::chrono::duration<f64>(end - start).count();
+    }
+    return seconds;
+}
+
+f64 mips(u64 instructions, f64 seconds) {
+    return seconds > 0 ? f64(instructions) / seconds / 1000000.0 : 0;
+}
+
+} // namespace
+
+i32 runEmulatorBenchmarks() {
+    EngineBenchmark engines[] = {
+        { "interpreter", EMU_OPT_NONE, 0, 0 },
+        { "block", EMU_OPT_BLOCK_ENGINE, 0, 0 },
+        { "threaded", EMU_OPT_THREADED_ENGINE, 0, 0 },
+        { "jit", EMU_OPT_JIT, 0, 0 },
+    };
+    constexpr addr_size enginesLen = sizeof(engines) / sizeof(engines[0]);
+
+    writeLineBold("Emulation speed in MIPS (%d runs per program):", ITERATIONS_PER_PROGRAM);
+    for (const char* name : RUNNABLE_PROGRAMS) {
+        core::Arr<u8> binaryData;
+        if (!loadProgram(name, binaryData)) {
+            logErr("Failed to read %s", name);
+            return -1;
+        }
+
+        u64 instructions = countExecutedInstructions(binaryData) * u64(ITERATIONS_PER_PROGRAM);
+
+        writeDirect("  %-45s %10llu inst", name, instructions);
+        for (addr_size i = 0; i < enginesLen; i++) {
+            f64 seconds = timeEmulation(binaryData, engines[i].options);
+            engines[i].instructions += instructions;
+            engines[i].seconds += seconds;
+            writeDirect(" | %s: %8.2f", engines[i].name, mips(instructions, seconds));
+        }
+        writeLine("");
+    }
+
+    writeLineBold("Total:");
+    for (addr_size i = 0; i < enginesLen; i++) {
+        writeLine("  %-12s %8.2f MIPS", engines[i].name, mips(engines[i].instructions, engines[i].seconds));
+    }
+
+    return 0;
+}
+
+i32 runSnapshotBenchmarks() {
+    constexpr i32 iterations = 10000;
+    const char* name = "17_image_gen_program.asm.o";
+
+    core::Arr<u8> binaryData;
+    if (!loadProgram(name, binaryData)) {
+        logErr("Failed to read %s", name);
+        return -1;
+    }
+
+    // Checkpoint the state after the program drew the whole image, then fork variants that each change one page.
+    EmulationContext ectx = createEmulationCtx(binaryData.data(), binaryData.len(), EMU_OPT_THREADED_ENGINE);
+    emulate(ectx);
+    EmulationSnapshot checkpoint = snapshot(ectx);
+
+    f64 snapshotSeconds = 0;
+    f64 restoreSeconds = 0;
+    for (i32 i = 0; i < iterations; i++) {
+        ectx.memory[addr_size(i) % EMULATOR_MEMORY_SIZE] ^= 0xFF;
+        ectx.dirtyPages[(addr_size(i) % EMULATOR_MEMORY_SIZE) / MEMORY_PAGE_SIZE] = 1;
+
+        auto start = std::chrono::steady_clock::now();
+        EmulationSnapshot variant = snapshot(ectx);
+        auto mid = std::chrono::steady_clock::now();
+        restore(ectx, checkpoint);
+        auto end = std::chrono::steady_clock::now();
+
+        snapshotSeconds += std::chrono::duration<f64>(mid - start).count();
+        restoreSeconds += std::chrono::duration<f64>(end - mid).count();
+    }
+
+    // The cost of copying the whole memory instead.
+    core::Arr<u8> copy;
+    for (addr_size i = 0; i < EMULATOR_MEMORY_SIZE; i++) copy.append(0);
+    auto start = std::chrono::steady_clock::now();
+    for (i32 i = 0; i < iterations / 100; i++) {
+        std::memcpy(copy.data(), ectx.memory, EMULATOR_MEMORY_SIZE);
+    }
+    auto end = std::chrono::steady_clock::now();
+    f64 copySeconds = std::chrono::duration<f64>(end - start).count() * 100;
+
+    writeLineBold("Snapshot cost in microseconds (%d runs, one dirty page each):", iterations);
+    writeLine("  snapshot     %8.3f", snapshotSeconds / iterations * 1000000.0);
+    writeLine("  restore      %8.3f", restoreSeconds / iterations * 1000000.0);
+    writeLine("  full copy    %8.3f", copySeconds / iterations * 1000000.0);
+
+    return 0;
+}
+
+i32 runContextBenchmarks() {
+    constexpr i32 iterations = 2000;
+    const char* name = "06_simple_mov_sim.asm.o";
+
+    core::Arr<u8> binaryData;
+    if (!loadProgram(name, binaryData)) {
+        logErr("Failed to read %s", name);
+        return -1;
+    }
+
+    // The C heap has to clear the whole memory on every allocation it serves from memory it already owns.
+    EmulatorMemoryAllocator heap = {};
+    heap.alloc = [](addr_size size, void*) { return reinterpret_cast<u8*>(std::calloc(size, 1)); };
+    heap.free = [](u8* memory, addr_size, void*) { std::free(memory); };
+
+    auto timeRuns = [&](const EmulatorMemoryAllocator& allocator) {
+        auto start = std::chrono::steady_clock::now();
+        for (i32 i = 0; i < iterations; i++) {
+            EmulationContext ectx = createEmulationCtx(binaryData.data(), binaryData.len(), EMU_OPT_NONE, 0, allocator);
+            emulate(ectx);
+        }
+        auto end = std::chrono::steady_clock::now();
+        return std::chrono::duration<f64>(end - start).count();
+    };
+
+    f64 defaultSeconds = timeRuns(defaultMemoryAllocator());
+    f64 heapSeconds = timeRuns(heap);
+
+    // Running the program again in the same context only restores what the previous run wrote.
+    EmulationContext reused = createEmulationCtx(binaryData.data(), binaryData.len(), EMU_OPT_NONE);
+    auto start = std::chrono::steady_clock::now();
+    for (i32 i = 0; i < iterations; i++) {
+        resetEmulationCtx(reused);
+        emulate(reused);
+    }
+    auto end = std::chrono::steady_clock::now();
+    f64 resetSeconds = std::chrono::duration<f64>(end - start).count();
+
+    writeLineBold("Create and run a short program in microseconds (%d runs):", iterations);
+    writeLine("  default allocator  %8.3f", defaultSeconds / iterations * 1000000.0);
+    writeLine("  calloc             %8.3f", heapSeconds / iterations * 1000000.0);
+    writeLine("  reset and run      %8.3f", resetSeconds / iterations * 1000000.0);
+
+    return 0;
+}
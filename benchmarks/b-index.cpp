@@ -0,0 +1,12 @@
+#include "b-index.h"
+
+i32 runAllBenchmarks() {
+    writeLine("\nRUNNING BENCHMARKS\n");
+
+    if (runEmulatorBenchmarks() != 0) return -1;
+    if (runSnapshotBenchmarks() != 0) return -1;
+    if (runContextBenchmarks() != 0) return -1;
+    if (runDecoderBenchmarks() != 0) return -1;
+
+    return 0;
+}
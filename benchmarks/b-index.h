@@ -0,0 +1,16 @@
+#pragma once
+
+#include <init_core.h>
+#include <logger.h>
+#include <decoder.h>
+#include <emulator.h>
+#include <thread_pool.h>
+#include <runnable_programs.h>
+
+using namespace asm8086;
+
+i32 runEmulatorBenchmarks();
+i32 runSnapshotBenchmarks();
+i32 runContextBenchmarks();
+i32 runDecoderBenchmarks();
+i32 runAllBenchmarks();
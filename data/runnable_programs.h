@@ -0,0 +1,24 @@
+#pragma once
+
+// Programs in this directory that the emulator runs from start to finish. The others stop at instructions the emulator
+// does not support yet. Tests and benchmarks that run whole programs share this list.
+constexpr const char* RUNNABLE_PROGRAMS[] = {
+    "01_one_move_inst.asm.o",
+    "02_multiple_move_inst.asm.o",
+    "06_simple_mov_sim.asm.o",
+    "07_memory_to_register_sim.asm.o",
+    "08_half_register_movs.asm.o",
+    "09_carry_and_sign_flags.asm.o",
+    "10_more_flags.asm.o",
+    "11_ip_basic.asm.o",
+    "12_ip_loop.asm.o",
+    "13_ip_bonus.asm.o",
+    "14_basic_memory_addressing.asm.o",
+    "15_loop_memory_addressing.asm.o",
+    "16_challange_memory_addressing.asm.o",
+    "17_image_gen_program.asm.o",
+    "18_image_gen_with_boarder.asm.o",
+    "my_examples/02_low_and_hi_operations.asm.o",
+    "my_examples/03_memory_addressing.asm.o",
+    "my_examples/04_accumulators.asm.o",
+};
@@ -14,6 +14,77 @@ enum struct Mod : u8 {
     NONE_SENTINEL
 };
 
+// The effective address calculation selected by the mod and rm fields of a ModR/M byte.
+enum struct AddrForm : u8 {
+    BX_SI,
+    BX_DI,
+    BP_SI,
+    BP_DI,
+    SI,
+    DI,
+    BP,
+    BX,
+    DIRECT,   // A 16-bit address without registers.
+    REGISTER, // rm names a register, there is no memory operand.
+};
+
+// The fields of a ModR/M byte together with what follows from them.
+struct ModRM {
+    Mod mod;
+    u8 reg;
+    u8 rm;
+    u8 dispByteCount; // The displacement bytes right after the ModR/M byte.
+    AddrForm addrForm;
+};
+
+namespace detail {
+
+constexpr ModRM modRMOf(u8 byte) {
+    ModRM modrm = {};
+    modrm.mod = Mod(byte >> 6);
+    modrm.reg = (byte >> 3) & 0b111;
+    modrm.rm = byte & 0b111;
+    if (modrm.mod == Mod::REGISTER_TO_REGISTER_NO_DISPLACEMENT) {
+        modrm.addrForm = AddrForm::REGISTER;
+    }
+    else if (modrm.mod == Mod::MEMORY_NO_DISPLACEMENT && modrm.rm == 0b110) {
+        modrm.addrForm = AddrForm::DIRECT;
+        modrm.dispByteCount = 2;
+    }
+    else {
+        modrm.addrForm = AddrForm(modrm.rm);
+        if (modrm.mod == Mod::MEMORY_8_BIT_DISPLACEMENT) modrm.dispByteCount = 1;
+        if (modrm.mod == Mod::MEMORY_16_BIT_DISPLACEMENT) modrm.dispByteCount = 2;
+    }
+    return modrm;
+}
+
+struct ModRMTable {
+    ModRM byByte[256] = {};
+};
+
+constexpr ModRMTable buildModRMTable() {
+    ModRMTable table;
+    for (u32 byte = 0; byte < 256; byte++) {
+        table.byByte[byte] = modRMOf(u8(byte));
+    }
+    return table;
+}
+
+inline constexpr ModRMTable MODRM_TABLE = buildModRMTable();
+
+} // namespace detail
+
+constexpr const ModRM& decodeModRM(u8 byte) {
+    return detail::MODRM_TABLE.byByte[byte];
+}
+
+// Looks up the fields of a decoded instruction. The reg field does not change the addressing, and mod must not be
+// NONE_SENTINEL.
+constexpr const ModRM& decodeModRM(Mod mod, u8 rm) {
+    return decodeModRM(u8((u8(mod) << 6) | rm));
+}
+
 const char* modeToCptr(Mod mod);
 
 enum struct InstType : u8 {
@@ -122,7 +193,53 @@ struct DecodingContext {
     core::Arr<JmpLabel> jmpLabels;
 };
 
-void decodeAsm8086(core::Arr<u8>& bytes, DecodingContext& ctx);
+// Decodes len bytes, continuing from ctx.idx. The bytes are only read, so they can come straight from a mapped file.
+void decodeAsm8086(const u8* bytes, addr_size len, DecodingContext& ctx);
+void decodeAsm8086(const core::Arr<u8>& bytes, DecodingContext& ctx);
+
+struct ThreadPool;
+
+// Inputs shorter than this are decoded sequentially. Splitting them costs more than it saves.
+constexpr static addr_size PARALLEL_DECODE_MIN_SIZE = 64 * core::KILOBYTE;
+
+// Decodes like decodeAsm8086 and produces the same instructions and jump labels, but splits the input into segments that
+// are decoded on the pool. The byte where an instruction starts at a segment boundary is not known up front, so each
+// segment is also decoded from the next few bytes, and the segments are joined where the paths meet.
+void decodeAsm8086Parallel(const u8* bytes, addr_size len, DecodingContext& ctx, ThreadPool& pool);
+
+// Decodes the single instruction that starts at byte offset idx. Jump labels are not collected.
+Instruction decodeInstructionAt(const u8* bytes, addr_size len, addr_size idx);
+
+// Appends the offset of every instruction in the bytes without decoding them, for callers that only need the
+// instruction boundaries. Returns where the scan stopped: len, or the offset of an unsupported opcode or of an
+// instruction cut by the end of the input.
+addr_size scanInstructionLengths(const u8* bytes, addr_size len, core::Arr<addr_size>& offsets);
+
+// The longest instruction: opcode, ModR/M, two displacement and two data bytes.
+constexpr static addr_size MAX_INSTRUCTION_SIZE = 6;
+
+// Receives each decoded instruction in stream order, with the offset of its first byte from the start of the stream.
+using DecodedInstructionFn = void (*)(const Instruction& inst, addr_size offset, void* userData);
+
+// Decodes input that arrives in chunks of any size. The bytes of an instruction that is cut by the end of a chunk are
+// carried over to the next chunk, so memory use does not depend on the size of the input. Jump labels are not collected.
+struct StreamDecoder {
+    DecodedInstructionFn onInstruction = nullptr;
+    void* userData = nullptr;
+    addr_size offset = 0; // Stream offset of the first byte that is not decoded yet.
+    u8 carry[MAX_INSTRUCTION_SIZE] = {};
+    addr_size carryLen = 0;
+};
+
+StreamDecoder createStreamDecoder(DecodedInstructionFn onInstruction, void* userData = nullptr);
+
+// Decodes every instruction of the chunk that is known to be complete. At most MAX_INSTRUCTION_SIZE - 1 bytes at the
+// end of the chunk are held back until more input arrives.
+void streamDecode(StreamDecoder& decoder, const u8* chunk, addr_size len);
+
+// Decodes the held back bytes at the end of the stream.
+void streamDecodeFinish(StreamDecoder& decoder);
+
 void encodeAsm8086(core::StrBuilder<>& asmOut, const DecodingContext& ctx);
 
 namespace detail {
@@ -1,3 +1,5 @@
+#pragma once
+
 #include <init_core.h>
 #include <decoder.h>
 
@@ -52,30 +54,324 @@ enum Flags : u16 {
 static constexpr addr_size BUFFER_SIZE_FLAGS = 16;
 char* flagsToCptr(Flags f, char* buffer);
 
+// The conditional jumps, JE through JNS in InstType, select their condition with the low 4 bits of the opcode. A
+// condition is a set of flags and whether the jump is taken when any of them is set or when none is. The signed
+// conditions test SF != OF, which jumpConditionFlags computes into JUMP_LESS_FLAG, a bit the 8086 leaves unused. x86
+// hosts use the same condition numbers.
+constexpr u16 JUMP_LESS_FLAG = 0x1000;
+
+struct JumpPredicate {
+    u16 mask;
+    bool invert;
+};
+
+constexpr JumpPredicate JUMP_PREDICATES[16] = {
+    { CPU_FLAG_OVERFLOW_FLAG, false },                   // JO
+    { CPU_FLAG_OVERFLOW_FLAG, true },                    // JNO
+    { CPU_FLAG_CARRY_FLAG, false },                      // JB, JNAE
+    { CPU_FLAG_CARRY_FLAG, true },                       // JNB, JAE
+    { CPU_FLAG_ZERO_FLAG, false },                       // JE, JZ
+    { CPU_FLAG_ZERO_FLAG, true },                        // JNE, JNZ
+    { CPU_FLAG_CARRY_FLAG | CPU_FLAG_ZERO_FLAG, false }, // JBE, JNA
+    { CPU_FLAG_CARRY_FLAG | CPU_FLAG_ZERO_FLAG, true },  // JNBE, JA
+    { CPU_FLAG_SIGN_FLAG, false },                       // JS
+    { CPU_FLAG_SIGN_FLAG, true },                        // JNS
+    { CPU_FLAG_PARITY_FLAG, false },                     // JP, JPE
+    { CPU_FLAG_PARITY_FLAG, true },                      // JNP, JPO
+    { JUMP_LESS_FLAG, false },                           // JL, JNGE
+    { JUMP_LESS_FLAG, true },                            // JNL, JGE
+    { JUMP_LESS_FLAG | CPU_FLAG_ZERO_FLAG, false },      // JLE, JNG
+    { JUMP_LESS_FLAG | CPU_FLAG_ZERO_FLAG, true },       // JNLE, JG
+};
+
+constexpr bool isConditionalJump(InstType t) {
+    return u8(t) >= u8(InstType::JE) && u8(t) <= u8(InstType::JNS);
+}
+
+constexpr u16 jumpConditionFlags(u16 flags) {
+    // OF is 4 bits above SF.
+    u16 less = u16(((flags >> 4) ^ flags) & CPU_FLAG_SIGN_FLAG);
+    return u16((flags & ~JUMP_LESS_FLAG) | (less << 5));
+}
+
+// cond is the low 4 bits of the opcode. Every condition costs the same, a table lookup, a mask and a compare.
+constexpr bool isJumpTaken(u16 flags, u8 cond) {
+    const JumpPredicate& p = JUMP_PREDICATES[cond & 0xF];
+    return ((jumpConditionFlags(flags) & p.mask) != 0) != p.invert;
+}
+
+// The registers are stored as an array of these in RegisterType order, which doubles as a flat byte addressable register
+// file: word register r is the little endian word at byte 2 * r, and the byte registers AL, CL, DL, BL and AH, CH, DH,
+// BH are the low and high bytes of the first four words. See registerByteOffset.
 struct Register {
-    RegisterType type;
     u16 value;
 };
 
+static_assert(sizeof(Register) == 2, "The register file must have no padding between registers.");
+
+// Returns the offset in the register file of the register a reg or rm field selects. Byte register i is byte
+// (i % 4) * 2 + i / 4, so the high byte registers follow their low byte without a lookup.
+constexpr u8 registerByteOffset(u8 reg, bool isWord) {
+    return isWord ? u8(reg << 1) : u8(((reg & 0b11) << 1) | (reg >> 2));
+}
+
+enum struct LazyFlagsOp : u8 {
+    None, // The flags register is up to date.
+    Add,
+    Sub,
+
+    SENTINEL
+};
+
+// Arithmetic flags are not computed when an instruction executes. Instead the operands and the result of the last
+// arithmetic operation are recorded, and the flags are computed only when something reads them.
+struct LazyFlags {
+    LazyFlagsOp op;
+    bool isWord;
+    u16 dst; // Destination value before the operation.
+    u16 src; // Source value, already sign extended if the instruction required it.
+    u16 result;
+};
+
 enum EmulationOpts : u32 {
     EMU_OPT_NONE = 0,
     EMU_OPT_VERBOSE = 1 << 0,
+    EMU_OPT_BLOCK_ENGINE = 1 << 1, // Execute a whole basic block before looking up the next one.
+    EMU_OPT_THREADED_ENGINE = 1 << 2, // Dispatch through handlers specialized for each instruction at load time.
+    EMU_OPT_JIT = 1 << 3, // Compile hot basic blocks to native code. Runs on top of the block engine.
+};
+
+// The form in which the emulator executes an instruction. It is built from the decoded Instruction when the instruction
+// is first fetched, so execution does not pick the fields apart again: the immediate is already sign extended where the
+// instruction asks for it, the displacement is combined and the target of a short jump is known. The decoded Instruction
+// is kept only for printing. Four of these fit in a cache line.
+struct ExecInst {
+    InstType type;
+    Operands operands;
+    u8 byteCount;
+    bool isWord;
+    u8 reg; // Register or segment register index from the reg field.
+    u8 rm; // Register index from the rm field, for register operands.
+    AddrForm addrForm; // For memory operands. The accumulator forms use DIRECT.
+    u8 cond; // For short jumps, the low 4 bits of the opcode. Selects the JUMP_PREDICATES entry of conditional jumps.
+    u16 imm;
+    union {
+        i16 disp; // The displacement, or the address for DIRECT.
+        u16 jumpIp; // Where a taken short jump continues. Short jumps have no memory operand.
+    };
+    i32 targetIdx; // The instruction at jumpIp once the jump is linked to it, otherwise -1.
 };
 
+static_assert(sizeof(ExecInst) <= 16, "ExecInst should stay small enough for four to share a cache line.");
+
+// ip is the address of the first byte of the instruction.
+ExecInst toExecInst(const Instruction& inst, u16 ip);
+
+struct EmulationContext;
+
+// Executes one instruction and returns the index of the next instruction to execute, or -1 to stop.
+using InstHandler = i32 (*)(EmulationContext& ctx, const ExecInst& inst, i32 instIdx);
+
+// Native code for a block. Runs the block on the register file and memory, marks the memory pages it stores to in
+// dirtyPages, updates IP and returns a JitExitCode.
+using JitBlockFn = u32 (*)(Register* registers, u8* memory, u8* dirtyPages);
+
+// A straight line of instructions that ends with a control transfer instruction, or with the end of the program.
+// Blocks are cached by the instruction pointer they start from.
+struct BasicBlock {
+    u16 startIp;
+    u16 endIp; // One past the last byte of the block.
+    i32 firstInstIdx;
+    i32 instCount;
+    u64 hitCount;
+    JitBlockFn jitFn; // Native code for the block, or nullptr while it is interpreted.
+    bool jitAttempted; // Set once the block was handed to the JIT, so unsupported blocks are not retried.
+};
+
+// Executable memory that holds the native code of compiled blocks.
+struct JitCodeBuffer {
+    u8* code = nullptr;
+    addr_size cap = 0;
+    addr_size used = 0;
+
+    JitCodeBuffer() = default;
+    JitCodeBuffer(const JitCodeBuffer&) = delete;
+    JitCodeBuffer& operator=(const JitCodeBuffer&) = delete;
+    JitCodeBuffer(JitCodeBuffer&& other);
+    JitCodeBuffer& operator=(JitCodeBuffer&& other);
+    ~JitCodeBuffer();
+};
+
+// A block is compiled to native code after it was entered this many times.
+constexpr static u64 JIT_DEFAULT_HOT_THRESHOLD = 16;
+
 constexpr static addr_size EMULATOR_MEMORY_SIZE = core::MEGABYTE;
 
+// Granularity of dirty tracking and of the memory that snapshots share.
+constexpr static addr_size MEMORY_PAGE_SIZE = 4 * core::KILOBYTE;
+constexpr static addr_size MEMORY_PAGE_COUNT = EMULATOR_MEMORY_SIZE / MEMORY_PAGE_SIZE;
+
+struct MemoryPage;
+
+// Counted references to immutable memory pages. A missing page reads as zeros. Pages are shared between snapshots and
+// contexts, also across threads, and are freed with the last reference.
+struct SnapshotPages {
+    MemoryPage* pages[MEMORY_PAGE_COUNT] = {};
+
+    SnapshotPages() = default;
+    SnapshotPages(const SnapshotPages&) = delete;
+    SnapshotPages& operator=(const SnapshotPages&) = delete;
+    SnapshotPages(SnapshotPages&& other);
+    SnapshotPages& operator=(SnapshotPages&& other);
+    ~SnapshotPages();
+
+    // Drops the current pages and references the pages of other.
+    void share(const SnapshotPages& other);
+};
+
+// A saved emulation state: memory, registers and the location of the loaded program.
+struct EmulationSnapshot {
+    SnapshotPages memory;
+    Register registers[i32(RegisterType::SENTINEL)];
+    LazyFlags lazyFlags = {};
+    addr_size codeStart = 0;
+    addr_size codeEnd = 0;
+};
+
+// Provides the memory of emulation contexts. alloc must return zeroed memory or nullptr. The default allocator maps
+// anonymous pages, which the kernel zero fills on first touch, and falls back to the C heap where that is not available.
+// Processes that run many emulators can pass their own, userData is handed back to every function.
+struct EmulatorMemoryAllocator {
+    u8* (*alloc)(addr_size size, void* userData);
+    void (*free)(u8* memory, addr_size size, void* userData);
+    void* userData;
+};
+
+EmulatorMemoryAllocator defaultMemoryAllocator();
+
+// Owns the memory of one emulation context and returns it to its allocator.
+struct EmulatorMemory {
+    u8* data = nullptr;
+    addr_size size = 0;
+    EmulatorMemoryAllocator allocator = {};
+
+    EmulatorMemory() = default;
+    EmulatorMemory(const EmulatorMemory&) = delete;
+    EmulatorMemory& operator=(const EmulatorMemory&) = delete;
+    EmulatorMemory(EmulatorMemory&& other);
+    EmulatorMemory& operator=(EmulatorMemory&& other);
+    ~EmulatorMemory();
+};
+
+// Maps a 16 bit instruction pointer to an index, or to -1. Entries are allocated in pages of 256 addresses when they are
+// first written, so the table grows with the code that runs rather than with the address space.
+struct IpIndexTable {
+    constexpr static addr_size PAGE_SIZE = 256;
+    constexpr static addr_size PAGE_COUNT = 0x10000 / PAGE_SIZE;
+
+    u32 pages[PAGE_COUNT] = {}; // Offset of the page in entries plus one, or 0 while the page is not allocated.
+    core::Arr<i32> entries;
+
+    i32 get(u16 ip) const {
+        u32 page = pages[ip / PAGE_SIZE];
+        if (page == 0) return -1;
+        return entries[addr_size(page - 1) + ip % PAGE_SIZE];
+    }
+
+    void set(u16 ip, i32 idx) {
+        u32& page = pages[ip / PAGE_SIZE];
+        if (page == 0) {
+            page = u32(entries.len()) + 1;
+            for (addr_size i = 0; i < PAGE_SIZE; i++) entries.append(-1);
+        }
+        entries[addr_size(page - 1) + ip % PAGE_SIZE] = idx;
+    }
+
+    // Returns how many addresses of the page were mapped.
+    addr_size clearPage(addr_size pageIdx) {
+        u32 page = pages[pageIdx];
+        if (page == 0) return 0;
+        addr_size cleared = 0;
+        for (addr_size i = 0; i < PAGE_SIZE; i++) {
+            i32& entry = entries[addr_size(page - 1) + i];
+            if (entry >= 0) cleared++;
+            entry = -1;
+        }
+        return cleared;
+    }
+
+    void clear() {
+        core::memset(pages, 0, sizeof(pages));
+        entries.clear();
+    }
+};
+
 struct EmulationContext {
     EmulationOpts emuOpts = EMU_OPT_NONE;
     DecodingOpts decodingOpts = DEC_OP_NONE;
-    core::Arr<Instruction> instructions;
+    core::Arr<ExecInst> instructions; // Decoded when first fetched, see loadProgram.
+    core::Arr<Instruction> decodedInstructions; // Parallel to instructions. Only the verbose trace prints them.
+    IpIndexTable instIdxByIp; // Maps an address to the index of the decoded instruction starting there.
+    core::Arr<InstHandler> handlers; // Parallel to instructions.
+    core::Arr<InstHandler> fusedHandlers; // Parallel to instructions. Runs the instruction and the next one as one, or nullptr.
+    core::Arr<i32> linkedJumps; // The jumps with a targetIdx. Invalidating code unlinks them all.
+    core::Arr<BasicBlock> blocks;
+    IpIndexTable blockIdxByIp; // Maps an address to the index of the cached block starting there.
+    addr_size codeStart = 0; // The loaded program occupies [codeStart, codeEnd) of the memory.
+    addr_size codeEnd = 0;
+    u64 codePages[IpIndexTable::PAGE_COUNT / 64] = {}; // One bit per page that holds decoded instructions.
+    u64 codeBytes[0x10000 / 64] = {}; // One bit per byte that a decoded instruction was read from.
+    bool codeModified = false; // Set when a store overwrote decoded instructions.
+    addr_size staleInstructions = 0; // Decoded instructions that were invalidated since the decoded code was last reset.
+    u32 decodedCodeResets = 0; // Counts resets of the decoded code, after which every held instruction index is stale.
     Register registers[i32(RegisterType::SENTINEL)];
-    u8* memory = nullptr;
+    LazyFlags lazyFlags = {};
+    u8* memory = nullptr; // Points into ownedMemory.
+    EmulatorMemory ownedMemory;
+    SnapshotPages snapshotBase; // Contents of every memory page that is not dirty.
+    u8 dirtyPages[MEMORY_PAGE_COUNT] = {}; // Non zero for pages written since the last snapshot or restore.
+    EmulationSnapshot initialState; // Taken when the program is loaded, see resetEmulationCtx.
+    JitCodeBuffer jitCode;
+    u64 jitHotThreshold = JIT_DEFAULT_HOT_THRESHOLD;
 
     core::StrBuilder<> __verbosecity_buff;
 };
 
-EmulationContext createEmulationCtx(core::Arr<Instruction>&& instructions, EmulationOpts options = EMU_OPT_NONE);
+// Every context gets its own memory, so contexts can run on different threads at the same time.
+EmulationContext createEmulationCtx(const u8* code, addr_size codeSize, EmulationOpts options = EMU_OPT_NONE,
+                                    u16 loadBase = 0,
+                                    const EmulatorMemoryAllocator& allocator = defaultMemoryAllocator());
+
+// Copies the program into memory at loadBase and points IP at its first byte. Nothing is decoded up front. Instructions
+// are decoded from memory the first time they are fetched, one straight line run within a 256 byte page at a time, and
+// cached by address. A store into a page with decoded instructions drops the cached instructions and blocks of that page,
+// and they are decoded again from the new bytes on the next fetch.
+void loadProgram(EmulationContext& ctx, const u8* code, addr_size codeSize, u16 loadBase);
 
 void emulate(EmulationContext& ctx);
 
+// Takes a snapshot of the context. Only the pages written since the context was last snapshot or restored are copied,
+// every other page is shared with the previous snapshot.
+EmulationSnapshot snapshot(EmulationContext& ctx);
+
+// Puts the context in the state of the snapshot. Only the pages that differ between the two are copied, and the decoded
+// instructions of those pages are dropped. A snapshot can be restored into any number of contexts.
+void restore(EmulationContext& ctx, const EmulationSnapshot& snap);
+
+// Appends the index of every memory page whose contents may differ from the snapshot. These are the pages written since
+// the context was last snapshot or restored and the pages in which that last state differs from the snapshot. Passing
+// ctx.initialState gives the pages the program changed since it was loaded.
+void changedPages(const EmulationContext& ctx, const EmulationSnapshot& snap, core::Arr<addr_size>& pages);
+
+// Puts the memory and registers back in the state they had right after the program was loaded, so the program can be run
+// again. Only the pages written since then are copied, and instructions decoded from pages that were not written stay
+// cached.
+void resetEmulationCtx(EmulationContext& ctx);
+
+// Computes the CF, PF, AF, ZF, SF and OF bits the recorded operation produces. The other bits of the result are zero.
+u16 computeArithmeticFlags(const LazyFlags& lazyFlags);
+
+// Computes any pending arithmetic flags into the FLAGS register and returns its value.
+u16 materializeFlags(EmulationContext& ctx);
+
 } // namespace asm8086
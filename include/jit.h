@@ -0,0 +1,23 @@
+#pragma once
+
+#include <init_core.h>
+#include <decoder.h>
+#include <emulator.h>
+
+namespace asm8086 {
+
+enum JitExitCode : u32 {
+    JIT_EXIT_NORMAL = 0, // IP points to the next block to execute.
+    JIT_EXIT_SIDE = 1,   // IP points to an instruction of the block that the interpreter must execute next.
+};
+
+// Returns true when native code can be generated and executed on the host.
+bool jitIsSupported();
+
+// Translates a basic block to native code. Returns nullptr when the block contains an instruction the JIT can not
+// translate, or when the code buffer is full. In both cases the block should be interpreted. Stores into the program
+// loaded at [codeStart, codeEnd) exit the block before they execute.
+JitBlockFn jitCompileBlock(JitCodeBuffer& buffer, const ExecInst* instructions, i32 instCount, u16 startIp,
+                           addr_size codeStart, addr_size codeEnd);
+
+} // namespace asm8086
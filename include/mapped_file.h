@@ -0,0 +1,26 @@
+#pragma once
+
+#include <init_core.h>
+
+namespace asm8086 {
+
+// Read only contents of a whole file. Where the host supports it the file is mapped into memory, so opening it copies
+// nothing and allocates nothing proportional to its size. Elsewhere the file is read into an owned buffer.
+struct MappedFile {
+    const u8* data = nullptr;
+    addr_size size = 0;
+    bool mapped = false; // False when the contents live in buffer.
+    core::Arr<u8> buffer;
+
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    MappedFile(MappedFile&& other);
+    MappedFile& operator=(MappedFile&& other);
+    ~MappedFile();
+};
+
+// Opens the file at path read only. Returns false when it can not be opened or read.
+bool mapFile(const char* path, MappedFile& out);
+
+} // namespace asm8086
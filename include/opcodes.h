@@ -133,7 +133,6 @@ enum Opcode : u8 {
 };
 
 const char* opcodeToCptr(Opcode o);
-Opcode opcodeDecode(u8 opcodeByte);
 
 struct FieldDisplacements {
     struct Displacement {
@@ -157,6 +156,232 @@ struct FieldDisplacements {
     i8 fixedWord;
 };
 
-FieldDisplacements getFieldDisplacements(Opcode opcode);
+namespace detail {
+
+constexpr FieldDisplacements::Displacement DEFAULT_NOT_SET  = { 0, 0, -1 };
+constexpr FieldDisplacements::Displacement DEFAULT_OPTIONAL = { 0, 0b11111111, 2 };
+constexpr FieldDisplacements::Displacement DEFAULT_W        = { 0, 0b00000001, 0 };
+constexpr FieldDisplacements::Displacement DEFAULT_D        = { 1, 0b00000010, 0 };
+constexpr FieldDisplacements::Displacement DEFAULT_S        = { 1, 0b00000010, 0 };
+constexpr FieldDisplacements::Displacement DEFAULT_MOD      = { 6, 0b11000000, 1 };
+constexpr FieldDisplacements::Displacement DEFAULT_REG      = { 3, 0b00111000, 1 };
+constexpr FieldDisplacements::Displacement DEFAULT_RM       = { 0, 0b00000111, 1 };
+
+constexpr i8 NO_FIXED_SIZE = -1;
+constexpr i8 FIXED_SIZE_BYTE = 0;
+constexpr i8 FIXED_SIZE_WORD = 1;
+
+constexpr FieldDisplacements DEFAULT_JMP = {
+    { 0, 0b11111111, 0 }, DEFAULT_NOT_SET, DEFAULT_NOT_SET, DEFAULT_NOT_SET,
+    DEFAULT_NOT_SET, DEFAULT_NOT_SET, DEFAULT_NOT_SET,
+    DEFAULT_NOT_SET, DEFAULT_NOT_SET,
+    DEFAULT_OPTIONAL, DEFAULT_NOT_SET,
+    FIXED_SIZE_BYTE
+};
+
+} // namespace detail
+
+// The layout of the fields of every instruction with the opcode.
+constexpr FieldDisplacements fieldDisplacementsOf(Opcode opcode) {
+    using namespace detail;
+    switch (opcode) {
+        case MOV_REG_OR_MEM_TO_OR_FROM_REG:
+            return {
+                { 2, 0b11111100, 0 }, DEFAULT_D, DEFAULT_NOT_SET, DEFAULT_W,
+                DEFAULT_MOD, DEFAULT_REG, DEFAULT_RM,
+                DEFAULT_OPTIONAL, DEFAULT_OPTIONAL,
+                DEFAULT_NOT_SET, DEFAULT_NOT_SET,
+                NO_FIXED_SIZE
+            };
+        case MOV_IMM_TO_REG_OR_MEM:
+            return {
+                { 1, 0b11111110, 0 }, DEFAULT_NOT_SET, DEFAULT_NOT_SET, DEFAULT_W,
+                DEFAULT_MOD, DEFAULT_REG, DEFAULT_RM,
+                DEFAULT_OPTIONAL, DEFAULT_OPTIONAL,
+                DEFAULT_OPTIONAL, DEFAULT_OPTIONAL,
+                NO_FIXED_SIZE
+            };
+        case MOV_IMM_TO_REG:
+            return {
+                { 4, 0b11110000, 0 }, DEFAULT_NOT_SET, DEFAULT_NOT_SET, { 3, 0b00001000, 0 },
+                DEFAULT_NOT_SET, { 0, 0b00000111, 0 }, DEFAULT_NOT_SET,
+                DEFAULT_NOT_SET, DEFAULT_NOT_SET,
+                DEFAULT_OPTIONAL, DEFAULT_OPTIONAL,
+                NO_FIXED_SIZE
+            };
+        case MOV_MEM_TO_ACC:
+            return {
+                { 1, 0b11111110, 0 }, DEFAULT_D, DEFAULT_NOT_SET, DEFAULT_W,
+                DEFAULT_NOT_SET, DEFAULT_NOT_SET, DEFAULT_NOT_SET,
+                DEFAULT_NOT_SET, DEFAULT_NOT_SET,
+                DEFAULT_OPTIONAL, DEFAULT_OPTIONAL,
+                FIXED_SIZE_WORD
+            };
+        case MOV_ACC_TO_MEM:
+            return {
+                { 1, 0b11111110, 0 }, DEFAULT_D, DEFAULT_NOT_SET, DEFAULT_W,
+                DEFAULT_NOT_SET, DEFAULT_NOT_SET, DEFAULT_NOT_SET,
+                DEFAULT_NOT_SET, DEFAULT_NOT_SET,
+                DEFAULT_OPTIONAL, DEFAULT_OPTIONAL,
+                FIXED_SIZE_WORD
+            };
+        case MOV_REG_OR_MEMORY_TO_SEGMENT_REG:
+            return {
+                { 0, 0b11111111, 0 }, DEFAULT_NOT_SET, DEFAULT_NOT_SET, DEFAULT_NOT_SET,
+                DEFAULT_MOD, DEFAULT_REG, DEFAULT_RM,
+                DEFAULT_OPTIONAL, DEFAULT_OPTIONAL,
+                DEFAULT_NOT_SET, DEFAULT_NOT_SET,
+                NO_FIXED_SIZE
+            };
+        case MOV_SEGMENT_REG_TO_REG_OR_MEMORY:
+            return {
+                { 0, 0b11111111, 0 }, DEFAULT_NOT_SET, DEFAULT_NOT_SET, DEFAULT_NOT_SET,
+                DEFAULT_MOD, DEFAULT_REG, DEFAULT_RM,
+                DEFAULT_OPTIONAL, DEFAULT_OPTIONAL,
+                DEFAULT_NOT_SET, DEFAULT_NOT_SET,
+                NO_FIXED_SIZE
+            };
+        case ADD_REG_OR_MEM_WITH_REG_TO_EDIT:
+            return {
+                { 2, 0b11111100, 0 }, DEFAULT_D, DEFAULT_NOT_SET, DEFAULT_W,
+                DEFAULT_MOD, DEFAULT_REG, DEFAULT_RM,
+                DEFAULT_OPTIONAL, DEFAULT_OPTIONAL,
+                DEFAULT_NOT_SET, DEFAULT_NOT_SET,
+                NO_FIXED_SIZE
+            };
+        case IMM_TO_FROM_REG_OR_MEM:
+            return {
+                { 2, 0b11111100, 0 }, DEFAULT_NOT_SET, DEFAULT_S, DEFAULT_W,
+                DEFAULT_MOD, DEFAULT_REG, DEFAULT_RM,
+                DEFAULT_OPTIONAL, DEFAULT_OPTIONAL,
+                DEFAULT_OPTIONAL, DEFAULT_OPTIONAL,
+                NO_FIXED_SIZE
+            };
+        case ADD_IMM_TO_ACC:
+            return {
+                { 1, 0b11111110, 0 }, DEFAULT_D, DEFAULT_NOT_SET, DEFAULT_W,
+                DEFAULT_NOT_SET, DEFAULT_NOT_SET, DEFAULT_NOT_SET,
+                DEFAULT_NOT_SET, DEFAULT_NOT_SET,
+                DEFAULT_OPTIONAL, DEFAULT_OPTIONAL,
+                NO_FIXED_SIZE
+            };
+        case SUB_REG_OR_MEM_WITH_REG_TO_EDIT:
+            return {
+                { 2, 0b11111100, 0 }, DEFAULT_D, DEFAULT_NOT_SET, DEFAULT_W,
+                DEFAULT_MOD, DEFAULT_REG, DEFAULT_RM,
+                DEFAULT_OPTIONAL, DEFAULT_OPTIONAL,
+                DEFAULT_NOT_SET, DEFAULT_NOT_SET,
+                NO_FIXED_SIZE
+            };
+        case SUB_IMM_FROM_ACC:
+            return {
+                { 1, 0b11111110, 0 }, DEFAULT_D, DEFAULT_NOT_SET, DEFAULT_W,
+                DEFAULT_NOT_SET, DEFAULT_NOT_SET, DEFAULT_NOT_SET,
+                DEFAULT_NOT_SET, DEFAULT_NOT_SET,
+                DEFAULT_OPTIONAL, DEFAULT_OPTIONAL,
+                NO_FIXED_SIZE
+            };
+        case CMP_REG_OR_MEM_WITH_REG:
+            return {
+                { 2, 0b11111100, 0 }, DEFAULT_D, DEFAULT_NOT_SET, DEFAULT_W,
+                DEFAULT_MOD, DEFAULT_REG, DEFAULT_RM,
+                DEFAULT_OPTIONAL, DEFAULT_OPTIONAL,
+                DEFAULT_NOT_SET, DEFAULT_NOT_SET,
+                NO_FIXED_SIZE
+            };
+        case CMP_IMM_WITH_ACC:
+            return {
+                { 1, 0b11111110, 0 }, DEFAULT_D, DEFAULT_NOT_SET, DEFAULT_W,
+                DEFAULT_NOT_SET, DEFAULT_NOT_SET, DEFAULT_NOT_SET,
+                DEFAULT_NOT_SET, DEFAULT_NOT_SET,
+                DEFAULT_OPTIONAL, DEFAULT_OPTIONAL,
+                NO_FIXED_SIZE
+            };
+        case JE_JZ_ON_EQ_ZERO:
+        case JL_JNGE_ON_LESS_NOT_GE_OR_EQ:
+        case JLE_JNG_ON_LESS_OR_EQ_NOT_GE:
+        case JB_JNAE_ON_BELOW_NOT_ABOVE_OR_EQ:
+        case JBE_JNA_ON_BELOW_OR_EQ_NOT_ABOVE:
+        case JP_JPE_ON_PARITY_EVEN:
+        case JO_ON_OVERFLOW:
+        case JS_ON_SIGN:
+        case JNE_JNZ_ON_NOT_EQ_NOR_ZERO:
+        case JNL_JGE_ON_NOT_LESS_GE_OR_EQ:
+        case JNLE_JG_ON_NOT_LESS_OR_EQ_GE:
+        case JNB_JAE_ON_NOT_BELOW_ABOVE_OR_EQ:
+        case JNBE_JA_ON_NOT_BELOW_OR_EQ_ABOVE:
+        case JNP_JPO_ON_NOT_PAR_PAR_ODD:
+        case JNO_ON_NOT_OVERFLOW:
+        case JNS_ON_NOT_SIGN:
+        case LOOP_CX_TIMES:
+        case LOOPZ_LOOPE_WHILE_ZERO_EQ:
+        case LOOPNZ_LOOPNE_WHILE_NOT_ZERO_EQ:
+        case JCXZ_ON_CX_ZERO:
+            return DEFAULT_JMP;
+    }
+    return {};
+}
+
+// Matches the opcode patterns from the longest to the shortest. Returns false for bytes that do not start a supported
+// instruction. Only used to build the decoding tables at compile time.
+constexpr bool matchOpcode(u8 opcodeByte, Opcode& out) {
+    // Check 8 bit opcodes:
+    switch (opcodeByte) {
+        case MOV_REG_OR_MEMORY_TO_SEGMENT_REG:     out = MOV_REG_OR_MEMORY_TO_SEGMENT_REG; return true;
+        case MOV_SEGMENT_REG_TO_REG_OR_MEMORY:     out = MOV_SEGMENT_REG_TO_REG_OR_MEMORY; return true;
+        case JE_JZ_ON_EQ_ZERO:                     out = JE_JZ_ON_EQ_ZERO; return true;
+        case JL_JNGE_ON_LESS_NOT_GE_OR_EQ:         out = JL_JNGE_ON_LESS_NOT_GE_OR_EQ; return true;
+        case JLE_JNG_ON_LESS_OR_EQ_NOT_GE:         out = JLE_JNG_ON_LESS_OR_EQ_NOT_GE; return true;
+        case JB_JNAE_ON_BELOW_NOT_ABOVE_OR_EQ:     out = JB_JNAE_ON_BELOW_NOT_ABOVE_OR_EQ; return true;
+        case JBE_JNA_ON_BELOW_OR_EQ_NOT_ABOVE:     out = JBE_JNA_ON_BELOW_OR_EQ_NOT_ABOVE; return true;
+        case JP_JPE_ON_PARITY_EVEN:                out = JP_JPE_ON_PARITY_EVEN; return true;
+        case JO_ON_OVERFLOW:                       out = JO_ON_OVERFLOW; return true;
+        case JS_ON_SIGN:                           out = JS_ON_SIGN; return true;
+        case JNE_JNZ_ON_NOT_EQ_NOR_ZERO:           out = JNE_JNZ_ON_NOT_EQ_NOR_ZERO; return true;
+        case JNL_JGE_ON_NOT_LESS_GE_OR_EQ:         out = JNL_JGE_ON_NOT_LESS_GE_OR_EQ; return true;
+        case JNLE_JG_ON_NOT_LESS_OR_EQ_GE:         out = JNLE_JG_ON_NOT_LESS_OR_EQ_GE; return true;
+        case JNB_JAE_ON_NOT_BELOW_ABOVE_OR_EQ:     out = JNB_JAE_ON_NOT_BELOW_ABOVE_OR_EQ; return true;
+        case JNBE_JA_ON_NOT_BELOW_OR_EQ_ABOVE:     out = JNBE_JA_ON_NOT_BELOW_OR_EQ_ABOVE; return true;
+        case JNP_JPO_ON_NOT_PAR_PAR_ODD:           out = JNP_JPO_ON_NOT_PAR_PAR_ODD; return true;
+        case JNO_ON_NOT_OVERFLOW:                  out = JNO_ON_NOT_OVERFLOW; return true;
+        case JNS_ON_NOT_SIGN:                      out = JNS_ON_NOT_SIGN; return true;
+        case LOOP_CX_TIMES:                        out = LOOP_CX_TIMES; return true;
+        case LOOPZ_LOOPE_WHILE_ZERO_EQ:            out = LOOPZ_LOOPE_WHILE_ZERO_EQ; return true;
+        case LOOPNZ_LOOPNE_WHILE_NOT_ZERO_EQ:      out = LOOPNZ_LOOPNE_WHILE_NOT_ZERO_EQ; return true;
+        case JCXZ_ON_CX_ZERO:                      out = JCXZ_ON_CX_ZERO; return true;
+    }
+
+    // Check 7 bit opcodes:
+    opcodeByte = opcodeByte >> 1;
+    switch (opcodeByte) {
+        case MOV_IMM_TO_REG_OR_MEM: out = MOV_IMM_TO_REG_OR_MEM; return true;
+        case MOV_MEM_TO_ACC:        out = MOV_MEM_TO_ACC; return true;
+        case MOV_ACC_TO_MEM:        out = MOV_ACC_TO_MEM; return true;
+        case ADD_IMM_TO_ACC:        out = ADD_IMM_TO_ACC; return true;
+        case SUB_IMM_FROM_ACC:      out = SUB_IMM_FROM_ACC; return true;
+        case CMP_IMM_WITH_ACC:      out = CMP_IMM_WITH_ACC; return true;
+    }
+
+    // Check 6 bit opcodes:
+    opcodeByte = opcodeByte >> 1;
+    switch (opcodeByte) {
+        case MOV_REG_OR_MEM_TO_OR_FROM_REG:   out = MOV_REG_OR_MEM_TO_OR_FROM_REG; return true;
+        case ADD_REG_OR_MEM_WITH_REG_TO_EDIT: out = ADD_REG_OR_MEM_WITH_REG_TO_EDIT; return true;
+        case IMM_TO_FROM_REG_OR_MEM:          out = IMM_TO_FROM_REG_OR_MEM; return true;
+        case SUB_REG_OR_MEM_WITH_REG_TO_EDIT: out = SUB_REG_OR_MEM_WITH_REG_TO_EDIT; return true;
+        case CMP_REG_OR_MEM_WITH_REG:         out = CMP_REG_OR_MEM_WITH_REG; return true;
+    }
+
+    // Check 5 bit opcodes:
+    opcodeByte = opcodeByte >> 1;
+
+    // Check 4 bit opcodes:
+    opcodeByte = opcodeByte >> 1;
+    switch (opcodeByte) {
+        case MOV_IMM_TO_REG: out = MOV_IMM_TO_REG; return true;
+    }
+
+    return false;
+}
 
 } // namespace asm8086
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <init_core.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace asm8086 {
+
+// A fixed set of worker threads with one job queue per worker. Submitted jobs are spread over the queues. A worker takes
+// the newest job from its own queue and, when that is empty, steals the oldest job from another worker, so long jobs
+// on one queue do not leave the other workers idle.
+struct ThreadPool {
+    using JobFn = void (*)(void* userData);
+
+    static constexpr u32 MAX_THREADS = 64;
+
+    // Starts threadCount workers, or one per hardware thread when threadCount is 0. Both are capped at MAX_THREADS.
+    explicit ThreadPool(u32 threadCount = 0);
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+    // Finishes every submitted job before the workers are joined.
+    ~ThreadPool();
+
+    // Calls fn(userData) on any of the workers. Jobs must not throw, and userData must stay valid until the job finished.
+    void submit(JobFn fn, void* userData);
+    // Blocks until every submitted job has finished.
+    void wait();
+    u32 threadCount() const { return workerCount; }
+
+private:
+    struct Job {
+        JobFn fn;
+        void* userData;
+    };
+
+    // Jobs in [head, tail) are queued. The owner takes from the tail and thieves take from the head. Both go back to 0
+    // when the queue runs empty, so the slots are reused.
+    struct WorkQueue {
+        std::mutex mutex;
+        core::Arr<Job> jobs;
+        addr_size head = 0;
+        addr_size tail = 0;
+    };
+
+    bool popOwn(u32 workerIdx, Job& job);
+    bool steal(u32 workerIdx, Job& job);
+    void workerLoop(u32 workerIdx);
+
+    std::thread workers[MAX_THREADS];
+    WorkQueue queues[MAX_THREADS];
+    u32 workerCount = 0;
+    std::mutex stateMutex;
+    std::condition_variable workAvailable;
+    std::condition_variable allDone;
+    addr_size queuedCount = 0; // Submitted jobs that no worker took yet.
+    addr_size pendingCount = 0; // Submitted jobs that did not finish yet.
+    u32 nextQueue = 0;
+    bool stopping = false;
+};
+
+} // namespace asm8086
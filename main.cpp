@@ -2,15 +2,18 @@
 #include <logger.h>
 #include <decoder.h>
 #include <emulator.h>
+#include <thread_pool.h>
+#include <mapped_file.h>
 
 #include <stdio.h>
+#include <cstring>
+#include <exception>
 #include <iostream>
 
 
 // TODO:
 // General list of unfinished things, that would be easy to do:
 //
-// * I should load the instruction bytes into memory as well. Then fix the terrible linear search for jump instructions.
 // * The encoder has some bugs, where it does not encode instruction sizes (word/byte keywords) correctly.
 // * Better error handling should not allow any crashes, at least in the decoder/encoder logic.
 // * Support encoding and decoding for the entire 8086 instruction set. This is a bit tedious, but shouldn't be hard at
@@ -65,6 +68,26 @@
 //        * ret - return from a procedure
 //        * jmp - long jump to a label
 
+enum struct EngineType : u8 {
+    Interpreter,
+    Block,
+    Threaded,
+    Jit,
+
+    SENTINEL
+};
+
+const char* engineTypeToCptr(EngineType e) {
+    switch (e) {
+        case EngineType::Interpreter: return "interpreter";
+        case EngineType::Block:       return "block";
+        case EngineType::Threaded:    return "threaded";
+        case EngineType::Jit:         return "jit";
+        case EngineType::SENTINEL:    break;
+    }
+    return "invalid engine";
+}
+
 struct CommandLineArguments {
     core::StrBuilder<> fileName;
     i32 fileNameLen = 0;
@@ -74,6 +97,9 @@ struct CommandLineArguments {
     u32 dumpStart = 0;
     u32 dumpEnd = u32(core::MEGABYTE);
     i32 immValuesFmt = 0;
+    u32 loadBase = 0;
+    core::StrBuilder<> batchPath;
+    EngineType engine = EngineType::Interpreter;
 
     bool isVerbose() const { return verboseFlag && !dumpMemory; }
 };
@@ -84,7 +110,7 @@ void printUsage() {
     using namespace asm8086;
 
     writeLineBold("Usage:");
-    writeLine("  -f (required)       the binary file to use.");
+    writeLine("  -f (required)       the binary file to use. Not needed with -batch.");
     writeLine("  --exec              emulate the execution.");
     writeLine("  --verbose           print verbose information.");
     writeLine("  --dump-memory       dumps the memory to standard out. When this option is on, all other std output is off.");
@@ -99,6 +125,17 @@ void printUsage() {
     writeLine("                      1 - use hex format.");
     writeLine("                      2 - use signed format.");
     writeLine("                      3 - use unsigned format.");
+    writeLine("  -load-base          the address at which the program is loaded and execution starts.");
+    writeLine("                      If not specified, the default is 0.");
+    writeLine("                      Must be less than 0x10000 and leave room for the whole program.");
+    writeLine("  -batch              a directory with .o files, or a file that lists one binary per line.");
+    writeLine("                      Emulates every binary in parallel and prints one line per binary in input order.");
+    writeLine("                      The line has the final registers, or the memory dump hash with dump-memory set.");
+    writeLine("  --engine=<name>     the execution engine to use.");
+    writeLine("                      interpreter - one instruction at a time, the default.");
+    writeLine("                      block - one cached basic block at a time. Prints block hit counters in verbose mode.");
+    writeLine("                      threaded - handlers specialized for each instruction when it is decoded.");
+    writeLine("                      jit - block engine that compiles hot blocks to native x86-64 code.");
 }
 
 bool parseCmdArguments(i32 argc, char const** argv) {
@@ -107,7 +144,8 @@ bool parseCmdArguments(i32 argc, char const** argv) {
         core::CmdFlagParser parser;
         parser.allowUnknownFlags(true);
 
-        parser.setFlagString(&cmdArgs.fileName, core::sv("f"), true);
+        parser.setFlagString(&cmdArgs.fileName, core::sv("f"), false);
+        parser.setFlagString(&cmdArgs.batchPath, core::sv("batch"), false);
         parser.setFlagUint32(&cmdArgs.dumpStart, core::sv("dump-start"), false, [](void* a) -> bool {
             u32 v = *reinterpret_cast<u32*>(a);
             return (v < cmdArgs.dumpEnd);
@@ -120,6 +158,10 @@ bool parseCmdArguments(i32 argc, char const** argv) {
             i32 v = *reinterpret_cast<i32*>(a);
             return (v >= 0 && v <= 3);
         });
+        parser.setFlagUint32(&cmdArgs.loadBase, core::sv("load-base"), false, [](void* a) -> bool {
+            u32 v = *reinterpret_cast<u32*>(a);
+            return (v < 0x10000);
+        });
 
         {
             auto res = parser.parse(addr_size(argc), argv);
@@ -143,12 +185,27 @@ bool parseCmdArguments(i32 argc, char const** argv) {
                 else if (arg.eq(core::sv("dump-memory"))) {
                     cmdArgs.dumpMemory = true;
                 }
+                else if (arg.eq(core::sv("engine=interpreter"))) {
+                    cmdArgs.engine = EngineType::Interpreter;
+                }
+                else if (arg.eq(core::sv("engine=block"))) {
+                    cmdArgs.engine = EngineType::Block;
+                }
+                else if (arg.eq(core::sv("engine=threaded"))) {
+                    cmdArgs.engine = EngineType::Threaded;
+                }
+                else if (arg.eq(core::sv("engine=jit"))) {
+                    cmdArgs.engine = EngineType::Jit;
+                }
 
                 return true;
             });
         }
     }
 
+    // One of the inputs is required.
+    argsAreOk = argsAreOk && (cmdArgs.fileName.len() > 0 || cmdArgs.batchPath.len() > 0);
+
     if (!argsAreOk) {
         printUsage();
         return false;
@@ -166,7 +223,10 @@ void debugPrintCmdArguments(CommandLineArguments& args) {
         "\tDump memory: %s\n"
         "\tDump start: %u\n"
         "\tDump end: %u\n"
-        "\tImmediate values format: %d",
+        "\tImmediate values format: %d\n"
+        "\tLoad base: %u\n"
+        "\tBatch: %s\n"
+        "\tEngine: %s",
 
         args.fileName.view().data(),
         args.execFlag ? "true" : "false",
@@ -174,10 +234,24 @@ void debugPrintCmdArguments(CommandLineArguments& args) {
         args.dumpMemory ? "true" : "false",
         args.dumpStart,
         args.dumpEnd,
-        args.immValuesFmt
+        args.immValuesFmt,
+        args.loadBase,
+        args.batchPath.len() > 0 ? args.batchPath.view().data() : "",
+        engineTypeToCptr(args.engine)
     );
 }
 
+asm8086::EmulationOpts engineOptions(EngineType engine) {
+    switch (engine) {
+        case EngineType::Block:       return asm8086::EmulationOpts::EMU_OPT_BLOCK_ENGINE;
+        case EngineType::Threaded:    return asm8086::EmulationOpts::EMU_OPT_THREADED_ENGINE;
+        case EngineType::Jit:         return asm8086::EmulationOpts::EMU_OPT_JIT;
+        case EngineType::Interpreter: [[fallthrough]];
+        case EngineType::SENTINEL:    break;
+    }
+    return asm8086::EmulationOpts::EMU_OPT_NONE;
+}
+
 void dumpMemory(u8* memory, u32 start, u32 end) {
     std::cout.write(reinterpret_cast<char*>(memory + start),  end - start);
 }
@@ -187,45 +261,211 @@ void printRegisterState(asm8086::EmulationContext& ctx) {
 
     asm8086::writeLine("Final Registers:");
 
-    auto reg = ctx.registers[i32(RegisterType::AX)];
-    asm8086::writeLine("\t%s: 0x%06X (%u)", regTypeToCptr(reg.type), reg.value, reg.value);
-    reg = ctx.registers[i32(RegisterType::BX)];
-    asm8086::writeLine("\t%s: 0x%06X (%u)", regTypeToCptr(reg.type), reg.value, reg.value);
-    reg = ctx.registers[i32(RegisterType::CX)];
-    asm8086::writeLine("\t%s: 0x%06X (%u)", regTypeToCptr(reg.type), reg.value, reg.value);
-    reg = ctx.registers[i32(RegisterType::DX)];
-    asm8086::writeLine("\t%s: 0x%06X (%u)", regTypeToCptr(reg.type), reg.value, reg.value);
-    reg = ctx.registers[i32(RegisterType::SP)];
-    asm8086::writeLine("\t%s: 0x%06X (%u)", regTypeToCptr(reg.type), reg.value, reg.value);
-    reg = ctx.registers[i32(RegisterType::BP)];
-    asm8086::writeLine("\t%s: 0x%06X (%u)", regTypeToCptr(reg.type), reg.value, reg.value);
-    reg = ctx.registers[i32(RegisterType::SI)];
-    asm8086::writeLine("\t%s: 0x%06X (%u)", regTypeToCptr(reg.type), reg.value, reg.value);
-    reg = ctx.registers[i32(RegisterType::DI)];
-    asm8086::writeLine("\t%s: 0x%06X (%u)", regTypeToCptr(reg.type), reg.value, reg.value);
+    auto printRegister = [&ctx](RegisterType r) {
+        u16 value = ctx.registers[i32(r)].value;
+        asm8086::writeLine("\t%s: 0x%06X (%u)", regTypeToCptr(r), value, value);
+    };
+
+    printRegister(RegisterType::AX);
+    printRegister(RegisterType::BX);
+    printRegister(RegisterType::CX);
+    printRegister(RegisterType::DX);
+    printRegister(RegisterType::SP);
+    printRegister(RegisterType::BP);
+    printRegister(RegisterType::SI);
+    printRegister(RegisterType::DI);
 
     asm8086::writeLine("");
 
-    reg = ctx.registers[i32(RegisterType::ES)];
-    asm8086::writeLine("\t%s: 0x%06X (%u)", regTypeToCptr(reg.type), reg.value, reg.value);
-    reg = ctx.registers[i32(RegisterType::SS)];
-    asm8086::writeLine("\t%s: 0x%06X (%u)", regTypeToCptr(reg.type), reg.value, reg.value);
-    reg = ctx.registers[i32(RegisterType::DS)];
-    asm8086::writeLine("\t%s: 0x%06X (%u)", regTypeToCptr(reg.type), reg.value, reg.value);
-    reg = ctx.registers[i32(RegisterType::CS)];
-    asm8086::writeLine("\t%s: 0x%06X (%u)", regTypeToCptr(reg.type), reg.value, reg.value);
+    printRegister(RegisterType::ES);
+    printRegister(RegisterType::SS);
+    printRegister(RegisterType::DS);
+    printRegister(RegisterType::CS);
 
     asm8086::writeLine("");
 
-    reg = ctx.registers[i32(RegisterType::IP)];
-    asm8086::writeLine("\t%s: 0x%06X (%u)", regTypeToCptr(reg.type), reg.value, reg.value);
+    printRegister(RegisterType::IP);
 
-    reg = ctx.registers[i32(RegisterType::FLAGS)];
+    u16 flags = asm8086::materializeFlags(ctx);
     {
         char flagsBuf[asm8086::BUFFER_SIZE_FLAGS] = {};
-        flagsToCptr(asm8086::Flags(reg.value), flagsBuf);
-        asm8086::writeLine("\t%s: %s (%u)", regTypeToCptr(reg.type), flagsBuf, reg.value);
+        flagsToCptr(asm8086::Flags(flags), flagsBuf);
+        asm8086::writeLine("\t%s: %s (%u)", regTypeToCptr(RegisterType::FLAGS), flagsBuf, flags);
+    }
+}
+
+void printBlockStats(asm8086::EmulationContext& ctx) {
+    asm8086::writeLine("Block Hits:");
+    for (addr_size i = 0; i < ctx.blocks.len(); i++) {
+        const auto& block = ctx.blocks[i];
+        asm8086::writeLine("\t[0x%04X, 0x%04X) %d instructions: %llu hits",
+                           block.startIp, block.endIp, block.instCount, block.hitCount);
+    }
+}
+
+struct BatchResult {
+    bool ok = false;
+    asm8086::Register registers[i32(asm8086::RegisterType::SENTINEL)];
+    u32 memoryHash = 0;
+};
+
+// The file names of a batch, each one followed by a zero byte in names.
+struct BatchFiles {
+    core::StrBuilder<> names;
+    core::Arr<addr_size> offsets;
+
+    void add(const char* name, addr_size len) {
+        offsets.append(names.len());
+        names.append(name, len);
+        names.append('\0');
     }
+    addr_size len() const { return offsets.len(); }
+    const char* name(addr_size i) const { return names.view().data() + offsets[i]; }
+};
+
+bool hasObjectExtension(const char* name) {
+    addr_size len = addr_size(strlen(name));
+    return len >= 2 && name[len - 2] == '.' && name[len - 1] == 'o';
+}
+
+// Collects the .o files of a directory sorted by name, or the non empty lines of a list file in their order.
+bool collectBatchFiles(const char* path, BatchFiles& files) {
+    struct WalkState {
+        const char* dir;
+        BatchFiles* files;
+    };
+    WalkState state = { path, &files };
+
+    auto dirRes = core::dirWalk(path, [](const core::DirEntry& entry, addr_size, void* userData) -> bool {
+        auto& walk = *reinterpret_cast<WalkState*>(userData);
+        if (entry.type != core::FileType::Regular || !hasObjectExtension(entry.name)) return true;
+        core::StrBuilder<> filePath;
+        filePath.append(walk.dir);
+        if (filePath.len() > 0 && filePath.view().data()[filePath.len() - 1] != '/') filePath.append('/');
+        filePath.append(entry.name);
+        walk.files->add(filePath.view().data(), filePath.len());
+        return true;
+    }, &state);
+
+    if (!dirRes.hasErr()) {
+        // Directory order depends on the file system. Sorting keeps the output stable. The batch is small enough for an
+        // insertion sort.
+        for (addr_size i = 1; i < files.len(); i++) {
+            addr_size offset = files.offsets[i];
+            addr_size j = i;
+            while (j > 0 && strcmp(files.names.view().data() + offset, files.name(j - 1)) < 0) {
+                files.offsets[j] = files.offsets[j - 1];
+                j--;
+            }
+            files.offsets[j] = offset;
+        }
+        return true;
+    }
+
+    core::Arr<u8> list;
+    if (core::fileReadEntire(path, list).hasErr()) return false;
+    addr_size lineStart = 0;
+    for (addr_size i = 0; i <= list.len(); i++) {
+        if (i < list.len() && list[i] != '\n') continue;
+        addr_size lineEnd = i;
+        if (lineEnd > lineStart && list[lineEnd - 1] == '\r') lineEnd--;
+        if (lineEnd > lineStart) {
+            files.add(reinterpret_cast<const char*>(list.data() + lineStart), lineEnd - lineStart);
+        }
+        lineStart = i + 1;
+    }
+    return true;
+}
+
+BatchResult runBatchJob(const char* fileName, asm8086::EmulationOpts options) {
+    BatchResult result;
+    try {
+        asm8086::MappedFile binary;
+        if (!asm8086::mapFile(fileName, binary)) {
+            return result;
+        }
+
+        asm8086::EmulationContext emuCtx = asm8086::createEmulationCtx(binary.data, binary.size, options,
+                                                                          u16(cmdArgs.loadBase));
+        asm8086::emulate(emuCtx);
+
+        for (i32 i = 0; i < i32(asm8086::RegisterType::SENTINEL); i++) {
+            result.registers[i] = emuCtx.registers[i];
+        }
+        if (cmdArgs.dumpMemory) {
+            u32 dumpSize = cmdArgs.dumpEnd - cmdArgs.dumpStart;
+            result.memoryHash = core::simpleHash_32(emuCtx.memory + cmdArgs.dumpStart, dumpSize);
+        }
+        result.ok = true;
+    }
+    catch (const std::exception&) {
+        // The assert handler already reported what went wrong with this binary. The other binaries keep running.
+        result.ok = false;
+    }
+    return result;
+}
+
+void printBatchResult(const char* fileName, const BatchResult& result) {
+    using RegisterType = asm8086::RegisterType;
+
+    if (!result.ok) {
+        asm8086::writeLine("%s: failed", fileName);
+        return;
+    }
+    if (cmdArgs.dumpMemory) {
+        asm8086::writeLine("%s: memory hash 0x%08X", fileName, result.memoryHash);
+        return;
+    }
+
+    auto reg = [&result](RegisterType r) { return result.registers[i32(r)].value; };
+    char flagsBuf[asm8086::BUFFER_SIZE_FLAGS] = {};
+    flagsToCptr(asm8086::Flags(reg(RegisterType::FLAGS)), flagsBuf);
+    asm8086::writeLine("%s: ax=0x%04X bx=0x%04X cx=0x%04X dx=0x%04X sp=0x%04X bp=0x%04X si=0x%04X di=0x%04X "
+                       "es=0x%04X ss=0x%04X ds=0x%04X cs=0x%04X ip=0x%04X flags=%s",
+                       fileName,
+                       reg(RegisterType::AX), reg(RegisterType::BX), reg(RegisterType::CX), reg(RegisterType::DX),
+                       reg(RegisterType::SP), reg(RegisterType::BP), reg(RegisterType::SI), reg(RegisterType::DI),
+                       reg(RegisterType::ES), reg(RegisterType::SS), reg(RegisterType::DS), reg(RegisterType::CS),
+                       reg(RegisterType::IP), flagsBuf);
+}
+
+// Emulates every binary of the batch on a thread pool with one context per binary. Startup costs are paid once for
+// the whole batch instead of once per binary.
+i32 runBatch() {
+    BatchFiles files;
+    if (!collectBatchFiles(cmdArgs.batchPath.view().data(), files)) {
+        logErr("Failed to read the batch: %s", cmdArgs.batchPath.view().data());
+        return -1;
+    }
+
+    struct BatchJob {
+        const char* fileName;
+        asm8086::EmulationOpts options;
+        BatchResult result;
+    };
+
+    asm8086::EmulationOpts options = engineOptions(cmdArgs.engine);
+    core::Arr<BatchJob> jobs;
+    for (addr_size i = 0; i < files.len(); i++) {
+        jobs.append(BatchJob{ files.name(i), options, {} });
+    }
+    {
+        asm8086::ThreadPool pool;
+        for (addr_size i = 0; i < jobs.len(); i++) {
+            pool.submit([](void* userData) {
+                auto& job = *reinterpret_cast<BatchJob*>(userData);
+                job.result = runBatchJob(job.fileName, job.options);
+            }, &jobs[i]);
+        }
+        pool.wait();
+    }
+
+    i32 exitCode = 0;
+    for (addr_size i = 0; i < jobs.len(); i++) {
+        printBatchResult(jobs[i].fileName, jobs[i].result);
+        if (!jobs[i].result.ok) exitCode = -1;
+    }
+    return exitCode;
 }
 
 i32 main(i32 argc, char const** argv) {
@@ -245,8 +485,15 @@ i32 main(i32 argc, char const** argv) {
     }
     debugPrintCmdArguments(cmdArgs);
 
-    core::Arr<u8> binaryData;
-    Expect(core::fileReadEntire(cmdArgs.fileName.view().data(), binaryData));
+    if (cmdArgs.batchPath.len() > 0) {
+        return runBatch();
+    }
+
+    asm8086::MappedFile binary;
+    if (!asm8086::mapFile(cmdArgs.fileName.view().data(), binary)) {
+        logErr("Failed to read %s", cmdArgs.fileName.view().data());
+        return -1;
+    }
 
     asm8086::DecodingContext ctx = {};
     switch (cmdArgs.immValuesFmt) {
@@ -255,10 +502,16 @@ i32 main(i32 argc, char const** argv) {
         case 3: ctx.options = asm8086::DecodingOpts(ctx.options | asm8086::DEC_OP_IMMEDIATE_AS_UNSIGNED); break;
     }
 
-    asm8086::decodeAsm8086(binaryData, ctx);
-
     core::StrBuilder sb;
     if (!cmdArgs.execFlag || cmdArgs.isVerbose()) {
+        // Emulation decodes from memory as it fetches, so the whole file is decoded up front only for the listing.
+        if (binary.size >= asm8086::PARALLEL_DECODE_MIN_SIZE) {
+            asm8086::ThreadPool pool;
+            asm8086::decodeAsm8086Parallel(binary.data, binary.size, ctx, pool);
+        }
+        else {
+            asm8086::decodeAsm8086(binary.data, binary.size, ctx);
+        }
         asm8086::encodeAsm8086(sb, ctx);
         asm8086::writeLine(sb.view().data());
     }
@@ -266,11 +519,13 @@ i32 main(i32 argc, char const** argv) {
     if (cmdArgs.execFlag) {
         sb.clear();
 
-        asm8086::EmulationContext emuCtx = asm8086::createEmulationCtx(core::move(ctx.instructions));
+        asm8086::EmulationContext emuCtx = asm8086::createEmulationCtx(binary.data, binary.size,
+                                                                          asm8086::EMU_OPT_NONE, u16(cmdArgs.loadBase));
         emuCtx.__verbosecity_buff = core::move(sb);
         if (cmdArgs.isVerbose()) {
             emuCtx.emuOpts = asm8086::EmulationOpts(emuCtx.emuOpts | asm8086::EmulationOpts::EMU_OPT_VERBOSE);
         }
+        emuCtx.emuOpts = asm8086::EmulationOpts(emuCtx.emuOpts | engineOptions(cmdArgs.engine));
 
         asm8086::emulate(emuCtx);
         if (cmdArgs.isVerbose()) asm8086::writeLine("");
@@ -280,6 +535,10 @@ i32 main(i32 argc, char const** argv) {
         }
         else {
             printRegisterState(emuCtx);
+            if (cmdArgs.isVerbose() && cmdArgs.engine == EngineType::Block) {
+                asm8086::writeLine("");
+                printBlockStats(emuCtx);
+            }
         }
     }
 
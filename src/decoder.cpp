@@ -1,11 +1,149 @@
 #include <decoder.h>
 #include <utils.h>
+#include <thread_pool.h>
+
+#include <cstring>
 
 namespace asm8086 {
 
 namespace {
 
-Instruction decodeInstruction(core::Arr<u8>& bytes, DecodingContext& ctx);
+// Bounds checked view over the bytes being decoded.
+struct ByteView {
+    const u8* data;
+    addr_size len;
+
+    u8 operator[](addr_size i) const {
+        Panic(i < len, "Instruction extends past the end of the code.");
+        return data[i];
+    }
+};
+
+// How the operands of an instruction follow from its fields.
+enum struct OperandsRule : u8 {
+    Fixed,           // Always the operands of the encoding.
+    ImmToReg,        // Register_Immediate, with the register in the reg field of the opcode byte.
+    RegOrMemWithReg, // Register_Register in register mode, otherwise Memory_Register or Register_Memory by the d bit.
+    ImmToRegOrMem,   // Memory_Immediate when the operand is in memory, otherwise Register_Immediate.
+    ToSegReg,        // Register16_SegReg in register mode, otherwise Memory_SegReg.
+    FromSegReg,      // SegReg_Register16 in register mode, otherwise SegReg_Memory16.
+};
+
+// Everything the first byte of an instruction determines.
+struct InstEncoding {
+    FieldDisplacements fields;
+    Opcode opcode;
+    bool supported;
+    InstType type; // For IMM_TO_FROM_REG_OR_MEM the reg field selects the type.
+    OperandsRule operandsRule;
+    Operands operands; // Used with OperandsRule::Fixed.
+    bool hasModRM;
+    u8 length; // Without the displacement, which depends on the ModR/M byte.
+};
+
+constexpr InstEncoding encodingOf(Opcode opcode) {
+    auto make = [opcode](InstType type, OperandsRule rule, Operands operands = Operands::None) {
+        return InstEncoding{ fieldDisplacementsOf(opcode), opcode, true, type, rule, operands, false, 0 };
+    };
+    auto shortJump = [&make](InstType type) { return make(type, OperandsRule::Fixed, Operands::ShortLabel); };
+
+    switch (opcode) {
+        case MOV_IMM_TO_REG:                   return make(InstType::MOV, OperandsRule::ImmToReg);
+        case MOV_REG_OR_MEM_TO_OR_FROM_REG:    return make(InstType::MOV, OperandsRule::RegOrMemWithReg);
+        case MOV_MEM_TO_ACC:                   return make(InstType::MOV, OperandsRule::Fixed, Operands::Memory_Accumulator);
+        case MOV_ACC_TO_MEM:                   return make(InstType::MOV, OperandsRule::Fixed, Operands::Accumulator_Memory);
+        case MOV_IMM_TO_REG_OR_MEM:            return make(InstType::MOV, OperandsRule::ImmToRegOrMem);
+        case MOV_REG_OR_MEMORY_TO_SEGMENT_REG: return make(InstType::MOV, OperandsRule::ToSegReg);
+        case MOV_SEGMENT_REG_TO_REG_OR_MEMORY: return make(InstType::MOV, OperandsRule::FromSegReg);
+        case IMM_TO_FROM_REG_OR_MEM:           return make(InstType::UNKNOWN, OperandsRule::ImmToRegOrMem);
+        case ADD_REG_OR_MEM_WITH_REG_TO_EDIT:  return make(InstType::ADD, OperandsRule::RegOrMemWithReg);
+        case ADD_IMM_TO_ACC:                   return make(InstType::ADD, OperandsRule::Fixed, Operands::Accumulator_Immediate);
+        case SUB_REG_OR_MEM_WITH_REG_TO_EDIT:  return make(InstType::SUB, OperandsRule::RegOrMemWithReg);
+        case SUB_IMM_FROM_ACC:                 return make(InstType::SUB, OperandsRule::Fixed, Operands::Accumulator_Immediate);
+        case CMP_REG_OR_MEM_WITH_REG:          return make(InstType::CMP, OperandsRule::RegOrMemWithReg);
+        case CMP_IMM_WITH_ACC:                 return make(InstType::CMP, OperandsRule::Fixed, Operands::Accumulator_Immediate);
+        case JE_JZ_ON_EQ_ZERO:                 return shortJump(InstType::JE);
+        case JL_JNGE_ON_LESS_NOT_GE_OR_EQ:     return shortJump(InstType::JL);
+        case JLE_JNG_ON_LESS_OR_EQ_NOT_GE:     return shortJump(InstType::JLE);
+        case JB_JNAE_ON_BELOW_NOT_ABOVE_OR_EQ: return shortJump(InstType::JB);
+        case JBE_JNA_ON_BELOW_OR_EQ_NOT_ABOVE: return shortJump(InstType::JBE);
+        case JP_JPE_ON_PARITY_EVEN:            return shortJump(InstType::JP);
+        case JO_ON_OVERFLOW:                   return shortJump(InstType::JO);
+        case JS_ON_SIGN:                       return shortJump(InstType::JS);
+        case JNE_JNZ_ON_NOT_EQ_NOR_ZERO:       return shortJump(InstType::JNE);
+        case JNL_JGE_ON_NOT_LESS_GE_OR_EQ:     return shortJump(InstType::JNL);
+        case JNLE_JG_ON_NOT_LESS_OR_EQ_GE:     return shortJump(InstType::JNLE);
+        case JNB_JAE_ON_NOT_BELOW_ABOVE_OR_EQ: return shortJump(InstType::JNB);
+        case JNBE_JA_ON_NOT_BELOW_OR_EQ_ABOVE: return shortJump(InstType::JNBE);
+        case JNP_JPO_ON_NOT_PAR_PAR_ODD:       return shortJump(InstType::JNP);
+        case JNO_ON_NOT_OVERFLOW:              return shortJump(InstType::JNO);
+        case JNS_ON_NOT_SIGN:                  return shortJump(InstType::JNS);
+        case LOOP_CX_TIMES:                    return shortJump(InstType::LOOP);
+        case LOOPZ_LOOPE_WHILE_ZERO_EQ:        return shortJump(InstType::LOOPE);
+        case LOOPNZ_LOOPNE_WHILE_NOT_ZERO_EQ:  return shortJump(InstType::LOOPNE);
+        case JCXZ_ON_CX_ZERO:                  return shortJump(InstType::JCXZ);
+    }
+    return {};
+}
+
+struct InstEncodingTable {
+    InstEncoding byFirstByte[256] = {};
+};
+
+// The d, s and w bits are all in the first byte, so it alone decides the size of the data.
+constexpr u8 dataByteCountOf(const FieldDisplacements& fd, u8 firstByte) {
+    if (fd.data1.byteIdx <= 0) return 0;
+    bool dataIsWord = fd.fixedWord == 1;
+    if (fd.fixedWord < 0) {
+        u8 s = fd.s.byteIdx == 0 ? u8((firstByte & fd.s.mask) >> fd.s.offset) : 0;
+        u8 w = fd.w.byteIdx == 0 ? u8((firstByte & fd.w.mask) >> fd.w.offset) : 0;
+        dataIsWord = s ? false : (w == 1);
+    }
+    return dataIsWord ? 2 : 1;
+}
+
+constexpr InstEncodingTable buildInstEncodings() {
+    InstEncodingTable table;
+    for (u32 byte = 0; byte < 256; byte++) {
+        Opcode opcode = Opcode(0);
+        if (!matchOpcode(u8(byte), opcode)) continue;
+        InstEncoding encoding = encodingOf(opcode);
+        encoding.hasModRM = encoding.fields.mod.byteIdx >= 0;
+        encoding.length = u8(1 + (encoding.hasModRM ? 1 : 0) + dataByteCountOf(encoding.fields, u8(byte)));
+        table.byFirstByte[byte] = encoding;
+    }
+    return table;
+}
+
+// Indexed by the first byte of an instruction, so decoding one starts with a single load instead of matching the
+// opcode patterns.
+constexpr InstEncodingTable INST_ENCODINGS = buildInstEncodings();
+
+constexpr InstType immediateGroupType(u8 reg) {
+    if (reg == 0b000) return InstType::ADD;
+    if (reg == 0b101) return InstType::SUB;
+    if (reg == 0b111) return InstType::CMP;
+    return InstType::UNKNOWN;
+}
+
+// The label number of each byte offset around the decoded range, or -1 for offsets without a label. Short jumps reach
+// at most 128 bytes past either end of the range, so the encoder finds labels without searching them.
+struct JmpLabelIndex {
+    addr_off base = 0;
+    core::Arr<addr_off> labelIdxBySlot;
+
+    addr_off labelAt(addr_off byteOffset) const {
+        addr_off slot = byteOffset - base;
+        if (slot < 0 || addr_size(slot) >= labelIdxBySlot.len()) return -1;
+        return labelIdxBySlot[addr_size(slot)];
+    }
+};
+
+Instruction decodeInstruction(const ByteView& bytes, addr_off idx);
+bool tryDecodeInstruction(const ByteView& bytes, addr_size idx, Instruction& out);
+addr_off shortJmpTarget(const Instruction& inst, addr_off idx);
+void appendJmpLabels(DecodingContext& ctx, addr_size firstNew, addr_size start, addr_size end);
+JmpLabelIndex buildJmpLabelIndex(const core::Arr<JmpLabel>& labels, addr_size end);
 
 void appendU16toSb(core::StrBuilder<>& sb, u16 i);
 void appendImmFromLowAndHigh(core::StrBuilder<>& sb, DecodingOpts decodingOpts, bool explictSign, u8 low, u8 high);
@@ -15,6 +153,7 @@ void appendMemory(core::StrBuilder<>& sb, DecodingOpts decodingOpts,
                   u8 rm, u8 dispLow, u8 dispHigh, bool isWord, bool isCalc, bool isDirect);
 void encodeInstruction(core::StrBuilder<>& sb,
                        const DecodingContext& ctx,
+                       const JmpLabelIndex& labels,
                        const Instruction& inst,
                        addr_size byteIdx);
 
@@ -30,26 +169,249 @@ constexpr const char* segRegTable[]   = { "es", "cs", "ss", "ds" };
 
 } // namespace
 
-void decodeAsm8086(core::Arr<u8>& bytes, DecodingContext& ctx) {
-    while (ctx.idx < bytes.len()) {
-        auto inst = decodeInstruction(bytes, ctx);
+void decodeAsm8086(const u8* bytes, addr_size len, DecodingContext& ctx) {
+    ByteView view = { bytes, len };
+    addr_size start = ctx.idx;
+    addr_size firstNew = ctx.instructions.len();
+    while (ctx.idx < len) {
+        auto inst = decodeInstruction(view, addr_off(ctx.idx));
         ctx.idx += inst.byteCount;
         ctx.instructions.append(inst);
     }
+    appendJmpLabels(ctx, firstNew, start, ctx.idx);
+}
+
+void decodeAsm8086(const core::Arr<u8>& bytes, DecodingContext& ctx) {
+    decodeAsm8086(bytes.data(), bytes.len(), ctx);
+}
+
+addr_size scanInstructionLengths(const u8* bytes, addr_size len, core::Arr<addr_size>& offsets) {
+    addr_size idx = 0;
+    while (idx < len) {
+        const InstEncoding& encoding = INST_ENCODINGS.byFirstByte[bytes[idx]];
+        if (!encoding.supported) break;
+        addr_size instLen = encoding.length;
+        if (encoding.hasModRM) {
+            if (idx + 1 >= len) break;
+            instLen += decodeModRM(bytes[idx + 1]).dispByteCount;
+        }
+        if (instLen > len - idx) break;
+        offsets.append(idx);
+        idx += instLen;
+    }
+    return idx;
+}
+
+Instruction decodeInstructionAt(const u8* bytes, addr_size len, addr_size idx) {
+    ByteView view = { bytes, len };
+    return decodeInstruction(view, addr_off(idx));
+}
+
+StreamDecoder createStreamDecoder(DecodedInstructionFn onInstruction, void* userData) {
+    StreamDecoder decoder;
+    decoder.onInstruction = onInstruction;
+    decoder.userData = userData;
+    return decoder;
+}
+
+namespace {
+
+void emitStreamInstruction(StreamDecoder& decoder, const ByteView& view, addr_size& pos) {
+    Instruction inst = decodeInstruction(view, addr_off(pos));
+    decoder.onInstruction(inst, decoder.offset, decoder.userData);
+    decoder.offset += inst.byteCount;
+    pos += inst.byteCount;
+}
+
+} // namespace
+
+void streamDecode(StreamDecoder& decoder, const u8* chunk, addr_size len) {
+    // Finish the instructions that start in the carried bytes. Each needs at most MAX_INSTRUCTION_SIZE bytes from the
+    // window, so it is decoded only when they are all there or it is clear that the chunk is too short to tell.
+    addr_size chunkPos = 0;
+    if (decoder.carryLen > 0) {
+        u8 window[MAX_INSTRUCTION_SIZE * 2];
+        addr_size carryLen = decoder.carryLen;
+        addr_size take = core::core_min(len, MAX_INSTRUCTION_SIZE);
+        std::memcpy(window, decoder.carry, carryLen);
+        std::memcpy(window + carryLen, chunk, take);
+        addr_size windowLen = carryLen + take;
+
+        ByteView view = { window, windowLen };
+        addr_size pos = 0;
+        while (pos < carryLen) {
+            if (windowLen - pos < MAX_INSTRUCTION_SIZE && take == len) {
+                // The whole chunk fit in the window and still might not complete the instruction.
+                decoder.carryLen = windowLen - pos;
+                std::memcpy(decoder.carry, window + pos, decoder.carryLen);
+                return;
+            }
+            emitStreamInstruction(decoder, view, pos);
+        }
+        decoder.carryLen = 0;
+        chunkPos = pos - carryLen;
+    }
+
+    ByteView view = { chunk, len };
+    while (len - chunkPos >= MAX_INSTRUCTION_SIZE) {
+        emitStreamInstruction(decoder, view, chunkPos);
+    }
+
+    decoder.carryLen = len - chunkPos;
+    if (decoder.carryLen > 0) std::memcpy(decoder.carry, chunk + chunkPos, decoder.carryLen);
+}
+
+void streamDecodeFinish(StreamDecoder& decoder) {
+    ByteView view = { decoder.carry, decoder.carryLen };
+    addr_size pos = 0;
+    while (pos < decoder.carryLen) {
+        emitStreamInstruction(decoder, view, pos);
+    }
+    decoder.carryLen = 0;
+}
+
+namespace {
+
+// A path of instructions through one segment of a parallel decode, starting at one of the first bytes of the segment.
+struct SegmentPath {
+    core::Arr<Instruction> instructions;
+    addr_size joinPath = 0; // The path this one continues with, always one decoded before it.
+    i32 joinIdx = -1; // Index of the instruction of joinPath this path continues with, or -1 when it does not join one.
+    addr_size exit = 0; // Offset of the first instruction after the segment, when the path does not join another.
+    bool valid = true; // False when the path runs into bytes that are not a supported instruction before it joins.
+};
+
+// An instruction from the segment before can extend up to MAX_INSTRUCTION_SIZE - 1 bytes into this one, so the segment
+// is decoded from each of its first bytes. Instruction streams synchronize quickly, so every path after the first that
+// decodes usually runs into the start of an instruction of an earlier path after a few instructions and joins it there.
+struct DecodeSegment {
+    ByteView bytes = {};
+    addr_size begin = 0;
+    addr_size end = 0;
+    addr_size pathCount = 0;
+    SegmentPath paths[MAX_INSTRUCTION_SIZE];
+    core::Arr<u8> pathAt; // For each byte of the segment, the path with an instruction starting there plus one, or 0.
+    core::Arr<i32> instIdxAt; // For each byte of the segment, the index of that instruction in its path.
+};
+
+void decodeSegment(const ByteView& bytes, DecodeSegment& seg) {
+    for (addr_size i = seg.begin; i < seg.end; i++) {
+        seg.pathAt.append(0);
+        seg.instIdxAt.append(-1);
+    }
+
+    for (addr_size j = 0; j < seg.pathCount; j++) {
+        SegmentPath& path = seg.paths[j];
+        addr_size pos = seg.begin + j;
+        while (pos < seg.end) {
+            addr_size byteIdx = pos - seg.begin;
+            if (seg.pathAt[byteIdx] != 0) {
+                path.joinPath = addr_size(seg.pathAt[byteIdx] - 1);
+                path.joinIdx = seg.instIdxAt[byteIdx];
+                break;
+            }
+            Instruction inst;
+            if (!tryDecodeInstruction(bytes, pos, inst)) {
+                path.valid = false;
+                break;
+            }
+            seg.pathAt[byteIdx] = u8(j + 1);
+            seg.instIdxAt[byteIdx] = i32(path.instructions.len());
+            path.instructions.append(inst);
+            pos += inst.byteCount;
+        }
+        path.exit = pos;
+    }
+}
+
+void decodeSegmentJob(void* userData) {
+    DecodeSegment& seg = *reinterpret_cast<DecodeSegment*>(userData);
+    decodeSegment(seg.bytes, seg);
+}
+
+} // namespace
+
+void decodeAsm8086Parallel(const u8* bytes, addr_size len, DecodingContext& ctx, ThreadPool& pool) {
+    addr_size start = ctx.idx;
+    if (start >= len || len - start < PARALLEL_DECODE_MIN_SIZE || pool.threadCount() < 2) {
+        decodeAsm8086(bytes, len, ctx);
+        return;
+    }
+
+    // A few segments per worker keep the workers busy when some segments decode slower than others.
+    addr_size segmentCount = addr_size(pool.threadCount()) * 4;
+    addr_size segmentLen = (len - start + segmentCount - 1) / segmentCount;
+    segmentLen = core::core_max(segmentLen, PARALLEL_DECODE_MIN_SIZE / 4);
+    segmentCount = (len - start + segmentLen - 1) / segmentLen;
+
+    ByteView view = { bytes, len };
+    core::Arr<DecodeSegment> segments;
+    for (addr_size i = 0; i < segmentCount; i++) segments.append(DecodeSegment{});
+    for (addr_size i = 0; i < segmentCount; i++) {
+        DecodeSegment& seg = segments[i];
+        seg.bytes = view;
+        seg.begin = start + i * segmentLen;
+        seg.end = core::core_min(seg.begin + segmentLen, len);
+        // The first segment starts where the decoding starts, so only the path from its first byte is needed.
+        seg.pathCount = i == 0 ? 1 : MAX_INSTRUCTION_SIZE;
+        pool.submit(decodeSegmentJob, &seg);
+    }
+    pool.wait();
+
+    // Follow the true path from segment to segment. Each segment is entered where the previous one left off.
+    addr_size firstNew = ctx.instructions.len();
+    addr_size entry = start;
+    bool synchronized = true;
+    for (addr_size i = 0; i < segmentCount; i++) {
+        DecodeSegment& seg = segments[i];
+        addr_size pathIdx = entry - seg.begin;
+        Assert(pathIdx < seg.pathCount, "[BUG] An instruction extends further into the next segment than possible.");
+
+        // Find where the chain of joined paths ends before taking any of its instructions.
+        const SegmentPath* last = &seg.paths[pathIdx];
+        while (last->joinIdx >= 0) last = &seg.paths[last->joinPath];
+        if (!last->valid) {
+            synchronized = false;
+            break;
+        }
+
+        const SegmentPath* path = &seg.paths[pathIdx];
+        addr_size from = 0;
+        while (true) {
+            for (addr_size j = from; j < path->instructions.len(); j++) {
+                ctx.instructions.append(path->instructions[j]);
+            }
+            if (path->joinIdx < 0) break;
+            from = addr_size(path->joinIdx);
+            path = &seg.paths[path->joinPath];
+        }
+        entry = path->exit;
+    }
+
+    if (!synchronized) {
+        // The input holds bytes that do not decode. Continue sequentially, which reports them like decodeAsm8086 does.
+        while (entry < len) {
+            Instruction inst = decodeInstruction(view, addr_off(entry));
+            entry += inst.byteCount;
+            ctx.instructions.append(inst);
+        }
+    }
+
+    appendJmpLabels(ctx, firstNew, start, entry);
+    ctx.idx = entry;
 }
 
 void encodeAsm8086(core::StrBuilder<>& asmOut, const DecodingContext& ctx) {
     asmOut.append("bits 16\n\n");
+    JmpLabelIndex labels = buildJmpLabelIndex(ctx.jmpLabels, ctx.idx);
     addr_size byteIdx = 0;
     for (addr_size i = 0; i <= ctx.instructions.len(); i++) {
         // Insert the label before the instruction.
         {
-            i64 jmpidx = core::find(ctx.jmpLabels, [&](auto& el, addr_off) -> bool {
-                return el.byteOffset == addr_off(byteIdx);
-            });
-            if (jmpidx != -1) {
+            addr_off labelIdx = labels.labelAt(addr_off(byteIdx));
+            if (labelIdx != -1) {
                 asmOut.append("label_");
-                appendU16toSb(asmOut, u16(ctx.jmpLabels[addr_size(jmpidx)].labelIdx));
+                appendU16toSb(asmOut, u16(labelIdx));
                 asmOut.append(":");
                 if (i != ctx.instructions.len()) {
                     // Don't want any empty lines at the end of the file. Ever.
@@ -64,7 +426,7 @@ void encodeAsm8086(core::StrBuilder<>& asmOut, const DecodingContext& ctx) {
         }
         auto inst = ctx.instructions[i];
         byteIdx += inst.byteCount; // Intentionally increase the size before encoding.
-        encodeInstruction(asmOut, ctx, inst, byteIdx);
+        encodeInstruction(asmOut, ctx, labels, inst, byteIdx);
         asmOut.append("\n");
     }
 }
@@ -252,7 +614,63 @@ void encodeBasicInstruction(core::StrBuilder<>& sb, const Instruction& inst, Dec
 
 namespace {
 
-Instruction decodeInstruction(core::Arr<u8>& bytes, DecodingContext& ctx) {
+addr_off shortJmpTarget(const Instruction& inst, addr_off idx) {
+    addr_off diff = 0;
+    i8 shortJmpDiff = i8(inst.data[0]);
+    safeCastSignedInt(shortJmpDiff, diff);
+    return addr_off(idx) + addr_off(inst.byteCount) + addr_off(diff);
+}
+
+// Appends a label for each short jump target of the instructions from firstNew on, which cover the bytes from start to
+// end. Labels are numbered in instruction order and each offset gets one label. Short jump targets lie within 256 bytes
+// of the decoded range, so a flag per offset replaces searching the labels for an existing one.
+void appendJmpLabels(DecodingContext& ctx, addr_size firstNew, addr_size start, addr_size end) {
+    if (firstNew == ctx.instructions.len()) return;
+
+    constexpr addr_off labelMargin = 256;
+    addr_off labelBase = addr_off(start) - labelMargin;
+    core::Arr<u8> hasLabel;
+    for (addr_size i = 0; i < end - start + 2 * addr_size(labelMargin); i++) hasLabel.append(0);
+    auto labelSlot = [&](addr_off byteOffset) -> i64 {
+        addr_off slot = byteOffset - labelBase;
+        return slot >= 0 && addr_size(slot) < hasLabel.len() ? slot : -1;
+    };
+    for (addr_size i = 0; i < ctx.jmpLabels.len(); i++) {
+        i64 slot = labelSlot(ctx.jmpLabels[i].byteOffset);
+        if (slot >= 0) hasLabel[addr_size(slot)] = 1;
+    }
+
+    addr_size offset = start;
+    for (addr_size i = firstNew; i < ctx.instructions.len(); i++) {
+        const Instruction& inst = ctx.instructions[i];
+        if (inst.operands == Operands::ShortLabel) {
+            addr_off target = shortJmpTarget(inst, addr_off(offset));
+            i64 slot = labelSlot(target);
+            Assert(slot >= 0, "[BUG] Short jump target outside of the label table.");
+            if (!hasLabel[addr_size(slot)]) {
+                hasLabel[addr_size(slot)] = 1;
+                ctx.jmpLabels.append({ target, addr_off(ctx.jmpLabels.len()) });
+            }
+        }
+        offset += inst.byteCount;
+    }
+}
+
+JmpLabelIndex buildJmpLabelIndex(const core::Arr<JmpLabel>& labels, addr_size end) {
+    constexpr addr_off labelMargin = 256;
+    JmpLabelIndex index;
+    index.base = -labelMargin;
+    for (addr_size i = 0; i < end + 2 * addr_size(labelMargin); i++) index.labelIdxBySlot.append(-1);
+    for (addr_size i = 0; i < labels.len(); i++) {
+        addr_off slot = labels[i].byteOffset - index.base;
+        if (slot < 0 || addr_size(slot) >= index.labelIdxBySlot.len()) continue;
+        // The first label of an offset wins, as searching the labels in order would find it.
+        if (index.labelIdxBySlot[addr_size(slot)] == -1) index.labelIdxBySlot[addr_size(slot)] = labels[i].labelIdx;
+    }
+    return index;
+}
+
+Instruction decodeInstruction(const ByteView& bytes, addr_off offset) {
     auto decodeFromDisplacements = [](auto& _bytes, addr_off idx, const FieldDisplacements& fd, Instruction& inst) {
         i8 ibc = 0;
         if (fd.d.byteIdx >= 0) {
@@ -268,30 +686,23 @@ Instruction decodeInstruction(core::Arr<u8>& bytes, DecodingContext& ctx) {
             inst.w = (_bytes[addr_size(idx + ibc)] & fd.w.mask) >> fd.w.offset;
         }
         if (fd.mod.byteIdx >= 0) {
-            ibc = core::core_max(ibc, fd.mod.byteIdx);
-            inst.mod = Mod((_bytes[addr_size(idx + ibc)] & fd.mod.mask) >> fd.mod.offset);
+            // Every opcode with a ModR/M byte has it right after the first byte, followed by the displacement.
+            const ModRM& modrm = decodeModRM(_bytes[addr_size(idx + 1)]);
+            ibc = 1;
+            inst.mod = modrm.mod;
+            inst.reg = modrm.reg;
+            inst.rm = modrm.rm;
+            for (u8 i = 0; i < modrm.dispByteCount; i++) {
+                inst.disp[i] = _bytes[addr_size(idx + ibc + 1)];
+                ibc++;
+            }
         }
         else {
             inst.mod = Mod::NONE_SENTINEL;
-        }
-        if (fd.reg.byteIdx >= 0) {
-            ibc = core::core_max(ibc, fd.reg.byteIdx);
-            inst.reg = (_bytes[addr_size(idx + ibc)] & fd.reg.mask) >> fd.reg.offset;
-        }
-        if (fd.rm.byteIdx >= 0) {
-            ibc = core::core_max(ibc, fd.rm.byteIdx);
-            inst.rm = (_bytes[addr_size(idx + ibc)] & fd.rm.mask) >> fd.rm.offset;
-        }
-
-        // Displacement byte(s) decoding.
-        if (fd.disp1.byteIdx > 0 && is8bitDisplacement(inst.mod)) {
-            inst.disp[0] = _bytes[addr_size(idx + ibc) + 1];
-            ibc++;
-        }
-        else if (fd.disp1.byteIdx > 0 && (is16bitDisplacement(inst.mod) || isDirectAddrMode(inst.mod, inst.rm))) {
-            inst.disp[0] = _bytes[addr_size(idx + ibc + 1)];
-            inst.disp[1] = _bytes[addr_size(idx + ibc + 2)];
-            ibc += 2;
+            if (fd.reg.byteIdx >= 0) {
+                ibc = core::core_max(ibc, fd.reg.byteIdx);
+                inst.reg = (_bytes[addr_size(idx + ibc)] & fd.reg.mask) >> fd.reg.offset;
+            }
         }
 
         bool dataIsWord = false;
@@ -317,216 +728,71 @@ Instruction decodeInstruction(core::Arr<u8>& bytes, DecodingContext& ctx) {
         inst.byteCount += u8(ibc + 1);
     };
 
-    auto storeShortJmpLabel = [](core::Arr<JmpLabel>& jmpLabels, const Instruction &inst, addr_off idx) {
-        addr_off diff = 0;
-        i8 shortJmpDiff = i8(inst.data[0]);
-        safeCastSignedInt(shortJmpDiff, diff);
-        addr_off byteOff = addr_off(idx) + addr_off(inst.byteCount) + addr_off(diff);
-        JmpLabel jmpLabel = { byteOff, addr_off(jmpLabels.len()) };
-        core::appendUnique(jmpLabels, jmpLabel, [](JmpLabel& x, addr_off, const JmpLabel& el) -> bool {
-            return x.byteOffset == el.byteOffset;
-        });
-    };
-
-    auto& jmpLabels = ctx.jmpLabels;
-
-    addr_off idx = addr_off(ctx.idx);
-    Opcode opcode = opcodeDecode(bytes[addr_size(idx)]);
-    auto fd = getFieldDisplacements(opcode);
+    addr_off idx = offset;
+    const InstEncoding& encoding = INST_ENCODINGS.byFirstByte[bytes[addr_size(idx)]];
+    Panic(encoding.supported, "Opcode unsupported or invalid");
 
     Instruction inst = {};
-    inst.opcode = opcode;
-    decodeFromDisplacements(bytes, idx, fd, inst);
+    inst.opcode = encoding.opcode;
+    decodeFromDisplacements(bytes, idx, encoding.fields, inst);
+
+    inst.type = encoding.type;
+    if (encoding.opcode == IMM_TO_FROM_REG_OR_MEM) {
+        // The type of instruction is deduced by the reg field in this lovely case.
+        inst.type = immediateGroupType(inst.reg);
+        Panic(inst.type != InstType::UNKNOWN, "[BUG] Failed to set instruction type");
+    }
 
-    switch (inst.opcode) {
-        case MOV_IMM_TO_REG:
+    switch (encoding.operandsRule) {
+        case OperandsRule::Fixed:
+            inst.operands = encoding.operands;
+            break;
+        case OperandsRule::ImmToReg:
             inst.operands = Operands::Register_Immediate;
             inst.rm = inst.reg;
-            inst.type = InstType::MOV;
             break;
-        case MOV_REG_OR_MEM_TO_OR_FROM_REG:
+        case OperandsRule::RegOrMemWithReg:
             if (isRegToReg(inst.mod)) inst.operands = Operands::Register_Register;
             else inst.operands = inst.d ? Operands::Memory_Register : Operands::Register_Memory;
-            inst.type = InstType::MOV;
-            break;
-        case MOV_MEM_TO_ACC:
-            inst.operands = Operands::Memory_Accumulator;
-            inst.type = InstType::MOV;
             break;
-        case MOV_ACC_TO_MEM:
-            inst.operands = Operands::Accumulator_Memory;
-            inst.type = InstType::MOV;
-            break;
-        case MOV_IMM_TO_REG_OR_MEM:
+        case OperandsRule::ImmToRegOrMem:
             inst.operands = isEffectiveAddrCalc(inst.mod) ? Operands::Memory_Immediate : Operands::Register_Immediate;
-            inst.type = InstType::MOV;
             break;
-        case MOV_REG_OR_MEMORY_TO_SEGMENT_REG:
+        case OperandsRule::ToSegReg:
             inst.operands = isRegToReg(inst.mod) ? Operands::Register16_SegReg : Operands::Memory_SegReg;
-            inst.type = InstType::MOV;
-            break;
-        case MOV_SEGMENT_REG_TO_REG_OR_MEMORY:
-            inst.operands = isRegToReg(inst.mod)  ? Operands::SegReg_Register16 : Operands::SegReg_Memory16;
-            inst.type = InstType::MOV;
-            break;
-
-        case IMM_TO_FROM_REG_OR_MEM:
-        {
-            // The type of instruction is deduced by the reg field in this lovely case.
-            switch (inst.reg) {
-                case 0b000:
-                    inst.operands = isEffectiveAddrCalc(inst.mod) ? Operands::Memory_Immediate : Operands::Register_Immediate;
-                    inst.type = InstType::ADD;
-                    break;
-                case 0b101:
-                    inst.operands = isEffectiveAddrCalc(inst.mod) ? Operands::Memory_Immediate : Operands::Register_Immediate;
-                    inst.type = InstType::SUB;
-                    break;
-                case 0b111:
-                    inst.operands = isEffectiveAddrCalc(inst.mod) ? Operands::Memory_Immediate : Operands::Register_Immediate;
-                    inst.type = InstType::CMP;
-                    break;
-                default:
-                    Panic(false, "[BUG] Failed to set instruction type");
-            }
-            break;
-        }
-
-        case ADD_REG_OR_MEM_WITH_REG_TO_EDIT:
-            if (isRegToReg(inst.mod)) inst.operands = Operands::Register_Register;
-            else inst.operands = inst.d ? Operands::Memory_Register : Operands::Register_Memory;
-            inst.type = InstType::ADD;
             break;
-        case ADD_IMM_TO_ACC:
-            inst.operands = Operands::Accumulator_Immediate;
-            inst.type = InstType::ADD;
+        case OperandsRule::FromSegReg:
+            inst.operands = isRegToReg(inst.mod) ? Operands::SegReg_Register16 : Operands::SegReg_Memory16;
             break;
+    }
 
-        case SUB_REG_OR_MEM_WITH_REG_TO_EDIT:
-            if (isRegToReg(inst.mod)) inst.operands = Operands::Register_Register;
-            else inst.operands = inst.d ? Operands::Memory_Register : Operands::Register_Memory;
-            inst.type = InstType::SUB;
-            break;
-        case SUB_IMM_FROM_ACC:
-            inst.operands = Operands::Accumulator_Immediate;
-            inst.type = InstType::SUB;
-            break;
+    Assert(inst.type != InstType::UNKNOWN, "Instruction unsupported yet.");
 
-        case CMP_REG_OR_MEM_WITH_REG:
-            if (isRegToReg(inst.mod)) inst.operands = Operands::Register_Register;
-            else inst.operands = inst.d ? Operands::Memory_Register : Operands::Register_Memory;
-            inst.type = InstType::CMP;
-            break;
-        case CMP_IMM_WITH_ACC:
-            inst.operands = Operands::Accumulator_Immediate;
-            inst.type = InstType::CMP;
-            break;
+    return inst;
+}
 
-        case JE_JZ_ON_EQ_ZERO:
-            inst.type = InstType::JE;
-            inst.operands = Operands::ShortLabel;
-            storeShortJmpLabel(jmpLabels, inst, idx);
-            break;
-        case JL_JNGE_ON_LESS_NOT_GE_OR_EQ:
-            inst.type = InstType::JL;
-            inst.operands = Operands::ShortLabel;
-            storeShortJmpLabel(jmpLabels, inst, idx);
-            break;
-        case JLE_JNG_ON_LESS_OR_EQ_NOT_GE:
-            inst.type = InstType::JLE;
-            inst.operands = Operands::ShortLabel;
-            storeShortJmpLabel(jmpLabels, inst, idx);
-            break;
-        case JB_JNAE_ON_BELOW_NOT_ABOVE_OR_EQ:
-            inst.type = InstType::JB;
-            inst.operands = Operands::ShortLabel;
-            storeShortJmpLabel(jmpLabels, inst, idx);
-            break;
-        case JBE_JNA_ON_BELOW_OR_EQ_NOT_ABOVE:
-            inst.type = InstType::JBE;
-            inst.operands = Operands::ShortLabel;
-            storeShortJmpLabel(jmpLabels, inst, idx);
-            break;
-        case JP_JPE_ON_PARITY_EVEN:
-            inst.type = InstType::JP;
-            inst.operands = Operands::ShortLabel;
-            storeShortJmpLabel(jmpLabels, inst, idx);
-            break;
-        case JO_ON_OVERFLOW:
-            inst.type = InstType::JO;
-            inst.operands = Operands::ShortLabel;
-            storeShortJmpLabel(jmpLabels, inst, idx);
-            break;
-        case JS_ON_SIGN:
-            inst.type = InstType::JS;
-            inst.operands = Operands::ShortLabel;
-            storeShortJmpLabel(jmpLabels, inst, idx);
-            break;
-        case JNE_JNZ_ON_NOT_EQ_NOR_ZERO:
-            inst.type = InstType::JNE;
-            inst.operands = Operands::ShortLabel;
-            storeShortJmpLabel(jmpLabels, inst, idx);
-            break;
-        case JNL_JGE_ON_NOT_LESS_GE_OR_EQ:
-            inst.type = InstType::JNL;
-            inst.operands = Operands::ShortLabel;
-            storeShortJmpLabel(jmpLabels, inst, idx);
-            break;
-        case JNLE_JG_ON_NOT_LESS_OR_EQ_GE:
-            inst.type = InstType::JNLE;
-            inst.operands = Operands::ShortLabel;
-            storeShortJmpLabel(jmpLabels, inst, idx);
-            break;
-        case JNB_JAE_ON_NOT_BELOW_ABOVE_OR_EQ:
-            inst.type = InstType::JNB;
-            inst.operands = Operands::ShortLabel;
-            storeShortJmpLabel(jmpLabels, inst, idx);
-            break;
-        case JNBE_JA_ON_NOT_BELOW_OR_EQ_ABOVE:
-            inst.type = InstType::JNBE;
-            inst.operands = Operands::ShortLabel;
-            storeShortJmpLabel(jmpLabels, inst, idx);
-            break;
-        case JNP_JPO_ON_NOT_PAR_PAR_ODD:
-            inst.type = InstType::JNP;
-            inst.operands = Operands::ShortLabel;
-            storeShortJmpLabel(jmpLabels, inst, idx);
-            break;
-        case JNO_ON_NOT_OVERFLOW:
-            inst.type = InstType::JNO;
-            inst.operands = Operands::ShortLabel;
-            storeShortJmpLabel(jmpLabels, inst, idx);
-            break;
-        case JNS_ON_NOT_SIGN:
-            inst.type = InstType::JNS;
-            inst.operands = Operands::ShortLabel;
-            storeShortJmpLabel(jmpLabels, inst, idx);
-            break;
-        case LOOP_CX_TIMES:
-            inst.type = InstType::LOOP;
-            inst.operands = Operands::ShortLabel;
-            storeShortJmpLabel(jmpLabels, inst, idx);
-            break;
-        case LOOPZ_LOOPE_WHILE_ZERO_EQ:
-            inst.type = InstType::LOOPE;
-            inst.operands = Operands::ShortLabel;
-            storeShortJmpLabel(jmpLabels, inst, idx);
-            break;
-        case LOOPNZ_LOOPNE_WHILE_NOT_ZERO_EQ:
-            inst.type = InstType::LOOPNE;
-            inst.operands = Operands::ShortLabel;
-            storeShortJmpLabel(jmpLabels, inst, idx);
-            break;
-        case JCXZ_ON_CX_ZERO:
-            inst.type = InstType::JCXZ;
-            inst.operands = Operands::ShortLabel;
-            storeShortJmpLabel(jmpLabels, inst, idx);
-            break;
+bool tryDecodeInstruction(const ByteView& bytes, addr_size idx, Instruction& out) {
+    const InstEncoding& encoding = INST_ENCODINGS.byFirstByte[bytes.data[idx]];
+    if (!encoding.supported) return false;
+    if (encoding.opcode == IMM_TO_FROM_REG_OR_MEM) {
+        // Only add, sub and cmp are supported in this group.
+        if (idx + 1 >= bytes.len) return false;
+        u8 reg = (bytes.data[idx + 1] >> 3) & 0b111;
+        if (immediateGroupType(reg) == InstType::UNKNOWN) return false;
     }
 
-    Assert(inst.type != InstType::UNKNOWN, "Instruction unsupported yet.");
+    if (idx + MAX_INSTRUCTION_SIZE <= bytes.len) {
+        out = decodeInstruction(bytes, addr_off(idx));
+        return true;
+    }
 
-    return inst;
+    // Near the end the instruction may be cut off. Decode it from a zero padded copy and check that it fits.
+    u8 padded[MAX_INSTRUCTION_SIZE] = {};
+    addr_size available = bytes.len - idx;
+    std::memcpy(padded, bytes.data + idx, available);
+    ByteView view = { padded, MAX_INSTRUCTION_SIZE };
+    out = decodeInstruction(view, 0);
+    return out.byteCount <= available;
 }
 
 void appendU16toSb(core::StrBuilder<>& sb, u16 i) {
@@ -610,6 +876,7 @@ void appendMemory(core::StrBuilder<>& sb, DecodingOpts decodingOpts,
 
 void encodeInstruction(core::StrBuilder<>& sb,
                        const DecodingContext& ctx,
+                       const JmpLabelIndex& labels,
                        const Instruction& inst,
                        addr_size byteIdx) {
     auto appendShortLabel = [&]() {
@@ -617,16 +884,15 @@ void encodeInstruction(core::StrBuilder<>& sb,
         sb.append(" ");
 
         u8 dataLow = inst.data[0];
-        auto& jmpLabels = ctx.jmpLabels;
         i8 shotJmpOffset = i8(dataLow);
         addr_off byteOff = addr_off(byteIdx) + shotJmpOffset;
-        i64 jmpidx = core::find(jmpLabels, [&](auto& el, addr_off) -> bool { return el.byteOffset == byteOff; });
-        if (jmpidx == -1) {
+        addr_off labelIdx = labels.labelAt(byteOff);
+        if (labelIdx == -1) {
             sb.append("(failed to decode label)");
         }
         else {
             sb.append("label_");
-            appendU16toSb(sb, u16(jmpLabels[addr_size(jmpidx)].labelIdx));
+            appendU16toSb(sb, u16(labelIdx));
         }
     };
 
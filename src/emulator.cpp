@@ -1,8 +1,20 @@
 #include <emulator.h>
+#include <jit.h>
 #include <decoder.h>
 #include <utils.h>
 #include <logger.h>
 
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__linux__) || defined(__APPLE__)
+    #define EMULATOR_MMAP_MEMORY 1
+    #include <sys/mman.h>
+#else
+    #define EMULATOR_MMAP_MEMORY 0
+#endif
+
 namespace asm8086 {
 
 const char* regTypeToCptr(const RegisterType& rtype) {
@@ -37,26 +49,234 @@ char* flagsToCptr(Flags f, char* buffer) {
     return buffer;
 }
 
+ExecInst toExecInst(const Instruction& inst, u16 ip) {
+    ExecInst exec = {};
+    exec.type = inst.type;
+    exec.operands = inst.operands;
+    exec.byteCount = inst.byteCount;
+    exec.isWord = inst.w == 1;
+    exec.reg = inst.reg;
+    exec.rm = inst.rm;
+    exec.addrForm = AddrForm::REGISTER;
+    // The s bit marks a single data byte that is sign extended to the word operand.
+    exec.imm = inst.s ? u16(i16(i8(inst.data[0]))) : combineWord(inst.data[0], inst.data[1]);
+
+    if (inst.operands == Operands::Memory_Accumulator || inst.operands == Operands::Accumulator_Memory) {
+        // The accumulator forms have no ModR/M byte and carry the address in the data bytes.
+        exec.addrForm = AddrForm::DIRECT;
+        exec.disp = i16(combineWord(inst.data[0], inst.data[1]));
+    }
+    else if (inst.mod != Mod::NONE_SENTINEL) {
+        const ModRM& modrm = decodeModRM(inst.mod, inst.rm);
+        exec.addrForm = modrm.addrForm;
+        if (modrm.dispByteCount == 1) exec.disp = i8(inst.disp[0]);
+        else if (modrm.dispByteCount == 2) exec.disp = i16(combineWord(inst.disp[0], inst.disp[1]));
+    }
+
+    exec.targetIdx = -1;
+    if (inst.operands == Operands::ShortLabel) {
+        exec.jumpIp = u16(ip + inst.byteCount + i8(inst.data[0]));
+        exec.cond = u8(inst.opcode & 0x0F);
+    }
+    return exec;
+}
+
 namespace {
 
-u8 g_memory[EMULATOR_MEMORY_SIZE];
+#if EMULATOR_MMAP_MEMORY
+
+// Anonymous mappings are zero filled by the kernel on first touch, so creating a context costs no more than the pages the
+// program actually uses.
+u8* mappedAlloc(addr_size size, void*) {
+    void* mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) return nullptr;
+    return reinterpret_cast<u8*>(mem);
+}
+
+void mappedFree(u8* memory, addr_size size, void*) {
+    munmap(memory, size);
+}
+
+#else
+
+u8* heapAlloc(addr_size size, void*) {
+    return reinterpret_cast<u8*>(std::calloc(size, 1));
+}
+
+void heapFree(u8* memory, addr_size, void*) {
+    std::free(memory);
+}
+
+#endif
+
+void resetDecodedCode(EmulationContext& ctx) {
+    ctx.instructions.clear();
+    ctx.decodedInstructions.clear();
+    ctx.instIdxByIp.clear();
+    ctx.handlers.clear();
+    ctx.fusedHandlers.clear();
+    ctx.linkedJumps.clear();
+    ctx.blocks.clear();
+    ctx.blockIdxByIp.clear();
+    core::memset(ctx.codePages, 0, sizeof(ctx.codePages));
+    core::memset(ctx.codeBytes, 0, sizeof(ctx.codeBytes));
+    ctx.codeModified = false;
+    ctx.staleInstructions = 0;
+    ctx.decodedCodeResets++;
+    ctx.jitCode.used = 0;
+}
+
+constexpr inline void recordLazyFlags(LazyFlags& lazyFlags, LazyFlagsOp op, bool isWord, u16 dst, u16 src, u16 result) {
+    lazyFlags.op = op;
+    lazyFlags.isWord = isWord;
+    lazyFlags.dst = dst;
+    lazyFlags.src = src;
+    lazyFlags.result = result;
+}
+
+template <addr_size N>
+struct FlagsTable {
+    u16 entries[N];
+};
+
+// SF, ZF and PF of every byte result.
+constexpr FlagsTable<256> makeSignZeroParityTable() {
+    FlagsTable<256> table = {};
+    for (u32 b = 0; b < 256; b++) {
+        u32 setBits = 0;
+        for (u32 bit = 0; bit < 8; bit++) setBits += (b >> bit) & 1;
+        u16 flags = CPU_FLAG_NONE;
+        if (b & 0x80)           flags |= CPU_FLAG_SIGN_FLAG;
+        if (b == 0)             flags |= CPU_FLAG_ZERO_FLAG;
+        if ((setBits & 1) == 0) flags |= CPU_FLAG_PARITY_FLAG;
+        table.entries[b] = u16(flags);
+    }
+    return table;
+}
+
+// CF, OF and AF of an add or sub depend only on the sign bits of the destination, source and result and on the carry
+// into bit 4, which is bit 4 of dst ^ src ^ result. See carryTableIndex for the layout of the index.
+constexpr FlagsTable<32> makeCarryOverflowAuxTable() {
+    FlagsTable<32> table = {};
+    for (u32 i = 0; i < 32; i++) {
+        bool resultSign = i & 0x01;
+        bool srcSign = i & 0x02;
+        bool dstSign = i & 0x04;
+        bool auxCarry = i & 0x08;
+        bool isSub = i & 0x10;
+        bool carry, overflow;
+        if (isSub) {
+            carry = (!dstSign && srcSign) || ((!dstSign || srcSign) && resultSign);
+            overflow = dstSign != srcSign && dstSign != resultSign;
+        }
+        else {
+            carry = (dstSign && srcSign) || ((dstSign || srcSign) && !resultSign);
+            overflow = dstSign == srcSign && dstSign != resultSign;
+        }
+        u16 flags = CPU_FLAG_NONE;
+        if (carry)    flags |= CPU_FLAG_CARRY_FLAG;
+        if (overflow) flags |= CPU_FLAG_OVERFLOW_FLAG;
+        if (auxCarry) flags |= CPU_FLAG_AUX_CARRY_FLAG;
+        table.entries[i] = u16(flags);
+    }
+    return table;
+}
+
+constexpr FlagsTable<256> SIGN_ZERO_PARITY_FLAGS = makeSignZeroParityTable();
+constexpr FlagsTable<32> CARRY_OVERFLOW_AUX_FLAGS = makeCarryOverflowAuxTable();
+
+static_assert(SIGN_ZERO_PARITY_FLAGS.entries[0] == (CPU_FLAG_ZERO_FLAG | CPU_FLAG_PARITY_FLAG));
+static_assert(SIGN_ZERO_PARITY_FLAGS.entries[0x81] == (CPU_FLAG_SIGN_FLAG | CPU_FLAG_PARITY_FLAG));
+
+constexpr u32 carryTableIndex(const LazyFlags& lazyFlags) {
+    u32 signShift = lazyFlags.isWord ? 15 : 7;
+    u32 dst = lazyFlags.dst, src = lazyFlags.src, result = lazyFlags.result;
+    u32 index = ((result >> signShift) & 1) |
+                (((src >> signShift) & 1) << 1) |
+                (((dst >> signShift) & 1) << 2) |
+                (((dst ^ src ^ result) & 0x10) >> 1);
+    if (lazyFlags.op == LazyFlagsOp::Sub) index |= 0x10;
+    return index;
+}
 
 } // namespace
 
-EmulationContext createEmulationCtx(core::Arr<Instruction>&& instructions, EmulationOpts options) {
+u16 computeArithmeticFlags(const LazyFlags& lazyFlags) {
+    u16 flags = SIGN_ZERO_PARITY_FLAGS.entries[lazyFlags.result & 0xFF];
+    if (lazyFlags.isWord) {
+        // PF only looks at the low byte, SF and ZF look at the whole word.
+        flags &= CPU_FLAG_PARITY_FLAG;
+        if (lazyFlags.result & 0x8000) flags |= CPU_FLAG_SIGN_FLAG;
+        if (lazyFlags.result == 0)     flags |= CPU_FLAG_ZERO_FLAG;
+    }
+    return u16(flags | CARRY_OVERFLOW_AUX_FLAGS.entries[carryTableIndex(lazyFlags)]);
+}
+
+EmulatorMemoryAllocator defaultMemoryAllocator() {
+#if EMULATOR_MMAP_MEMORY
+    return { mappedAlloc, mappedFree, nullptr };
+#else
+    return { heapAlloc, heapFree, nullptr };
+#endif
+}
+
+EmulatorMemory::EmulatorMemory(EmulatorMemory&& other) : data(other.data), size(other.size), allocator(other.allocator) {
+    other.data = nullptr;
+    other.size = 0;
+}
+
+EmulatorMemory& EmulatorMemory::operator=(EmulatorMemory&& other) {
+    if (this != &other) {
+        this->~EmulatorMemory();
+        data = other.data;
+        size = other.size;
+        allocator = other.allocator;
+        other.data = nullptr;
+        other.size = 0;
+    }
+    return *this;
+}
+
+EmulatorMemory::~EmulatorMemory() {
+    if (data) allocator.free(data, size, allocator.userData);
+    data = nullptr;
+}
+
+EmulationContext createEmulationCtx(const u8* code, addr_size codeSize, EmulationOpts options, u16 loadBase,
+                                    const EmulatorMemoryAllocator& allocator) {
     EmulationContext ctx;
-    ctx.instructions = core::move(instructions);
     ctx.emuOpts = options;
-    ctx.memory = g_memory;
-    core::memset(ctx.memory, 0, EMULATOR_MEMORY_SIZE);
+    ctx.ownedMemory.data = allocator.alloc(EMULATOR_MEMORY_SIZE, allocator.userData);
+    Panic(ctx.ownedMemory.data != nullptr, "Failed to allocate the emulator memory.");
+    ctx.ownedMemory.size = EMULATOR_MEMORY_SIZE;
+    ctx.ownedMemory.allocator = allocator;
+    ctx.memory = ctx.ownedMemory.data;
     for (addr_size i = 0; i < addr_size(RegisterType::SENTINEL); i++) {
-        auto& reg = ctx.registers[i];
-        reg.type = RegisterType(i);
-        reg.value = 0;
+        ctx.registers[i].value = 0;
     }
+    loadProgram(ctx, code, codeSize, loadBase);
     return ctx;
 }
 
+void loadProgram(EmulationContext& ctx, const u8* code, addr_size codeSize, u16 loadBase) {
+    // Without segment support the code has to be reachable by the 16 bit instruction pointer.
+    Panic(addr_size(loadBase) + codeSize <= 0x10000, "The program does not fit in the 64KB code segment.");
+
+    for (addr_size i = 0; i < codeSize; i++) {
+        ctx.memory[addr_size(loadBase) + i] = code[i];
+    }
+    ctx.codeStart = loadBase;
+    ctx.codeEnd = addr_size(loadBase) + codeSize;
+    for (addr_size page = ctx.codeStart / MEMORY_PAGE_SIZE; page * MEMORY_PAGE_SIZE < ctx.codeEnd; page++) {
+        ctx.dirtyPages[page] = 1;
+    }
+
+    resetDecodedCode(ctx);
+
+    ctx.registers[i32(RegisterType::IP)].value = loadBase;
+    ctx.initialState = snapshot(ctx);
+}
+
 namespace {
 
 enum struct InstClassification : u8 {
@@ -132,474 +352,426 @@ constexpr inline bool isFlagSet(Register& flags, Flags flag) {
     return (flags.value & flag) != Flags::CPU_FLAG_NONE;
 }
 
-Register* getRegister(EmulationContext& ctx, u8 reg, bool isWord, bool isSegment) {
-    if (isSegment) {
-        Register& ret = ctx.registers[i32(RegisterType::ES) + i32(reg)];
-        return &ret;
-    }
-
-    if (isWord) {
-        Register& ret = ctx.registers[i32(RegisterType::AX) + i32(reg)];
-        return &ret;
-    }
-
-    // 8-bit register
-
-    switch (reg) {
-        // Lower registers:
-        case 0b000: return &ctx.registers[i32(RegisterType::AX)];
-        case 0b001: return &ctx.registers[i32(RegisterType::CX)];
-        case 0b010: return &ctx.registers[i32(RegisterType::DX)];
-        case 0b011: return &ctx.registers[i32(RegisterType::BX)];
+inline u8* registerFile(EmulationContext& ctx) {
+    return reinterpret_cast<u8*>(ctx.registers);
+}
 
-        // Higher registers:
-        case 0b100: return &ctx.registers[i32(RegisterType::AX)];
-        case 0b101: return &ctx.registers[i32(RegisterType::CX)];
-        case 0b110: return &ctx.registers[i32(RegisterType::DX)];
-        case 0b111: return &ctx.registers[i32(RegisterType::BX)];
-    }
+// The general purpose register a reg or rm field selects, as a byte or word operand.
+inline u8* registerOperand(EmulationContext& ctx, u8 reg, bool isWord) {
+    return registerFile(ctx) + registerByteOffset(reg, isWord);
+}
 
-    Panic(false, "[BUG] failed to get register ");
-    return nullptr;
+inline Register& segmentRegister(EmulationContext& ctx, u8 reg) {
+    return ctx.registers[i32(RegisterType::ES) + i32(reg)];
 }
 
+// Reading the flags register through this function guarantees that the flags of the last arithmetic operation are
+// materialized.
 Register& getFlagsRegister(EmulationContext& ctx) {
+    materializeFlags(ctx);
     return ctx.registers[i32(RegisterType::FLAGS)];
 }
 
-addr_off calcMemoryAddress(const EmulationContext& ctx, const Instruction& inst) {
-    bool isDirect = isDirectAddrMode(inst.mod, inst.rm);
-    u8 dispLow = inst.disp[0];
-    u8 dispHi = inst.disp[1];
+addr_off calcMemoryAddress(const EmulationContext& ctx, const ExecInst& inst) {
     addr_off addr = 0;
 
-    if (!isDirect) {
-        switch (inst.rm) {
-            case 0b000:
-            {
-                // [BX + SI]
-                i16 bx = i16(ctx.registers[i32(RegisterType::BX)].value);
-                i16 si = i16(ctx.registers[i32(RegisterType::SI)].value);
-                addr += bx + si;
-                break;
-            }
-            case 0b001:
-            {
-                // [BX + DI]
-                i16 bx = i16(ctx.registers[i32(RegisterType::BX)].value);
-                i16 di = i16(ctx.registers[i32(RegisterType::DI)].value);
-                addr += bx + di;
-                break;
-            }
-            case 0b010:
-            {
-                // [BP + SI]
-                i16 bp = i16(ctx.registers[i32(RegisterType::BP)].value);
-                i16 si = i16(ctx.registers[i32(RegisterType::SI)].value);
-                addr += bp + si;
-                break;
-            }
-            case 0b011:
-            {
-                // [BP + DI]
-                i16 bp = i16(ctx.registers[i32(RegisterType::BP)].value);
-                i16 di = i16(ctx.registers[i32(RegisterType::DI)].value);
-                addr += bp + di;
-                break;
-            }
-            case 0b100:
-            {
-                // [SI]
-                i16 si = i16(ctx.registers[i32(RegisterType::SI)].value);
-                addr += si;
-                break;
-            }
-            case 0b101:
-            {
-                // [DI]
-                i16 di = i16(ctx.registers[i32(RegisterType::DI)].value);
-                addr += di;
-                break;
-            }
-            case 0b110:
-            {
-                // [BP]
-                i16 bp = i16(ctx.registers[i32(RegisterType::BP)].value);
-                addr += bp;
-                break;
-            }
-            case 0b111:
-            {
-                // [BX]
-                i16 bx = i16(ctx.registers[i32(RegisterType::BX)].value);
-                addr += bx;
-                break;
-            }
+    switch (inst.addrForm) {
+        case AddrForm::BX_SI:
+        {
+            // [BX + SI]
+            i16 bx = i16(ctx.registers[i32(RegisterType::BX)].value);
+            i16 si = i16(ctx.registers[i32(RegisterType::SI)].value);
+            addr += bx + si;
+            break;
+        }
+        case AddrForm::BX_DI:
+        {
+            // [BX + DI]
+            i16 bx = i16(ctx.registers[i32(RegisterType::BX)].value);
+            i16 di = i16(ctx.registers[i32(RegisterType::DI)].value);
+            addr += bx + di;
+            break;
         }
+        case AddrForm::BP_SI:
+        {
+            // [BP + SI]
+            i16 bp = i16(ctx.registers[i32(RegisterType::BP)].value);
+            i16 si = i16(ctx.registers[i32(RegisterType::SI)].value);
+            addr += bp + si;
+            break;
+        }
+        case AddrForm::BP_DI:
+        {
+            // [BP + DI]
+            i16 bp = i16(ctx.registers[i32(RegisterType::BP)].value);
+            i16 di = i16(ctx.registers[i32(RegisterType::DI)].value);
+            addr += bp + di;
+            break;
+        }
+        case AddrForm::SI:
+        {
+            // [SI]
+            i16 si = i16(ctx.registers[i32(RegisterType::SI)].value);
+            addr += si;
+            break;
+        }
+        case AddrForm::DI:
+        {
+            // [DI]
+            i16 di = i16(ctx.registers[i32(RegisterType::DI)].value);
+            addr += di;
+            break;
+        }
+        case AddrForm::BP:
+        {
+            // [BP]
+            i16 bp = i16(ctx.registers[i32(RegisterType::BP)].value);
+            addr += bp;
+            break;
+        }
+        case AddrForm::BX:
+        {
+            // [BX]
+            i16 bx = i16(ctx.registers[i32(RegisterType::BX)].value);
+            addr += bx;
+            break;
+        }
+        case AddrForm::DIRECT:
+            break;
+        case AddrForm::REGISTER:
+            Panic(false, "[BUG] Register operand used as a memory address.");
+            break;
     }
 
-    if (is8bitDisplacement(inst.mod)) {
-        // [... + disp8]
-        addr += i8(dispLow);
-    }
-    else if (is16bitDisplacement(inst.mod) || isDirect) {
-        // [... + disp16]
-        i16 disp16 = i16(combineWord(dispLow, dispHi));
-        addr += disp16;
-    }
+    // [... + disp]
+    addr += inst.disp;
 
     // User bug:
     Panic(addr >= 0 && addr_size(addr) < EMULATOR_MEMORY_SIZE - 1, "Indexing memory out of bounds.");
     return addr;
 }
 
+// Operands are little endian words or single bytes, both in the register file and in memory.
+inline u16 loadOperand(const u8* operand, bool isWord) {
+    return isWord ? combineWord(operand[0], operand[1]) : operand[0];
+}
+
+inline void storeOperand(u8* operand, bool isWord, u16 value) {
+    operand[0] = lowPart(value);
+    if (isWord) operand[1] = highPart(value);
+}
+
 struct Dest {
     bool isWord;
-    bool isLow;
-    u16* target;
+    u8* target; // A byte of the register file or of memory.
 };
 
-struct Source {
-    u8 low;
-    u8 hi;
-    bool isWord;
-    bool isLow;
+// The source is in the low byte for byte operations. Immediates are already sign extended where the instruction asks for
+// it, so the source never has to be widened to the destination.
+void emulateMov(Dest& dst, u16 src) {
+    storeOperand(dst.target, dst.isWord, src);
+}
+
+void emulateAdd(Dest& dst, u16 src, LazyFlags& lazyFlags) {
+    u16 original = loadOperand(dst.target, dst.isWord);
+    u16 next = u16(original + src);
+    recordLazyFlags(lazyFlags, LazyFlagsOp::Add, dst.isWord, original, src, next);
+    storeOperand(dst.target, dst.isWord, next);
+}
+
+void emulateSub(Dest& dst, u16 src, LazyFlags& lazyFlags) {
+    u16 original = loadOperand(dst.target, dst.isWord);
+    u16 next = u16(original - src);
+    recordLazyFlags(lazyFlags, LazyFlagsOp::Sub, dst.isWord, original, src, next);
+    storeOperand(dst.target, dst.isWord, next);
+}
+
+// cmp is the same as sub, but doesn't write to dst.
+void emulateCmp(Dest& dst, u16 src, LazyFlags& lazyFlags) {
+    u16 original = loadOperand(dst.target, dst.isWord);
+    recordLazyFlags(lazyFlags, LazyFlagsOp::Sub, dst.isWord, original, src, u16(original - src));
+}
+
+struct Operation {
+    Register* destRegister; // The register that holds the destination. The trace shows all of it.
+    u8* destMemoryAddress;
+    Dest dst;
+    u16 src;
+    u8 jumpCond; // The condition of a short jump, see JUMP_PREDICATES.
 };
 
-void emulateMov(Dest& dst, Source& src) {
-    u16 original = *dst.target;
-    u16 next;
+inline void setRegisterDest(EmulationContext& ctx, Operation& op, u8 reg) {
+    op.dst.target = registerOperand(ctx, reg, op.dst.isWord);
+    op.destRegister = &ctx.registers[registerByteOffset(reg, op.dst.isWord) / 2];
+}
 
-    if (dst.isWord) {
-        next = combineWord(src.low, src.hi);
+inline void setMemoryDest(EmulationContext& ctx, const ExecInst& inst, Operation& op) {
+    op.destMemoryAddress = ctx.memory + calcMemoryAddress(ctx, inst);
+    op.dst.target = op.destMemoryAddress;
+}
+
+// The word the trace reports as the destination before and after the instruction.
+inline u16 destTraceValue(const Operation& op) {
+    if (op.destRegister) return op.destRegister->value;
+    if (op.destMemoryAddress) return loadOperand(op.destMemoryAddress, true);
+    return 0;
+}
+
+template <Operands TOperands>
+inline bool setOperands(EmulationContext& ctx, const ExecInst& inst, Operation& op) {
+    Dest& dst = op.dst;
+
+    if constexpr (TOperands == Operands::Register_Immediate) {
+        setRegisterDest(ctx, op, inst.rm);
+        op.src = inst.imm;
+    }
+    else if constexpr (TOperands == Operands::Register_Register) {
+        setRegisterDest(ctx, op, inst.rm);
+        op.src = loadOperand(registerOperand(ctx, inst.reg, dst.isWord), dst.isWord);
+    }
+    else if constexpr (TOperands == Operands::Register16_SegReg) {
+        dst.isWord = true;
+        op.destRegister = &segmentRegister(ctx, inst.reg);
+        dst.target = reinterpret_cast<u8*>(op.destRegister);
+        op.src = ctx.registers[inst.rm].value;
+    }
+    else if constexpr (TOperands == Operands::SegReg_Register16) {
+        dst.isWord = true;
+        setRegisterDest(ctx, op, inst.rm);
+        op.src = segmentRegister(ctx, inst.reg).value;
+    }
+    else if constexpr (TOperands == Operands::Memory_Register) {
+        setRegisterDest(ctx, op, inst.reg);
+        op.src = loadOperand(ctx.memory + calcMemoryAddress(ctx, inst), dst.isWord);
+    }
+    else if constexpr (TOperands == Operands::Register_Memory) {
+        setMemoryDest(ctx, inst, op);
+        op.src = loadOperand(registerOperand(ctx, inst.reg, dst.isWord), dst.isWord);
+    }
+    else if constexpr (TOperands == Operands::Memory_Immediate) {
+        setMemoryDest(ctx, inst, op);
+        op.src = inst.imm;
+    }
+    else if constexpr (TOperands == Operands::Accumulator_Immediate) {
+        setRegisterDest(ctx, op, 0);
+        op.src = inst.imm;
+    }
+    else if constexpr (TOperands == Operands::Memory_Accumulator) {
+        setRegisterDest(ctx, op, 0);
+        op.src = loadOperand(ctx.memory + calcMemoryAddress(ctx, inst), dst.isWord);
+    }
+    else if constexpr (TOperands == Operands::Accumulator_Memory) {
+        setMemoryDest(ctx, inst, op);
+        op.src = loadOperand(registerFile(ctx), dst.isWord);
+    }
+    else if constexpr (TOperands == Operands::ShortLabel) {
+        op.jumpCond = inst.cond;
     }
     else {
-        u8 srcVal = src.isLow ? src.low : src.hi;
-        if (dst.isLow) {
-            next = combineWord(srcVal, highPart(original));
-        }
-        else {
-            next = combineWord(lowPart(original), srcVal);
-        }
+        Assert(false, "Unsupported instruction operands.");
+        return false;
     }
 
-    *dst.target = next;
+    return true;
 }
 
-void emulateAdd(Dest& dst, Source& src, Register& flags) {
-    bool signFlag, zeroFlag, carryFlag, overflowFlag, parityFlag, auxCarryFlag;
-    u16 original = *dst.target;
-    u16 next;
+template <InstType TType>
+inline bool executeOperation(EmulationContext& ctx, Operation& op, bool& jumped) {
+    Dest& dst = op.dst;
 
-    if (dst.isWord) {
-        u16 srcVal;
-        if (src.isWord) {
-            srcVal = combineWord(src.low, src.hi);
+    if constexpr (TType == InstType::MOV) {
+        emulateMov(dst, op.src);
+    }
+    else if constexpr (TType == InstType::ADD) {
+        emulateAdd(dst, op.src, ctx.lazyFlags);
+    }
+    else if constexpr (TType == InstType::SUB) {
+        emulateSub(dst, op.src, ctx.lazyFlags);
+    }
+    else if constexpr (TType == InstType::CMP) {
+        emulateCmp(dst, op.src, ctx.lazyFlags);
+    }
+    else if constexpr (isConditionalJump(TType)) {
+        jumped = isJumpTaken(getFlagsRegister(ctx).value, op.jumpCond);
+    }
+    else if constexpr (TType == InstType::LOOPNZ || TType == InstType::LOOPNE) {
+        Register& cx = ctx.registers[i32(RegisterType::CX)];
+        cx.value--; // Decrement CX. NOTE: Interestingly, this should not set any flags!
+        Register& flags = getFlagsRegister(ctx);
+        if (cx.value != 0 && isFlagSet(flags, Flags::CPU_FLAG_ZERO_FLAG) == false) {
+            jumped = true;
         }
-        else {
-            i16 tmp = 0;
-            safeCastSignedInt(i8(src.low), tmp);
-            srcVal = u16(tmp);
-        }
-        next = original + srcVal;
-        signFlag = i16(next) < 0;
-        zeroFlag = next == 0;
-        carryFlag = next < original;
-        overflowFlag = isSignedBitSet(srcVal) == isSignedBitSet(original) &&
-                       isSignedBitSet(srcVal) != isSignedBitSet(next);
-        auxCarryFlag = ((original & 0xF) + (srcVal & 0xF)) > 0xF;
-        i32 setBitsCount = i32(core::intrin_numberOfSetBits(u32(lowPart(next))));
-        parityFlag = (setBitsCount & 0x1) == 0;
     }
-    else {
-        u8 srcVal = src.isLow ? src.low : src.hi;
-        if (dst.isLow) {
-            u8 dstLow = lowPart(original);
-            dstLow += srcVal;
-            next = combineWord(dstLow, highPart(original));
-            signFlag = i8(dstLow) < 0;
-            zeroFlag = dstLow == 0;
-            carryFlag = dstLow < lowPart(original);
-            overflowFlag = isSignedBitSet(srcVal) == isSignedBitSet(lowPart(original)) &&
-                           isSignedBitSet(srcVal) != isSignedBitSet(dstLow);
-            auxCarryFlag = ((lowPart(original) & 0xF) + (srcVal & 0xF)) > 0xF;
-            i32 setBitsCount = i32(core::intrin_numberOfSetBits(u32(lowPart(next))));
-            parityFlag = (setBitsCount & 0x1) == 0;
+    else if constexpr (TType == InstType::LOOPE || TType == InstType::LOOPZ) {
+        Register& cx = ctx.registers[i32(RegisterType::CX)];
+        cx.value--; // Decrement CX. NOTE: Interestingly, this should not set any flags!
+        Register& flags = getFlagsRegister(ctx);
+        if (cx.value != 0 && isFlagSet(flags, Flags::CPU_FLAG_ZERO_FLAG) == true) {
+            jumped = true;
         }
-        else {
-            u8 dstHigh = highPart(original);
-            dstHigh += srcVal;
-            next = combineWord(lowPart(original), dstHigh);
-            signFlag = i8(dstHigh) < 0;
-            zeroFlag = dstHigh == 0;
-            carryFlag = dstHigh < highPart(original);
-            overflowFlag = isSignedBitSet(srcVal) == isSignedBitSet(highPart(original)) &&
-                           isSignedBitSet(srcVal) != isSignedBitSet(dstHigh);
-            auxCarryFlag = ((highPart(original) & 0x0F) + (srcVal & 0x0F)) > 0xF;
-            i32 setBitsCount = i32(core::intrin_numberOfSetBits(u32(highPart(next))));
-            parityFlag = (setBitsCount & 0x1) == 0;
+    }
+    else if constexpr (TType == InstType::LOOP) {
+        Register& cx = ctx.registers[i32(RegisterType::CX)];
+        cx.value--; // Decrement CX. NOTE: Interestingly, this should not set any flags!
+        if (cx.value != 0) {
+            jumped = true;
         }
-
+    }
+    else if constexpr (TType == InstType::JCXZ) {
+        if (ctx.registers[i32(RegisterType::CX)].value == 0) {
+            jumped = true;
+        }
+    }
+    else {
+        Assert(false, "Instruction not supported for emulation.");
+        return false;
     }
 
-    *dst.target = next;
-
-    setFlag(flags, CPU_FLAG_SIGN_FLAG, signFlag);
-    setFlag(flags, CPU_FLAG_ZERO_FLAG, zeroFlag);
-    setFlag(flags, CPU_FLAG_CARRY_FLAG, carryFlag);
-    setFlag(flags, CPU_FLAG_OVERFLOW_FLAG, overflowFlag);
-    setFlag(flags, CPU_FLAG_PARITY_FLAG, parityFlag);
-    setFlag(flags, CPU_FLAG_AUX_CARRY_FLAG, auxCarryFlag);
+    return true;
 }
 
-void emulateSub(Dest& dst, Source& src, Register& flags) {
-    bool signFlag, zeroFlag, carryFlag, overflowFlag, parityFlag, auxCarryFlag;
-    u16 original = *dst.target;
-    u16 next;
+void traceInstruction(EmulationContext& ctx, const Instruction& inst, const Operation& op, u16 old, u16 nextIp) {
+    static i64 tmp_g_counter = 0;
+
+    const Register& ip = ctx.registers[i32(RegisterType::IP)];
+    char flagsBuf[BUFFER_SIZE_FLAGS] = {};
+    flagsToCptr(Flags(getFlagsRegister(ctx).value), flagsBuf);
+
+    if (op.destRegister || op.destMemoryAddress) {
+        auto& sb = ctx.__verbosecity_buff; sb.clear();
+        detail::encodeBasicInstruction(sb, inst, ctx.decodingOpts);
+        const char* encodedInst = sb.view().buff;
 
-    if (dst.isWord) {
-        u16 srcVal;
-        if (src.isWord) {
-            srcVal = combineWord(src.low, src.hi);
+        writeDirectBold("(%lld) %s", ++tmp_g_counter, encodedInst);
+
+        if (op.destRegister) {
+            constexpr const char* fmtCptr = " ; %s:  0x%X -> 0x%X, ip:  0x%X -> 0x%X, flags: %s";
+            const char* rtype = regTypeToCptr(RegisterType(op.destRegister - ctx.registers));
+            writeLine(fmtCptr, rtype, old, op.destRegister->value, ip.value, nextIp, flagsBuf);
+        }
+        else if (op.destMemoryAddress) {
+            constexpr const char* fmtCptr = " ; [0x%06X]:  0x%X -> 0x%X, ip:  0x%X -> 0x%X, flags: %s";
+            addr_off targetAddrOff = addr_off(op.destMemoryAddress - ctx.memory);
+            writeLine(fmtCptr, targetAddrOff, old, destTraceValue(op), ip.value, nextIp, flagsBuf);
         }
-        else {
-            i16 tmp = 0;
-            safeCastSignedInt(i8(src.low), tmp);
-            srcVal = u16(tmp);
-        }
-        next = original - srcVal;
-        signFlag = i16(next) < 0;
-        zeroFlag = next == 0;
-        carryFlag = original < next;
-        overflowFlag = (isSignedBitSet(original) != isSignedBitSet(srcVal)) &&
-                       (isSignedBitSet(original) != isSignedBitSet(next));
-        auxCarryFlag = ((original & 0xF) - (srcVal & 0xF)) < 0;
-        i32 setBitsCount = i32(core::intrin_numberOfSetBits(u32(lowPart(next))));
-        parityFlag = (setBitsCount & 0x1) == 0;
     }
     else {
-        u8 srcVal = src.isLow ? src.low : src.hi;
-        if (dst.isLow) {
-            u8 dstLow = lowPart(original);
-            dstLow -= srcVal;
-            next = combineWord(dstLow, highPart(original));
-            signFlag = i8(dstLow) < 0;
-            zeroFlag = dstLow == 0;
-            carryFlag = lowPart(original) < dstLow;
-            overflowFlag = (isSignedBitSet(lowPart(original)) != isSignedBitSet(srcVal)) &&
-                           (isSignedBitSet(lowPart(original)) != isSignedBitSet(dstLow));
-            auxCarryFlag = ((lowPart(original) & 0xF) - (srcVal & 0xF)) < 0;
-            i32 setBitsCount = i32(core::intrin_numberOfSetBits(u32(lowPart(next))));
-            parityFlag = (setBitsCount & 0x1) == 0;
-        }
-        else {
-            u8 dstHigh = highPart(original);
-            dstHigh -= srcVal;
-            next = combineWord(lowPart(original), dstHigh);
-            signFlag = i8(dstHigh) < 0;
-            zeroFlag = dstHigh == 0;
-            carryFlag = highPart(original) < dstHigh;
-            overflowFlag = (isSignedBitSet(highPart(original)) != isSignedBitSet(srcVal)) &&
-                           (isSignedBitSet(highPart(original)) != isSignedBitSet(dstHigh));
-            auxCarryFlag = ((highPart(original) & 0x0F) - (srcVal & 0x0F)) < 0;
-            i32 setBitsCount = i32(core::intrin_numberOfSetBits(u32(highPart(next))));
-            parityFlag = (setBitsCount & 0x1) == 0;
-        }
+        writeDirectBold("(%lld) %s", ++tmp_g_counter, instTypeToCptr(inst.type));
+        writeLine(" -> ip: 0x%X -> 0x%X, flags: %s", ip.value, nextIp, flagsBuf);
+    }
+}
+
+constexpr addr_size CODE_PAGE_SIZE = IpIndexTable::PAGE_SIZE;
 
+inline bool isCodePage(const EmulationContext& ctx, addr_size page) {
+    return page < IpIndexTable::PAGE_COUNT && (ctx.codePages[page / 64] & (u64(1) << (page % 64)));
+}
+
+inline void markCodePage(EmulationContext& ctx, addr_size page) {
+    ctx.codePages[page / 64] |= u64(1) << (page % 64);
+}
+
+inline bool isCodeByte(const EmulationContext& ctx, addr_size addr) {
+    return addr < 0x10000 && (ctx.codeBytes[addr / 64] & (u64(1) << (addr % 64)));
+}
+
+inline void markCodeBytes(EmulationContext& ctx, addr_size addr, addr_size len) {
+    for (addr_size i = addr; i < addr + len && i < 0x10000; i++) {
+        ctx.codeBytes[i / 64] |= u64(1) << (i % 64);
     }
+}
 
-    *dst.target = next;
+inline void linkJump(EmulationContext& ctx, i32 jumpIdx, i32 targetIdx) {
+    ctx.instructions[addr_size(jumpIdx)].targetIdx = targetIdx;
+    ctx.linkedJumps.append(jumpIdx);
+}
 
-    setFlag(flags, CPU_FLAG_SIGN_FLAG, signFlag);
-    setFlag(flags, CPU_FLAG_ZERO_FLAG, zeroFlag);
-    setFlag(flags, CPU_FLAG_CARRY_FLAG, carryFlag);
-    setFlag(flags, CPU_FLAG_OVERFLOW_FLAG, overflowFlag);
-    setFlag(flags, CPU_FLAG_PARITY_FLAG, parityFlag);
-    setFlag(flags, CPU_FLAG_AUX_CARRY_FLAG, auxCarryFlag);
+// Each jump is linked at most once between invalidations, so this costs no more than the linking did.
+void unlinkJumps(EmulationContext& ctx) {
+    for (addr_size i = 0; i < ctx.linkedJumps.len(); i++) {
+        ctx.instructions[addr_size(ctx.linkedJumps[i])].targetIdx = -1;
+    }
+    ctx.linkedJumps.clear();
 }
 
-void emulateNext(EmulationContext& ctx, const Instruction& inst) {
-    Register* destRegister = nullptr;
-    u16* destMemoryAddress = nullptr;
-    Dest dst = {};
-    dst.isWord = (inst.w == 1);
-    Source src = {};
+// Forgets the instructions that start in the page and the blocks that start in it. Runs and blocks never cross a page
+// boundary, so nothing cached elsewhere falls through into the page. Jumps may be linked into the page from anywhere,
+// so all of them are unlinked. The forgotten instructions keep their slots until dropStaleCode.
+void invalidateCodePage(EmulationContext& ctx, addr_size page) {
+    static_assert(CODE_PAGE_SIZE % 64 == 0, "A code page must cover whole words of the code byte map.");
+    ctx.codePages[page / 64] &= ~(u64(1) << (page % 64));
+    core::memset(ctx.codeBytes + page * CODE_PAGE_SIZE / 64, 0, CODE_PAGE_SIZE / 8);
+    unlinkJumps(ctx);
+    ctx.staleInstructions += ctx.instIdxByIp.clearPage(page);
+    ctx.blockIdxByIp.clearPage(page);
+    ctx.codeModified = true;
+}
 
-    switch (inst.operands) {
-        case Operands::Register_Immediate:
-        {
-            // Set destination
-            destRegister = getRegister(ctx, inst.rm, dst.isWord, false);
-            dst.target = &destRegister->value;
-            dst.isLow = isLowRegister(inst.rm);
-            // Set source
-            src.low = inst.data[0];
-            src.hi = inst.data[1];
-            src.isLow = true;
-            src.isWord = inst.s ? false : (inst.w == 1);
-            break;
-        }
-        case Operands::Register_Register:
-        {
-            // Set destination
-            destRegister = getRegister(ctx, inst.rm, dst.isWord, false);
-            dst.target = &destRegister->value;
-            dst.isLow = isLowRegister(inst.rm);
-            // Set source
-            Register* rsrc = getRegister(ctx, inst.reg, dst.isWord, false);
-            src.low = lowPart(rsrc->value);
-            src.hi = highPart(rsrc->value);
-            src.isLow = isLowRegister(inst.reg);
-            src.isWord = dst.isWord;
-            break;
-        }
-        case Operands::Register16_SegReg:
-        {
-            // Set destination
-            destRegister= getRegister(ctx, inst.reg, true, true);
-            dst.target = &destRegister->value;
-            dst.isLow = false;
-            dst.isWord = true;
-            // Set source
-            Register* rsrc = getRegister(ctx, inst.rm, true, false);
-            src.low = lowPart(rsrc->value);
-            src.hi = highPart(rsrc->value);
-            src.isLow = true;
-            src.isWord = true;
-            break;
-        }
-        case Operands::SegReg_Register16:
-        {
-            // Set destination
-            destRegister = getRegister(ctx, inst.rm, true, false);
-            dst.target = &destRegister->value;
-            dst.isLow = false;
-            dst.isWord = true;
-            // Set source
-            Register* rsrc = getRegister(ctx, inst.reg, true, true);
-            src.low = lowPart(rsrc->value);
-            src.hi = highPart(rsrc->value);
-            src.isLow = true;
-            src.isWord = true;
-            break;
-        }
+void invalidateCodeStore(EmulationContext& ctx, addr_size page) {
+    // The last instruction of the page before may extend into this one.
+    if (page > 0 && isCodePage(ctx, page - 1)) {
+        invalidateCodePage(ctx, page - 1);
+    }
+    invalidateCodePage(ctx, page);
+}
 
-        case Operands::Memory_Register:
-        {
-            // Set destination
-            destRegister = getRegister(ctx, inst.reg, dst.isWord, false);
-            dst.target = &destRegister->value;
-            dst.isLow = isLowRegister(inst.reg);
-            // Set source
-            addr_off effectiveAddr = calcMemoryAddress(ctx, inst);
-            u16* srcMemoryAddress = reinterpret_cast<u16*>(ctx.memory + effectiveAddr);
-            src.low = *reinterpret_cast<u8*>(srcMemoryAddress);
-            src.hi = *(reinterpret_cast<u8*>(srcMemoryAddress) + 1);
-            src.isLow = true;
-            src.isWord = inst.s ? false : (inst.w == 1);
-            break;
-        }
+inline void recordStore(EmulationContext& ctx, const Operation& op) {
+    // Stores touch at most two bytes.
+    addr_size addr = addr_size(op.destMemoryAddress - ctx.memory);
+    addr_size lastAddr = op.dst.isWord ? addr + 1 : addr;
+    ctx.dirtyPages[addr / MEMORY_PAGE_SIZE] = 1;
+    ctx.dirtyPages[lastAddr / MEMORY_PAGE_SIZE] = 1;
+
+    // The page bits rule out most stores with one test. Data that shares a page with code only drops the decoded
+    // instructions when the store hits one of their bytes.
+    addr_size firstPage = addr / CODE_PAGE_SIZE;
+    addr_size lastPage = lastAddr / CODE_PAGE_SIZE;
+    if (isCodePage(ctx, firstPage) && isCodeByte(ctx, addr)) invalidateCodeStore(ctx, firstPage);
+    if (isCodePage(ctx, lastPage) && isCodeByte(ctx, lastAddr)) invalidateCodeStore(ctx, lastPage);
+}
 
-        case Operands::Register_Memory: {
-            // Set destination
-            addr_off effectiveAddr = calcMemoryAddress(ctx, inst);
-            destMemoryAddress = reinterpret_cast<u16*>(ctx.memory + effectiveAddr);
-            dst.target = destMemoryAddress;
-            dst.isLow = dst.isWord;
-            // Set source
-            Register* rsrc = getRegister(ctx, inst.reg, true, false);
-            src.low = lowPart(rsrc->value);
-            src.hi = highPart(rsrc->value);
-            src.isLow = true;
-            src.isWord = true;
-            break;
-        }
+inline u16 finishInstruction(EmulationContext& ctx, const ExecInst& inst, i32 instIdx, const Operation& op, u16 old,
+                             bool jumped) {
+    if (op.destMemoryAddress && inst.type != InstType::CMP) {
+        recordStore(ctx, op);
+    }
 
-        case Operands::Memory_Immediate: {
-            // Set destination
-            addr_off effectiveAddr = calcMemoryAddress(ctx, inst);
-            destMemoryAddress = reinterpret_cast<u16*>(ctx.memory + effectiveAddr);
-            dst.target = destMemoryAddress;
-            dst.isLow = dst.isWord;
-            // Set source
-            src.isWord = inst.s ? false : (inst.w == 1);
-            src.low = inst.data[0];
-            src.hi = inst.data[1];
-            if (!src.isWord) {
-                // This handles targetting the exact byte in memory when the instruction is a byte sized.
-                src.hi = src.low;
-                dst.isLow = true;
-                src.isLow = false;
-            }
-            break;
-        };
+    Register& ip = ctx.registers[i32(RegisterType::IP)];
+    u16 nextIp = jumped ? inst.jumpIp : u16(ip.value + inst.byteCount);
 
-        case Operands::Accumulator_Immediate:
-        {
-            // Set destination
-            destRegister = &ctx.registers[i32(RegisterType::AX)];
-            dst.target = &destRegister->value;
-            dst.isLow = true;
-            // Set source
-            src.isWord = dst.isWord;
-            src.isLow = dst.isLow;
-            src.low = inst.data[0];
-            src.hi = inst.data[1];
-            break;
-        }
-        case Operands::Memory_Accumulator:
-        {
-            // Set destination
-            destRegister = &ctx.registers[i32(RegisterType::AX)];
-            dst.target = &destRegister->value;
-            dst.isLow = true;
-            // Set source
-            Instruction instCpy = inst;
-            {
-                // This instruction is a bit special. The data is addr and in this case it should be used as the
-                // displacement for the effective memory calculation. Remember that here the mode is not set!
-                instCpy.mod = Mod::MEMORY_16_BIT_DISPLACEMENT;
-                instCpy.disp[0] = inst.data[0];
-                instCpy.disp[1] = inst.data[1];
-            }
-            addr_off effectiveAddr = calcMemoryAddress(ctx, instCpy);
-            u16* srcMemoryAddress = reinterpret_cast<u16*>(ctx.memory + effectiveAddr);
-            src.low = *reinterpret_cast<u8*>(srcMemoryAddress);
-            src.hi = *(reinterpret_cast<u8*>(srcMemoryAddress) + 1);
-            src.isLow = dst.isLow;
-            src.isWord = dst.isWord;
-            break;
-        }
-        case Operands::Accumulator_Memory:
-        {
-            // Set destination
-            Instruction instCpy = inst;
-            {
-                // Same reason as per Memory_Accumulator
-                instCpy.mod = Mod::MEMORY_16_BIT_DISPLACEMENT;
-                instCpy.disp[0] = inst.data[0];
-                instCpy.disp[1] = inst.data[1];
-            }
-            addr_off effectiveAddr = calcMemoryAddress(ctx, instCpy);
-            destMemoryAddress = reinterpret_cast<u16*>(ctx.memory + effectiveAddr);
-            dst.target = destMemoryAddress;
-            dst.isLow = true;
-            // Set source
-            Register& accReg = ctx.registers[i32(RegisterType::AX)];
-            src.isWord = dst.isWord;
-            src.isLow = dst.isLow;
-            src.low = lowPart(accReg.value);
-            src.hi = highPart(accReg.value);
-            break;
-        }
+    if (ctx.emuOpts & EmulationOpts::EMU_OPT_VERBOSE) {
+        traceInstruction(ctx, ctx.decodedInstructions[addr_size(instIdx)], op, old, nextIp);
+    }
+
+    ip.value = nextIp;
+    return nextIp;
+}
 
-        case Operands::ShortLabel: break; // nothing to do
+bool emulateNext(EmulationContext& ctx, i32 instIdx) {
+    const ExecInst& inst = ctx.instructions[addr_size(instIdx)];
+    Operation op = {};
+    op.dst.isWord = inst.isWord;
 
-        case Operands::SegReg_Memory16:            [[fallthrough]];
-        case Operands::Memory_SegReg:              [[fallthrough]];
-        case Operands::None:                       [[fallthrough]];
-        case Operands::SENTINEL:                   Assert(false, "Unsupported instruction operands."); return;
+    bool ok = false;
+    switch (inst.operands) {
+        case Operands::Register_Immediate:    ok = setOperands<Operands::Register_Immediate>(ctx, inst, op);    break;
+        case Operands::Register_Register:     ok = setOperands<Operands::Register_Register>(ctx, inst, op);     break;
+        case Operands::Register16_SegReg:     ok = setOperands<Operands::Register16_SegReg>(ctx, inst, op);     break;
+        case Operands::SegReg_Register16:     ok = setOperands<Operands::SegReg_Register16>(ctx, inst, op);     break;
+        case Operands::Memory_Register:       ok = setOperands<Operands::Memory_Register>(ctx, inst, op);       break;
+        case Operands::Register_Memory:       ok = setOperands<Operands::Register_Memory>(ctx, inst, op);       break;
+        case Operands::Memory_Immediate:      ok = setOperands<Operands::Memory_Immediate>(ctx, inst, op);      break;
+        case Operands::Accumulator_Immediate: ok = setOperands<Operands::Accumulator_Immediate>(ctx, inst, op); break;
+        case Operands::Memory_Accumulator:    ok = setOperands<Operands::Memory_Accumulator>(ctx, inst, op);    break;
+        case Operands::Accumulator_Memory:    ok = setOperands<Operands::Accumulator_Memory>(ctx, inst, op);    break;
+        case Operands::ShortLabel:            ok = setOperands<Operands::ShortLabel>(ctx, inst, op);            break;
+
+        case Operands::SegReg_Memory16:       [[fallthrough]];
+        case Operands::Memory_SegReg:         [[fallthrough]];
+        case Operands::None:                  [[fallthrough]];
+        case Operands::SENTINEL:              ok = setOperands<Operands::None>(ctx, inst, op);                  break;
     }
+    if (!ok) return false;
 
     InstClassification cmdType = getClassification(inst.type);
 
@@ -607,176 +779,663 @@ void emulateNext(EmulationContext& ctx, const Instruction& inst) {
     using IC = InstClassification;
     Assert(cmdType != IC::None, "Failed to classify command.");
     if (cmdType == IC::DataTransfer || cmdType == IC::Arithmentic || cmdType == IC::Logical) {
-        Assert(dst.target, "Failed to set destination for instruction that requires it.");
+        Assert(op.dst.target, "Failed to set destination for instruction that requires it.");
     }
 
-    u16 old = dst.target ? *dst.target : 0;
-    Register& ip = ctx.registers[i32(RegisterType::IP)];
-    i16 deltaIp = 0;
+    u16 old = destTraceValue(op);
+    bool jumped = false;
 
     switch (inst.type) {
-        case InstType::MOV:
-            emulateMov(dst, src);
-            break;
-        case InstType::ADD:
-            emulateAdd(dst, src, getFlagsRegister(ctx));
-            break;
-        case InstType::SUB:
-            emulateSub(dst, src, getFlagsRegister(ctx));
-            break;
-        case InstType::CMP:
-            emulateSub(dst, src, getFlagsRegister(ctx));
-            *dst.target = old; // cmp is the same as sub, but doesn't write to dst
-            break;
-        case InstType::JNZ:
-        case InstType::JNE:
-        {
-            Register& flags = getFlagsRegister(ctx);
-            if (isFlagSet(flags, Flags::CPU_FLAG_ZERO_FLAG) == false) {
-                deltaIp += i8(inst.data[0]);
+        case InstType::MOV:    ok = executeOperation<InstType::MOV>(ctx, op, jumped);    break;
+        case InstType::ADD:    ok = executeOperation<InstType::ADD>(ctx, op, jumped);    break;
+        case InstType::SUB:    ok = executeOperation<InstType::SUB>(ctx, op, jumped);    break;
+        case InstType::CMP:    ok = executeOperation<InstType::CMP>(ctx, op, jumped);    break;
+        case InstType::JE:     ok = executeOperation<InstType::JE>(ctx, op, jumped);     break;
+        case InstType::JZ:     ok = executeOperation<InstType::JZ>(ctx, op, jumped);     break;
+        case InstType::JL:     ok = executeOperation<InstType::JL>(ctx, op, jumped);     break;
+        case InstType::JNGE:   ok = executeOperation<InstType::JNGE>(ctx, op, jumped);   break;
+        case InstType::JLE:    ok = executeOperation<InstType::JLE>(ctx, op, jumped);    break;
+        case InstType::JNG:    ok = executeOperation<InstType::JNG>(ctx, op, jumped);    break;
+        case InstType::JB:     ok = executeOperation<InstType::JB>(ctx, op, jumped);     break;
+        case InstType::JNAE:   ok = executeOperation<InstType::JNAE>(ctx, op, jumped);   break;
+        case InstType::JBE:    ok = executeOperation<InstType::JBE>(ctx, op, jumped);    break;
+        case InstType::JNA:    ok = executeOperation<InstType::JNA>(ctx, op, jumped);    break;
+        case InstType::JP:     ok = executeOperation<InstType::JP>(ctx, op, jumped);     break;
+        case InstType::JPE:    ok = executeOperation<InstType::JPE>(ctx, op, jumped);    break;
+        case InstType::JO:     ok = executeOperation<InstType::JO>(ctx, op, jumped);     break;
+        case InstType::JS:     ok = executeOperation<InstType::JS>(ctx, op, jumped);     break;
+        case InstType::JNE:    ok = executeOperation<InstType::JNE>(ctx, op, jumped);    break;
+        case InstType::JNZ:    ok = executeOperation<InstType::JNZ>(ctx, op, jumped);    break;
+        case InstType::JNL:    ok = executeOperation<InstType::JNL>(ctx, op, jumped);    break;
+        case InstType::JGE:    ok = executeOperation<InstType::JGE>(ctx, op, jumped);    break;
+        case InstType::JNLE:   ok = executeOperation<InstType::JNLE>(ctx, op, jumped);   break;
+        case InstType::JG:     ok = executeOperation<InstType::JG>(ctx, op, jumped);     break;
+        case InstType::JNB:    ok = executeOperation<InstType::JNB>(ctx, op, jumped);    break;
+        case InstType::JAE:    ok = executeOperation<InstType::JAE>(ctx, op, jumped);    break;
+        case InstType::JNBE:   ok = executeOperation<InstType::JNBE>(ctx, op, jumped);   break;
+        case InstType::JA:     ok = executeOperation<InstType::JA>(ctx, op, jumped);     break;
+        case InstType::JNP:    ok = executeOperation<InstType::JNP>(ctx, op, jumped);    break;
+        case InstType::JPO:    ok = executeOperation<InstType::JPO>(ctx, op, jumped);    break;
+        case InstType::JNO:    ok = executeOperation<InstType::JNO>(ctx, op, jumped);    break;
+        case InstType::JNS:    ok = executeOperation<InstType::JNS>(ctx, op, jumped);    break;
+        case InstType::LOOP:   ok = executeOperation<InstType::LOOP>(ctx, op, jumped);   break;
+        case InstType::LOOPE:  ok = executeOperation<InstType::LOOPE>(ctx, op, jumped);  break;
+        case InstType::LOOPZ:  ok = executeOperation<InstType::LOOPZ>(ctx, op, jumped);  break;
+        case InstType::LOOPNE: ok = executeOperation<InstType::LOOPNE>(ctx, op, jumped); break;
+        case InstType::LOOPNZ: ok = executeOperation<InstType::LOOPNZ>(ctx, op, jumped); break;
+        case InstType::JCXZ:   ok = executeOperation<InstType::JCXZ>(ctx, op, jumped);   break;
+
+        case InstType::SENTINEL: [[fallthrough]];
+        case InstType::UNKNOWN:  ok = executeOperation<InstType::UNKNOWN>(ctx, op, jumped); break;
+    }
+    if (!ok) return false;
+
+    finishInstruction(ctx, inst, instIdx, op, old, jumped);
+    return jumped;
+}
+
+i32 decodeRun(EmulationContext& ctx, u16 ip);
+
+// Returns the index of the instruction at ip, decoding it on the first fetch, or -1 when ip is outside the program.
+inline i32 fetchInstIdx(EmulationContext& ctx, u16 ip) {
+    i32 idx = ctx.instIdxByIp.get(ip);
+    if (idx >= 0) {
+        return idx;
+    }
+    if (addr_size(ip) < ctx.codeStart || addr_size(ip) >= ctx.codeEnd) {
+        return -1;
+    }
+    return decodeRun(ctx, ip);
+}
+
+// Returns the index of the instruction a taken short jump continues at. Jumps to code that was not decoded yet are
+// linked the first time they are taken, after that a taken jump skips the lookup by address.
+inline i32 followJump(EmulationContext& ctx, i32 jumpIdx) {
+    i32 targetIdx = ctx.instructions[addr_size(jumpIdx)].targetIdx;
+    if (targetIdx >= 0) {
+        return targetIdx;
+    }
+    u32 resets = ctx.decodedCodeResets;
+    targetIdx = fetchInstIdx(ctx, ctx.instructions[addr_size(jumpIdx)].jumpIp);
+    // Decoding the target may have dropped the stale code, the jump included.
+    if (targetIdx >= 0 && resets == ctx.decodedCodeResets) {
+        linkJump(ctx, jumpIdx, targetIdx);
+    }
+    return targetIdx;
+}
+
+template <InstType TType, Operands TOperands, bool TIsWord>
+i32 threadedHandler(EmulationContext& ctx, const ExecInst& inst, i32 instIdx) {
+    Operation op = {};
+    op.dst.isWord = TIsWord;
+
+    if (!setOperands<TOperands>(ctx, inst, op)) return -1;
+
+    u16 old = 0;
+    if constexpr (TOperands != Operands::ShortLabel) {
+        old = destTraceValue(op);
+    }
+
+    bool jumped = false;
+    if (!executeOperation<TType>(ctx, op, jumped)) return -1;
+
+    u16 nextIp = finishInstruction(ctx, inst, instIdx, op, old, jumped);
+
+    if constexpr (TOperands == Operands::ShortLabel) {
+        if (jumped) return followJump(ctx, instIdx);
+        // A decoded run ends with the jump, so falling through continues with a lookup.
+        return fetchInstIdx(ctx, nextIp);
+    }
+    else {
+        if constexpr (TOperands == Operands::Register_Memory || TOperands == Operands::Memory_Immediate ||
+                      TOperands == Operands::Accumulator_Memory) {
+            if (ctx.codeModified) {
+                // The rest of the run may have been overwritten.
+                ctx.codeModified = false;
+                return fetchInstIdx(ctx, nextIp);
             }
-            break;
         }
-        case InstType::JZ:
-        case InstType::JE:
-        {
-            Register& flags = getFlagsRegister(ctx);
-            if (isFlagSet(flags, Flags::CPU_FLAG_ZERO_FLAG) == true) {
-                deltaIp += i8(inst.data[0]);
-            }
-            break;
+
+        // Runs are decoded in address order, so falling through is just the next index, unless the run ended at a page
+        // boundary or at the end of the program.
+        if (addr_size(nextIp) % CODE_PAGE_SIZE < inst.byteCount || addr_size(nextIp) >= ctx.codeEnd) {
+            return fetchInstIdx(ctx, nextIp);
         }
-        case InstType::JP:
-        case InstType::JPE:
-        {
-            Register& flags = getFlagsRegister(ctx);
-            if (isFlagSet(flags, Flags::CPU_FLAG_PARITY_FLAG) == true) {
-                deltaIp += i8(inst.data[0]);
-            }
-            break;
+        return instIdx + 1;
+    }
+}
+
+i32 unsupportedHandler(EmulationContext&, const ExecInst&, i32) {
+    Assert(false, "Instruction not supported for emulation.");
+    return -1;
+}
+
+template <InstType TType, Operands TOperands>
+InstHandler resolveHandlerForWidth(const ExecInst& inst) {
+    if (inst.isWord) return &threadedHandler<TType, TOperands, true>;
+    return &threadedHandler<TType, TOperands, false>;
+}
+
+template <InstType TType>
+InstHandler resolveDataHandler(const ExecInst& inst) {
+    switch (inst.operands) {
+        case Operands::Register_Immediate:    return resolveHandlerForWidth<TType, Operands::Register_Immediate>(inst);
+        case Operands::Register_Register:     return resolveHandlerForWidth<TType, Operands::Register_Register>(inst);
+        case Operands::Register16_SegReg:     return resolveHandlerForWidth<TType, Operands::Register16_SegReg>(inst);
+        case Operands::SegReg_Register16:     return resolveHandlerForWidth<TType, Operands::SegReg_Register16>(inst);
+        case Operands::Memory_Register:       return resolveHandlerForWidth<TType, Operands::Memory_Register>(inst);
+        case Operands::Register_Memory:       return resolveHandlerForWidth<TType, Operands::Register_Memory>(inst);
+        case Operands::Memory_Immediate:      return resolveHandlerForWidth<TType, Operands::Memory_Immediate>(inst);
+        case Operands::Accumulator_Immediate: return resolveHandlerForWidth<TType, Operands::Accumulator_Immediate>(inst);
+        case Operands::Memory_Accumulator:    return resolveHandlerForWidth<TType, Operands::Memory_Accumulator>(inst);
+        case Operands::Accumulator_Memory:    return resolveHandlerForWidth<TType, Operands::Accumulator_Memory>(inst);
+
+        case Operands::ShortLabel:            [[fallthrough]];
+        case Operands::SegReg_Memory16:       [[fallthrough]];
+        case Operands::Memory_SegReg:         [[fallthrough]];
+        case Operands::None:                  [[fallthrough]];
+        case Operands::SENTINEL:              break;
+    }
+    return &unsupportedHandler;
+}
+
+template <InstType TType>
+InstHandler resolveJumpHandler(const ExecInst& inst) {
+    if (inst.operands != Operands::ShortLabel) return &unsupportedHandler;
+    // The w bit is meaningless for short label jumps.
+    return &threadedHandler<TType, Operands::ShortLabel, false>;
+}
+
+InstHandler resolveHandler(const ExecInst& inst) {
+    switch (inst.type) {
+        case InstType::MOV:    return resolveDataHandler<InstType::MOV>(inst);
+        case InstType::ADD:    return resolveDataHandler<InstType::ADD>(inst);
+        case InstType::SUB:    return resolveDataHandler<InstType::SUB>(inst);
+        case InstType::CMP:    return resolveDataHandler<InstType::CMP>(inst);
+        case InstType::JE:     [[fallthrough]];
+        case InstType::JZ:     [[fallthrough]];
+        case InstType::JL:     [[fallthrough]];
+        case InstType::JNGE:   [[fallthrough]];
+        case InstType::JLE:    [[fallthrough]];
+        case InstType::JNG:    [[fallthrough]];
+        case InstType::JB:     [[fallthrough]];
+        case InstType::JNAE:   [[fallthrough]];
+        case InstType::JBE:    [[fallthrough]];
+        case InstType::JNA:    [[fallthrough]];
+        case InstType::JP:     [[fallthrough]];
+        case InstType::JPE:    [[fallthrough]];
+        case InstType::JO:     [[fallthrough]];
+        case InstType::JS:     [[fallthrough]];
+        case InstType::JNE:    [[fallthrough]];
+        case InstType::JNZ:    [[fallthrough]];
+        case InstType::JNL:    [[fallthrough]];
+        case InstType::JGE:    [[fallthrough]];
+        case InstType::JNLE:   [[fallthrough]];
+        case InstType::JG:     [[fallthrough]];
+        case InstType::JNB:    [[fallthrough]];
+        case InstType::JAE:    [[fallthrough]];
+        case InstType::JNBE:   [[fallthrough]];
+        case InstType::JA:     [[fallthrough]];
+        case InstType::JNP:    [[fallthrough]];
+        case InstType::JPO:    [[fallthrough]];
+        case InstType::JNO:    [[fallthrough]];
+        case InstType::JNS:    return resolveJumpHandler<InstType::JE>(inst); // The condition comes from the table.
+        case InstType::LOOPZ:  [[fallthrough]];
+        case InstType::LOOPE:  return resolveJumpHandler<InstType::LOOPE>(inst);
+        case InstType::LOOPNZ: [[fallthrough]];
+        case InstType::LOOPNE: return resolveJumpHandler<InstType::LOOPNE>(inst);
+        case InstType::LOOP:   return resolveJumpHandler<InstType::LOOP>(inst);
+        case InstType::JCXZ:   return resolveJumpHandler<InstType::JCXZ>(inst);
+
+        case InstType::SENTINEL: [[fallthrough]];
+        case InstType::UNKNOWN:  break;
+    }
+    return &unsupportedHandler;
+}
+
+// Executes a word sized add, sub or cmp on a register together with the short jump that follows it. The jump reads at
+// most the zero flag, which is the result being zero, so the flags are only recorded for later readers and IP is
+// written once for the pair.
+template <InstType TAlu, Operands TOperands, InstType TBranch>
+i32 fusedHandler(EmulationContext& ctx, const ExecInst& inst, i32 instIdx) {
+    const ExecInst& branch = ctx.instructions[addr_size(instIdx + 1)];
+
+    if (ctx.emuOpts & EmulationOpts::EMU_OPT_VERBOSE) {
+        // The trace shows both instructions with the complete flags after each one.
+        threadedHandler<TAlu, TOperands, true>(ctx, inst, instIdx);
+        return threadedHandler<TBranch, Operands::ShortLabel, false>(ctx, branch, instIdx + 1);
+    }
+
+    u16& dst = ctx.registers[inst.rm].value;
+    u16 src;
+    if constexpr (TOperands == Operands::Register_Register) {
+        src = ctx.registers[inst.reg].value;
+    }
+    else {
+        src = inst.imm;
+    }
+
+    u16 original = dst;
+    u16 result;
+    if constexpr (TAlu == InstType::ADD) {
+        result = u16(original + src);
+        recordLazyFlags(ctx.lazyFlags, LazyFlagsOp::Add, true, original, src, result);
+        dst = result;
+    }
+    else {
+        result = u16(original - src);
+        recordLazyFlags(ctx.lazyFlags, LazyFlagsOp::Sub, true, original, src, result);
+        if constexpr (TAlu == InstType::SUB) {
+            dst = result;
         }
-        case InstType::JB:
-        case InstType::JNAE:
-        {
-            Register& flags = getFlagsRegister(ctx);
-            if (isFlagSet(flags, Flags::CPU_FLAG_CARRY_FLAG) == true) {
-                deltaIp += i8(inst.data[0]);
-            }
-            break;
+    }
+
+    bool taken;
+    if constexpr (TBranch == InstType::JNE) {
+        taken = result != 0;
+    }
+    else if constexpr (TBranch == InstType::JE) {
+        taken = result == 0;
+    }
+    else if constexpr (TBranch == InstType::LOOP) {
+        u16& cx = ctx.registers[i32(RegisterType::CX)].value;
+        cx--;
+        taken = cx != 0;
+    }
+    else {
+        static_assert(TBranch == InstType::LOOPNE, "Unsupported fused branch.");
+        u16& cx = ctx.registers[i32(RegisterType::CX)].value;
+        cx--;
+        taken = cx != 0 && result != 0;
+    }
+
+    Register& ip = ctx.registers[i32(RegisterType::IP)];
+    if (taken) {
+        ip.value = branch.jumpIp;
+        return followJump(ctx, instIdx + 1);
+    }
+    ip.value = u16(ip.value + inst.byteCount + branch.byteCount);
+    return fetchInstIdx(ctx, ip.value);
+}
+
+template <InstType TAlu, Operands TOperands>
+InstHandler resolveFusedBranch(const ExecInst& branch) {
+    InstType t = branch.type;
+    if (t == InstType::JNZ || t == InstType::JNE)       return &fusedHandler<TAlu, TOperands, InstType::JNE>;
+    if (t == InstType::JZ || t == InstType::JE)         return &fusedHandler<TAlu, TOperands, InstType::JE>;
+    if (t == InstType::LOOP)                            return &fusedHandler<TAlu, TOperands, InstType::LOOP>;
+    if (t == InstType::LOOPNZ || t == InstType::LOOPNE) return &fusedHandler<TAlu, TOperands, InstType::LOOPNE>;
+    return nullptr;
+}
+
+template <InstType TAlu>
+InstHandler resolveFusedOperands(const ExecInst& alu, const ExecInst& branch) {
+    if (alu.operands == Operands::Register_Register) return resolveFusedBranch<TAlu, Operands::Register_Register>(branch);
+    if (alu.operands == Operands::Register_Immediate) return resolveFusedBranch<TAlu, Operands::Register_Immediate>(branch);
+    return nullptr;
+}
+
+// Returns the handler for the pair of instructions, or nullptr when they can not be fused.
+InstHandler resolveFusedHandler(const ExecInst& alu, const ExecInst& branch) {
+    if (!alu.isWord || branch.operands != Operands::ShortLabel) return nullptr;
+    if (alu.type == InstType::ADD) return resolveFusedOperands<InstType::ADD>(alu, branch);
+    if (alu.type == InstType::SUB) return resolveFusedOperands<InstType::SUB>(alu, branch);
+    if (alu.type == InstType::CMP) return resolveFusedOperands<InstType::CMP>(alu, branch);
+    return nullptr;
+}
+
+constexpr addr_size STALE_CODE_MIN_INSTRUCTIONS = 256;
+
+// Invalidated instructions keep their slots, because their indices are held by blocks, linked jumps and the engines.
+// Code that keeps overwriting itself would grow the arrays without bound, so once most of the decoded instructions are
+// stale everything is dropped and decoded again as it runs. The native code of invalidated blocks is only reclaimed
+// together with everything else, so the same happens when the code buffer is half full and some of it is stale. Only
+// called before decoding, where no index is held.
+void dropStaleCode(EmulationContext& ctx) {
+    if (ctx.staleInstructions == 0) return;
+    bool jitCodeFilling = ctx.jitCode.cap > 0 && ctx.jitCode.used * 2 >= ctx.jitCode.cap;
+    bool mostlyStale = ctx.instructions.len() >= STALE_CODE_MIN_INSTRUCTIONS &&
+                       ctx.staleInstructions * 2 >= ctx.instructions.len();
+    if (jitCodeFilling || mostlyStale) resetDecodedCode(ctx);
+}
+
+// Decodes from ip up to and including the next jump, the end of the page or the end of the program, and returns the
+// index of the first instruction. The instructions of a run get consecutive indices, which is what falling through,
+// blocks and fusion rely on. Addresses that an earlier run already decoded keep pointing to that run.
+i32 decodeRun(EmulationContext& ctx, u16 ip) {
+    dropStaleCode(ctx);
+
+    i32 firstIdx = i32(ctx.instructions.len());
+    addr_size addr = ip;
+    while (addr < ctx.codeEnd) {
+        Instruction decoded = decodeInstructionAt(ctx.memory, ctx.codeEnd, addr);
+        ExecInst inst = toExecInst(decoded, u16(addr));
+        i32 idx = i32(ctx.instructions.len());
+        ctx.instructions.append(inst);
+        ctx.decodedInstructions.append(decoded);
+        ctx.handlers.append(resolveHandler(inst));
+        ctx.fusedHandlers.append(nullptr);
+        if (ctx.instIdxByIp.get(u16(addr)) < 0) {
+            ctx.instIdxByIp.set(u16(addr), idx);
         }
-        case InstType::LOOPNZ:
-        case InstType::LOOPNE:
-        {
-            Register& cx = ctx.registers[i32(RegisterType::CX)];
-            cx.value--; // Decrement CX. NOTE: Interestingly, this should not set any flags!
-            Register& flags = getFlagsRegister(ctx);
-            if (cx.value != 0 && isFlagSet(flags, Flags::CPU_FLAG_ZERO_FLAG) == false) {
-                deltaIp += i8(inst.data[0]);
-            }
+
+        addr_size page = addr / CODE_PAGE_SIZE;
+        markCodeBytes(ctx, addr, inst.byteCount);
+        addr += inst.byteCount;
+        markCodePage(ctx, page);
+        markCodePage(ctx, (addr - 1) / CODE_PAGE_SIZE);
+        if (inst.operands == Operands::ShortLabel || addr / CODE_PAGE_SIZE != page) {
             break;
         }
-        case InstType::LOOP:
-        {
-            Register& cx = ctx.registers[i32(RegisterType::CX)];
-            cx.value--; // Decrement CX. NOTE: Interestingly, this should not set any flags!
-            if (cx.value != 0) {
-                deltaIp += i8(inst.data[0]);
-            }
-            break;
+    }
+
+    // A jump back into decoded code, the usual loop, is linked right away.
+    i32 lastIdx = i32(ctx.instructions.len()) - 1;
+    if (lastIdx >= firstIdx && ctx.instructions[addr_size(lastIdx)].operands == Operands::ShortLabel) {
+        i32 targetIdx = ctx.instIdxByIp.get(ctx.instructions[addr_size(lastIdx)].jumpIp);
+        if (targetIdx >= 0) linkJump(ctx, lastIdx, targetIdx);
+    }
+
+    for (addr_size i = addr_size(firstIdx); i + 1 < ctx.instructions.len(); i++) {
+        InstHandler fused = resolveFusedHandler(ctx.instructions[i], ctx.instructions[i + 1]);
+        if (fused) {
+            ctx.fusedHandlers[i] = fused;
+            ctx.handlers[i] = fused;
         }
+    }
 
-        case InstType::JL:       [[fallthrough]];
-        case InstType::JNGE:     [[fallthrough]];
-        case InstType::JLE:      [[fallthrough]];
-        case InstType::JNG:      [[fallthrough]];
-        case InstType::JBE:      [[fallthrough]];
-        case InstType::JNA:      [[fallthrough]];
-        case InstType::JO:       [[fallthrough]];
-        case InstType::JS:       [[fallthrough]];
-        case InstType::JNL:      [[fallthrough]];
-        case InstType::JGE:      [[fallthrough]];
-        case InstType::JNLE:     [[fallthrough]];
-        case InstType::JG:       [[fallthrough]];
-        case InstType::JNB:      [[fallthrough]];
-        case InstType::JAE:      [[fallthrough]];
-        case InstType::JNBE:     [[fallthrough]];
-        case InstType::JA:       [[fallthrough]];
-        case InstType::JNP:      [[fallthrough]];
-        case InstType::JPO:      [[fallthrough]];
-        case InstType::JNO:      [[fallthrough]];
-        case InstType::JNS:      [[fallthrough]];
-        case InstType::LOOPE:    [[fallthrough]];
-        case InstType::LOOPZ:    [[fallthrough]];
-        case InstType::JCXZ:     [[fallthrough]];
-        case InstType::SENTINEL: [[fallthrough]];
-        case InstType::UNKNOWN:  Assert(false, "Instruction not supported for emulation."); return;
+    return firstIdx;
+}
+
+BasicBlock* nextBlock(EmulationContext& ctx) {
+    u16 ip = ctx.registers[i32(RegisterType::IP)].value;
+    i32 blockIdx = ctx.blockIdxByIp.get(ip);
+    if (blockIdx >= 0) {
+        return &ctx.blocks[addr_size(blockIdx)];
     }
 
-    u16 nextIp = u16(ip.value + deltaIp + inst.byteCount);
+    i32 firstIdx = fetchInstIdx(ctx, ip);
+    if (firstIdx < 0) {
+        return nullptr;
+    }
 
-    if (ctx.emuOpts & EmulationOpts::EMU_OPT_VERBOSE) {
-        static i64 tmp_g_counter = 0;
+    // Build the block on a cache miss. Jumps can land in the middle of an existing block, so blocks may overlap. The
+    // instructions of a decoded run are consecutive, so the block ends with the run.
+    BasicBlock block = {};
+    block.startIp = ip;
+    block.firstInstIdx = firstIdx;
+    addr_size endAddr = ip;
+    for (addr_size i = addr_size(firstIdx); i < ctx.instructions.len() && endAddr < ctx.codeEnd; i++) {
+        const ExecInst& inst = ctx.instructions[i];
+        addr_size page = endAddr / CODE_PAGE_SIZE;
+        block.instCount++;
+        endAddr += inst.byteCount;
+        if (inst.operands == Operands::ShortLabel || endAddr / CODE_PAGE_SIZE != page) {
+            break;
+        }
+    }
+    block.endIp = u16(endAddr);
 
-        char flagsBuf[BUFFER_SIZE_FLAGS] = {};
-        flagsToCptr(Flags(getFlagsRegister(ctx).value), flagsBuf);
+    ctx.blockIdxByIp.set(ip, i32(ctx.blocks.len()));
+    ctx.blocks.append(block);
+    return &ctx.blocks[ctx.blocks.len() - 1];
+}
 
-        if (destRegister || destMemoryAddress) {
-            auto& sb = ctx.__verbosecity_buff; sb.clear();
-            detail::encodeBasicInstruction(sb, inst, ctx.decodingOpts);
-            const char* encodedInst = sb.view().buff;
+void emulateInstructions(EmulationContext& ctx) {
+    i32 idx = fetchInstIdx(ctx, ctx.registers[i32(RegisterType::IP)].value);
+    while (idx >= 0) {
+#if 0
+        // Print the instruction info:
+        char info[BUFFER_SIZE_INST_INFO_OUT] = {};
+        instructionToInfoCptr(ctx.decodedInstructions[addr_size(idx)], info);
+        writeLine("%s", info);
+#endif
+        if (InstHandler fused = ctx.fusedHandlers[addr_size(idx)]; fused != nullptr) {
+            idx = fused(ctx, ctx.instructions[addr_size(idx)], idx);
+            continue;
+        }
+        bool jumped = emulateNext(ctx, idx);
+        idx = jumped ? followJump(ctx, idx) : fetchInstIdx(ctx, ctx.registers[i32(RegisterType::IP)].value);
+    }
+}
+
+void emulateThreaded(EmulationContext& ctx) {
+    // Every handler is resolved once when its instruction is first decoded, so each step is a single indirect call with
+    // no decoding switches.
+    i32 idx = fetchInstIdx(ctx, ctx.registers[i32(RegisterType::IP)].value);
+    while (idx >= 0) {
+        idx = ctx.handlers[addr_size(idx)](ctx, ctx.instructions[addr_size(idx)], idx);
+    }
+}
+
+// Runs the native code of the block, compiling it first when it became hot. Returns false when the block has to be
+// interpreted.
+bool runCompiledBlock(EmulationContext& ctx, BasicBlock& block) {
+    if (block.jitFn == nullptr) {
+        if (block.jitAttempted || block.hitCount < ctx.jitHotThreshold) {
+            return false;
+        }
+        block.jitAttempted = true;
+        const ExecInst* first = &ctx.instructions[addr_size(block.firstInstIdx)];
+        block.jitFn = jitCompileBlock(ctx.jitCode, first, block.instCount, block.startIp, ctx.codeStart,
+                                      ctx.codeEnd);
+        if (block.jitFn == nullptr) {
+            return false;
+        }
+    }
 
-            writeDirectBold("(%lld) %s", ++tmp_g_counter, encodedInst);
+    // Native code writes the FLAGS register directly, so pending lazy flags have to land there first.
+    materializeFlags(ctx);
+    u32 exitCode = block.jitFn(ctx.registers, ctx.memory, ctx.dirtyPages);
+    if (exitCode == JIT_EXIT_SIDE) {
+        // The interpreter executes the instruction the native code backed out of and reports any errors in it.
+        i32 idx = fetchInstIdx(ctx, ctx.registers[i32(RegisterType::IP)].value);
+        if (idx >= 0) {
+            emulateNext(ctx, idx);
+        }
+    }
+    return true;
+}
 
-            if (destRegister) {
-                constexpr const char* fmtCptr = " ; %s:  0x%X -> 0x%X, ip:  0x%X -> 0x%X, flags: %s";
-                const char* rtype = regTypeToCptr(destRegister->type);
-                writeLine(fmtCptr, rtype, old, destRegister->value, ip.value, nextIp, flagsBuf);
+void emulateBlocks(EmulationContext& ctx) {
+    // Native blocks do not trace individual instructions, so verbose runs are always interpreted.
+    bool useJit = (ctx.emuOpts & EmulationOpts::EMU_OPT_JIT) &&
+                  !(ctx.emuOpts & EmulationOpts::EMU_OPT_VERBOSE) &&
+                  jitIsSupported();
+
+    BasicBlock* block;
+    while ((block = nextBlock(ctx)) != nullptr) {
+        block->hitCount++;
+        if (useJit && runCompiledBlock(ctx, *block)) {
+            continue;
+        }
+        addr_size first = addr_size(block->firstInstIdx);
+        addr_size last = first + addr_size(block->instCount);
+        ctx.codeModified = false;
+        for (addr_size i = first; i < last; i++) {
+            // A fused pair is always the last two instructions of a block.
+            if (InstHandler fused = ctx.fusedHandlers[i]; fused != nullptr && i + 1 < last) {
+                fused(ctx, ctx.instructions[i], i32(i));
+                break;
             }
-            else if (destMemoryAddress) {
-                constexpr const char* fmtCptr = " ; [0x%06X]:  0x%X -> 0x%X, ip:  0x%X -> 0x%X, flags: %s";
-                addr_off targetAddrOff = addr_off(reinterpret_cast<u8*>(destMemoryAddress) - ctx.memory);
-                writeLine(fmtCptr, targetAddrOff, old, *destMemoryAddress, ip.value, nextIp, flagsBuf);
+            emulateNext(ctx, i32(i));
+            if (ctx.codeModified) {
+                // The rest of the block may have been overwritten.
+                break;
             }
         }
-        else {
-            writeDirectBold("(%lld) %s", ++tmp_g_counter, instTypeToCptr(inst.type));
-            writeLine(" -> ip: 0x%X -> 0x%X, flags: %s", ip.value, nextIp, flagsBuf);
-        }
     }
+}
 
-    ip.value = nextIp;
+} // namespace
+
+u16 materializeFlags(EmulationContext& ctx) {
+    Register& flags = ctx.registers[i32(RegisterType::FLAGS)];
+    if (ctx.lazyFlags.op != LazyFlagsOp::None) {
+        constexpr u16 arithmeticFlagsMask = CPU_FLAG_SIGN_FLAG | CPU_FLAG_ZERO_FLAG | CPU_FLAG_CARRY_FLAG |
+                                            CPU_FLAG_OVERFLOW_FLAG | CPU_FLAG_PARITY_FLAG | CPU_FLAG_AUX_CARRY_FLAG;
+        flags.value = u16((flags.value & ~arithmeticFlagsMask) | computeArithmeticFlags(ctx.lazyFlags));
+        ctx.lazyFlags.op = LazyFlagsOp::None;
+    }
+    return flags.value;
 }
 
-bool nextInst(const EmulationContext& ctx, Instruction& inst) {
-    // FIXME: Linear search on each instruction is the hacky way to make jumps work, for now. Once there is a proper
-    //        address table that can map into the instructions this will be trivial to fix.
-    const Register& ip = ctx.registers[i32(RegisterType::IP)];
-    addr_off byteOff = 0;
-    i64 idx = core::find(ctx.instructions, [&](const auto& el, addr_off) -> bool {
-        bool ret = ip.value == byteOff;
-        byteOff += el.byteCount;
-        return ret;
-    });
-    if (idx == -1) {
-        return false;
+void emulate(EmulationContext& ctx) {
+    if (ctx.emuOpts & (EmulationOpts::EMU_OPT_BLOCK_ENGINE | EmulationOpts::EMU_OPT_JIT)) {
+        emulateBlocks(ctx);
+    }
+    else if (ctx.emuOpts & EmulationOpts::EMU_OPT_THREADED_ENGINE) {
+        emulateThreaded(ctx);
+    }
+    else {
+        emulateInstructions(ctx);
+    }
+
+    // Leave the context with an exact flags register for whoever inspects it next.
+    materializeFlags(ctx);
+}
+
+struct MemoryPage {
+    std::atomic<u32> refCount;
+    u8 bytes[MEMORY_PAGE_SIZE];
+};
+
+namespace {
+
+MemoryPage* copyPage(const u8* bytes) {
+    MemoryPage* page = new MemoryPage;
+    page->refCount.store(1, std::memory_order_relaxed);
+    std::memcpy(page->bytes, bytes, MEMORY_PAGE_SIZE);
+    return page;
+}
+
+MemoryPage* acquirePage(MemoryPage* page) {
+    if (page) page->refCount.fetch_add(1, std::memory_order_relaxed);
+    return page;
+}
+
+void releasePage(MemoryPage* page) {
+    if (page && page->refCount.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        delete page;
+    }
+}
+
+bool isZeroed(const u8* bytes, addr_size size) {
+    for (addr_size i = 0; i < size; i++) {
+        if (bytes[i] != 0) return false;
     }
-    inst = ctx.instructions[addr_size(idx)];
     return true;
 }
 
+bool pageDiffers(const EmulationContext& ctx, const EmulationSnapshot& snap, addr_size pageIdx) {
+    return ctx.dirtyPages[pageIdx] || ctx.snapshotBase.pages[pageIdx] != snap.memory.pages[pageIdx];
+}
+
 } // namespace
 
-void emulate(EmulationContext& ctx) {
-    Instruction inst;
-    while (nextInst(ctx, inst)) {
-#if 0
-        // Print the instruction info:
-        char info[BUFFER_SIZE_INST_INFO_OUT] = {};
-        instructionToInfoCptr(inst, info);
-        writeLine("%s", info);
-#endif
-        emulateNext(ctx, inst);
+SnapshotPages::SnapshotPages(SnapshotPages&& other) {
+    for (addr_size i = 0; i < MEMORY_PAGE_COUNT; i++) {
+        pages[i] = other.pages[i];
+        other.pages[i] = nullptr;
     }
 }
 
+SnapshotPages& SnapshotPages::operator=(SnapshotPages&& other) {
+    if (this != &other) {
+        for (addr_size i = 0; i < MEMORY_PAGE_COUNT; i++) {
+            releasePage(pages[i]);
+            pages[i] = other.pages[i];
+            other.pages[i] = nullptr;
+        }
+    }
+    return *this;
+}
+
+SnapshotPages::~SnapshotPages() {
+    for (addr_size i = 0; i < MEMORY_PAGE_COUNT; i++) {
+        releasePage(pages[i]);
+    }
+}
+
+void SnapshotPages::share(const SnapshotPages& other) {
+    if (this == &other) return;
+    for (addr_size i = 0; i < MEMORY_PAGE_COUNT; i++) {
+        MemoryPage* page = acquirePage(other.pages[i]);
+        releasePage(pages[i]);
+        pages[i] = page;
+    }
+}
+
+EmulationSnapshot snapshot(EmulationContext& ctx) {
+    EmulationSnapshot snap;
+    for (addr_size i = 0; i < MEMORY_PAGE_COUNT; i++) {
+        if (ctx.dirtyPages[i]) {
+            snap.memory.pages[i] = copyPage(ctx.memory + i * MEMORY_PAGE_SIZE);
+        }
+        else {
+            snap.memory.pages[i] = acquirePage(ctx.snapshotBase.pages[i]);
+        }
+    }
+    ctx.snapshotBase.share(snap.memory);
+    core::memset(ctx.dirtyPages, 0, sizeof(ctx.dirtyPages));
+
+    materializeFlags(ctx);
+    for (addr_size i = 0; i < addr_size(RegisterType::SENTINEL); i++) {
+        snap.registers[i] = ctx.registers[i];
+    }
+    snap.lazyFlags = ctx.lazyFlags;
+    snap.codeStart = ctx.codeStart;
+    snap.codeEnd = ctx.codeEnd;
+    return snap;
+}
+
+void restore(EmulationContext& ctx, const EmulationSnapshot& snap) {
+    bool sameCode = ctx.codeStart == snap.codeStart && ctx.codeEnd == snap.codeEnd;
+    if (!sameCode) {
+        resetDecodedCode(ctx);
+        ctx.codeStart = snap.codeStart;
+        ctx.codeEnd = snap.codeEnd;
+    }
+
+    constexpr addr_size codePagesPerPage = MEMORY_PAGE_SIZE / CODE_PAGE_SIZE;
+    for (addr_size i = 0; i < MEMORY_PAGE_COUNT; i++) {
+        if (!pageDiffers(ctx, snap, i)) continue;
+
+        MemoryPage* page = snap.memory.pages[i];
+        u8* dst = ctx.memory + i * MEMORY_PAGE_SIZE;
+
+        // Instructions decoded from bytes that change are no longer valid. Code that shares the page with the data the
+        // program wrote usually stays the same and keeps its decoded instructions.
+        for (addr_size j = 0; j < codePagesPerPage; j++) {
+            addr_size codePage = i * codePagesPerPage + j;
+            if (!isCodePage(ctx, codePage)) continue;
+            u8* codeBytes = dst + j * CODE_PAGE_SIZE;
+            bool changed = page ? std::memcmp(codeBytes, page->bytes + j * CODE_PAGE_SIZE, CODE_PAGE_SIZE) != 0
+                                : !isZeroed(codeBytes, CODE_PAGE_SIZE);
+            if (changed) invalidateCodeStore(ctx, codePage);
+        }
+
+        if (page) std::memcpy(dst, page->bytes, MEMORY_PAGE_SIZE);
+        else      core::memset(dst, 0, MEMORY_PAGE_SIZE);
+    }
+    ctx.snapshotBase.share(snap.memory);
+    core::memset(ctx.dirtyPages, 0, sizeof(ctx.dirtyPages));
+    ctx.codeModified = false;
+
+    for (addr_size i = 0; i < addr_size(RegisterType::SENTINEL); i++) {
+        ctx.registers[i] = snap.registers[i];
+    }
+    ctx.lazyFlags = snap.lazyFlags;
+}
+
+void changedPages(const EmulationContext& ctx, const EmulationSnapshot& snap, core::Arr<addr_size>& pages) {
+    for (addr_size i = 0; i < MEMORY_PAGE_COUNT; i++) {
+        if (pageDiffers(ctx, snap, i)) pages.append(i);
+    }
+}
+
+void resetEmulationCtx(EmulationContext& ctx) {
+    restore(ctx, ctx.initialState);
+}
+
 } // namespace asm8086
@@ -0,0 +1,653 @@
+#include <jit.h>
+#include <utils.h>
+
+#include <cstddef>
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+    #define EMULATOR_JIT_SUPPORTED 1
+    #include <sys/mman.h>
+#else
+    #define EMULATOR_JIT_SUPPORTED 0
+#endif
+
+namespace asm8086 {
+
+namespace {
+
+#if EMULATOR_JIT_SUPPORTED
+
+constexpr addr_size JIT_CODE_BUFFER_SIZE = 256 * core::KILOBYTE;
+
+constexpr u16 ARITHMETIC_FLAGS_MASK = CPU_FLAG_SIGN_FLAG | CPU_FLAG_ZERO_FLAG | CPU_FLAG_CARRY_FLAG |
+                                      CPU_FLAG_OVERFLOW_FLAG | CPU_FLAG_PARITY_FLAG | CPU_FLAG_AUX_CARRY_FLAG;
+
+// Host registers in x86-64 encoding order. While a block runs, the eight 16 bit 8086 registers live in r8 - r15, rdi
+// points to the register file, rsi points to the emulator memory, rbx points to the dirty page map and rax, rcx and rdx
+// are scratch.
+enum HostReg : u8 {
+    HOST_RAX = 0,
+    HOST_RCX = 1,
+    HOST_RDX = 2,
+    HOST_RBX = 3,
+    HOST_RSP = 4,
+    HOST_RSI = 6,
+    HOST_RDI = 7,
+    HOST_R8 = 8,
+};
+
+// Condition codes of the host jcc instructions.
+enum HostCond : u8 {
+    HOST_COND_B = 0x2,
+    HOST_COND_AE = 0x3,
+    HOST_COND_E = 0x4,
+    HOST_COND_NE = 0x5,
+};
+
+constexpr u8 OPERAND_SIZE_PREFIX = 0x66;
+constexpr u8 MEMORY_PAGE_SHIFT = 12;
+static_assert((addr_size(1) << MEMORY_PAGE_SHIFT) == MEMORY_PAGE_SIZE);
+constexpr u8 SIB_RSI_PLUS_RAX = 0x06; // [rsi + rax]
+
+constexpr u8 hostReg(u8 reg) { return u8(HOST_R8 + reg); }
+constexpr u8 regBit(RegisterType r) { return u8(1 << u8(r)); }
+
+constexpr u8 rex(bool w, u8 reg, u8 rm) {
+    return u8(0x40 | (w ? 0x08 : 0) | ((reg & 0x8) >> 1) | ((rm & 0x8) >> 3));
+}
+
+constexpr u8 modrm(u8 mod, u8 reg, u8 rm) {
+    return u8((mod << 6) | ((reg & 0x7) << 3) | (rm & 0x7));
+}
+
+u32 registerOffset(RegisterType r) {
+    return u32(addr_size(r) * sizeof(Register) + offsetof(Register, value));
+}
+
+enum struct AluOp : u8 {
+    Mov,
+    Add,
+    Sub,
+    Cmp,
+
+    SENTINEL
+};
+
+struct AluEncoding {
+    u8 regToRm; // op r/m16, r16
+    u8 rmToReg; // op r16, r/m16
+    u8 immDigit; // The /digit of the op r/m, imm group.
+};
+
+constexpr AluEncoding aluEncoding(AluOp op) {
+    switch (op) {
+        case AluOp::Mov:      return { 0x89, 0x8B, 0 };
+        case AluOp::Add:      return { 0x01, 0x03, 0 };
+        case AluOp::Sub:      return { 0x29, 0x2B, 5 };
+        case AluOp::Cmp:      return { 0x39, 0x3B, 7 };
+        case AluOp::SENTINEL: break;
+    }
+    return {};
+}
+
+bool toAluOp(InstType type, AluOp& op) {
+    if (type == InstType::MOV)      op = AluOp::Mov;
+    else if (type == InstType::ADD) op = AluOp::Add;
+    else if (type == InstType::SUB) op = AluOp::Sub;
+    else if (type == InstType::CMP) op = AluOp::Cmp;
+    else return false;
+    return true;
+}
+
+bool isLoop(InstType type) {
+    return type == InstType::LOOP || type == InstType::LOOPE || type == InstType::LOOPZ ||
+           type == InstType::LOOPNZ || type == InstType::LOOPNE;
+}
+
+struct Emitter {
+    u8* start;
+    u8* curr;
+    u8* end;
+    bool overflow;
+
+    void byte(u8 b) {
+        if (curr < end) *curr++ = b;
+        else overflow = true;
+    }
+
+    void word(u16 v) {
+        byte(lowPart(v));
+        byte(highPart(v));
+    }
+
+    void dword(u32 v) {
+        for (u32 i = 0; i < 4; i++) byte(u8((v >> (i * 8)) & 0xFF));
+    }
+};
+
+// Emits a conditional jump with a 32 bit displacement and returns the location of the displacement, so it can be
+// patched once the target is known.
+u8* emitJumpIf(Emitter& e, HostCond cond) {
+    e.byte(0x0F);
+    e.byte(u8(0x80 | cond));
+    u8* rel = e.curr;
+    e.dword(0);
+    return rel;
+}
+
+void patchJump(const Emitter& e, u8* rel, const u8* target) {
+    if (e.overflow) return;
+    u32 v = u32(i32(target - (rel + 4)));
+    for (u32 i = 0; i < 4; i++) rel[i] = u8((v >> (i * 8)) & 0xFF);
+}
+
+void emitLoadRegister(Emitter& e, u8 reg) {
+    u8 host = hostReg(reg);
+    e.byte(OPERAND_SIZE_PREFIX);
+    e.byte(rex(false, host, HOST_RDI));
+    e.byte(0x8B);
+    e.byte(modrm(0b10, host, HOST_RDI));
+    e.dword(registerOffset(RegisterType(reg)));
+}
+
+void emitStoreRegister(Emitter& e, u8 reg) {
+    u8 host = hostReg(reg);
+    e.byte(OPERAND_SIZE_PREFIX);
+    e.byte(rex(false, host, HOST_RDI));
+    e.byte(0x89);
+    e.byte(modrm(0b10, host, HOST_RDI));
+    e.dword(registerOffset(RegisterType(reg)));
+}
+
+void emitStoreIp(Emitter& e, u16 ip) {
+    e.byte(OPERAND_SIZE_PREFIX);
+    e.byte(0xC7);
+    e.byte(modrm(0b10, 0, HOST_RDI));
+    e.dword(registerOffset(RegisterType::IP));
+    e.word(ip);
+}
+
+// Copies the host arithmetic flags into the 8086 FLAGS register and leaves the whole register in eax. Both CPUs keep
+// these flags at the same bit positions.
+void emitCaptureFlags(Emitter& e) {
+    e.byte(0x9C); // pushfq
+    e.byte(0x58); // pop rax
+    e.byte(0x25); e.dword(ARITHMETIC_FLAGS_MASK); // and eax, mask
+    e.byte(0x0F); e.byte(0xB7); e.byte(modrm(0b10, HOST_RDX, HOST_RDI)); // movzx edx, word [rdi + flags]
+    e.dword(registerOffset(RegisterType::FLAGS));
+    e.byte(0x81); e.byte(modrm(0b11, 4, HOST_RDX)); e.dword(u16(~ARITHMETIC_FLAGS_MASK)); // and edx, ~mask
+    e.byte(0x09); e.byte(modrm(0b11, HOST_RDX, HOST_RAX)); // or eax, edx
+    e.byte(OPERAND_SIZE_PREFIX); e.byte(0x89); e.byte(modrm(0b10, HOST_RAX, HOST_RDI)); // mov word [rdi + flags], ax
+    e.dword(registerOffset(RegisterType::FLAGS));
+}
+
+void emitLoadFlags(Emitter& e) {
+    e.byte(0x0F); e.byte(0xB7); e.byte(modrm(0b10, HOST_RAX, HOST_RDI)); // movzx eax, word [rdi + flags]
+    e.dword(registerOffset(RegisterType::FLAGS));
+}
+
+void emitTestFlag(Emitter& e, u16 flags) {
+    e.byte(0xA9); e.dword(u32(flags)); // test eax, flags
+}
+
+// Sets JUMP_LESS_FLAG in eax to SF != OF of the flags in eax, like jumpConditionFlags.
+void emitJumpLessFlag(Emitter& e) {
+    e.byte(0x89); e.byte(modrm(0b11, HOST_RAX, HOST_RDX)); // mov edx, eax
+    e.byte(0xC1); e.byte(modrm(0b11, 5, HOST_RDX)); e.byte(4); // shr edx, 4
+    e.byte(0x31); e.byte(modrm(0b11, HOST_RAX, HOST_RDX)); // xor edx, eax
+    e.byte(0x81); e.byte(modrm(0b11, 4, HOST_RDX)); e.dword(CPU_FLAG_SIGN_FLAG); // and edx, SF
+    e.byte(0xC1); e.byte(modrm(0b11, 4, HOST_RDX)); e.byte(5); // shl edx, 5
+    e.byte(0x25); e.dword(u32(~u32(JUMP_LESS_FLAG))); // and eax, ~JUMP_LESS_FLAG
+    e.byte(0x09); e.byte(modrm(0b11, HOST_RDX, HOST_RAX)); // or eax, edx
+}
+
+void emitPrologue(Emitter& e) {
+    // rbx and r12 - r15 are callee saved.
+    e.byte(u8(0x50 | HOST_RBX)); // push rbx
+    for (u8 r = 12; r <= 15; r++) {
+        e.byte(rex(false, 0, r));
+        e.byte(u8(0x50 | (r & 0x7)));
+    }
+    e.byte(rex(true, HOST_RDX, HOST_RBX)); e.byte(0x89); e.byte(modrm(0b11, HOST_RDX, HOST_RBX)); // mov rbx, rdx
+}
+
+void emitExit(Emitter& e, u16 ip, u8 writtenRegs, JitExitCode code) {
+    emitStoreIp(e, ip);
+    for (u8 reg = 0; reg < 8; reg++) {
+        if (writtenRegs & (1 << reg)) emitStoreRegister(e, reg);
+    }
+    for (u8 r = 15; r >= 12; r--) {
+        e.byte(rex(false, 0, r));
+        e.byte(u8(0x58 | (r & 0x7)));
+    }
+    e.byte(u8(0x58 | HOST_RBX)); // pop rbx
+    e.byte(0xB8); e.dword(code); // mov eax, code
+    e.byte(0xC3); // ret
+}
+
+// Leaves the effective address in rax. The registers are sign extended and summed the same way calcMemoryAddress does
+// it, so out of range addresses are negative or too large rather than wrapped around.
+void emitEffectiveAddress(Emitter& e, const ExecInst& inst) {
+    constexpr u8 NO_REG = 0xFF;
+    constexpr u8 BX = u8(RegisterType::BX), BP = u8(RegisterType::BP);
+    constexpr u8 SI = u8(RegisterType::SI), DI = u8(RegisterType::DI);
+    // Indexed by the register forms of AddrForm.
+    constexpr u8 baseByForm[8] = { BX, BX, BP, BP, SI, DI, BP, BX };
+    constexpr u8 indexByForm[8] = { SI, DI, SI, DI, NO_REG, NO_REG, NO_REG, NO_REG };
+
+    i32 disp = inst.disp;
+    if (inst.addrForm == AddrForm::DIRECT) {
+        e.byte(rex(true, 0, HOST_RAX)); e.byte(0xC7); e.byte(modrm(0b11, 0, HOST_RAX)); // mov rax, disp
+        e.dword(u32(disp));
+        return;
+    }
+
+    u8 form = u8(inst.addrForm);
+    u8 base = hostReg(baseByForm[form]);
+    e.byte(rex(true, HOST_RAX, base)); e.byte(0x0F); e.byte(0xBF); e.byte(modrm(0b11, HOST_RAX, base)); // movsx rax, base
+    if (indexByForm[form] != NO_REG) {
+        u8 index = hostReg(indexByForm[form]);
+        e.byte(rex(true, HOST_RCX, index)); e.byte(0x0F); e.byte(0xBF); e.byte(modrm(0b11, HOST_RCX, index)); // movsx rcx, index
+        e.byte(rex(true, HOST_RCX, HOST_RAX)); e.byte(0x01); e.byte(modrm(0b11, HOST_RCX, HOST_RAX)); // add rax, rcx
+    }
+    if (disp != 0) {
+        e.byte(rex(true, 0, HOST_RAX)); e.byte(0x05); e.dword(u32(disp)); // add rax, disp
+    }
+}
+
+u8 effectiveAddressRegisters(const ExecInst& inst) {
+    switch (inst.addrForm) {
+        case AddrForm::BX_SI:    return regBit(RegisterType::BX) | regBit(RegisterType::SI);
+        case AddrForm::BX_DI:    return regBit(RegisterType::BX) | regBit(RegisterType::DI);
+        case AddrForm::BP_SI:    return regBit(RegisterType::BP) | regBit(RegisterType::SI);
+        case AddrForm::BP_DI:    return regBit(RegisterType::BP) | regBit(RegisterType::DI);
+        case AddrForm::SI:       return regBit(RegisterType::SI);
+        case AddrForm::DI:       return regBit(RegisterType::DI);
+        case AddrForm::BP:       return regBit(RegisterType::BP);
+        case AddrForm::BX:       return regBit(RegisterType::BX);
+        case AddrForm::DIRECT:   return 0;
+        case AddrForm::REGISTER: return 0;
+    }
+    return 0;
+}
+
+// Decides whether the instruction can be translated and collects the word registers it reads and writes. Byte
+// register operations are left to the interpreter.
+bool analyzeInstruction(const ExecInst& inst, u8& usedRegs, u8& writtenRegs) {
+    if (inst.operands == Operands::ShortLabel) {
+        if (isLoop(inst.type)) {
+            usedRegs |= regBit(RegisterType::CX);
+            writtenRegs |= regBit(RegisterType::CX);
+            return true;
+        }
+        if (inst.type == InstType::JCXZ) {
+            usedRegs |= regBit(RegisterType::CX);
+            return true;
+        }
+        return isConditionalJump(inst.type);
+    }
+
+    AluOp op;
+    if (!toAluOp(inst.type, op)) return false;
+    bool isWord = inst.isWord;
+    u8 dstWrite = op == AluOp::Cmp ? 0 : 0xFF;
+
+    switch (inst.operands) {
+        case Operands::Register_Register:
+            if (!isWord) return false;
+            usedRegs |= u8(1 << inst.rm) | u8(1 << inst.reg);
+            writtenRegs |= u8((1 << inst.rm) & dstWrite);
+            return true;
+        case Operands::Register_Immediate:
+            if (!isWord) return false;
+            usedRegs |= u8(1 << inst.rm);
+            writtenRegs |= u8((1 << inst.rm) & dstWrite);
+            return true;
+        case Operands::Accumulator_Immediate:
+            if (!isWord) return false;
+            usedRegs |= regBit(RegisterType::AX);
+            writtenRegs |= u8(regBit(RegisterType::AX) & dstWrite);
+            return true;
+        case Operands::Memory_Register:
+            if (!isWord) return false;
+            usedRegs |= u8(u8(1 << inst.reg) | effectiveAddressRegisters(inst));
+            writtenRegs |= u8((1 << inst.reg) & dstWrite);
+            return true;
+        case Operands::Register_Memory:
+            if (!isWord) return false;
+            usedRegs |= u8(u8(1 << inst.reg) | effectiveAddressRegisters(inst));
+            return true;
+        case Operands::Memory_Immediate:
+            usedRegs |= effectiveAddressRegisters(inst);
+            return true;
+        case Operands::Memory_Accumulator:
+            if (!isWord || op != AluOp::Mov) return false;
+            usedRegs |= u8(regBit(RegisterType::AX) | effectiveAddressRegisters(inst));
+            writtenRegs |= regBit(RegisterType::AX);
+            return true;
+        case Operands::Accumulator_Memory:
+            if (!isWord || op != AluOp::Mov) return false;
+            usedRegs |= u8(regBit(RegisterType::AX) | effectiveAddressRegisters(inst));
+            return true;
+
+        case Operands::None:              [[fallthrough]];
+        case Operands::ShortLabel:        [[fallthrough]];
+        case Operands::SegReg_Register16: [[fallthrough]];
+        case Operands::SegReg_Memory16:   [[fallthrough]];
+        case Operands::Register16_SegReg: [[fallthrough]];
+        case Operands::Memory_SegReg:     [[fallthrough]];
+        case Operands::SENTINEL:          break;
+    }
+    return false;
+}
+
+bool isMemoryOperation(Operands operands) {
+    return operands == Operands::Memory_Register || operands == Operands::Register_Memory ||
+           operands == Operands::Memory_Immediate || operands == Operands::Memory_Accumulator ||
+           operands == Operands::Accumulator_Memory;
+}
+
+bool isMemoryStore(const ExecInst& inst) {
+    bool memoryDest = inst.operands == Operands::Register_Memory || inst.operands == Operands::Memory_Immediate ||
+                      inst.operands == Operands::Accumulator_Memory;
+    return memoryDest && inst.type != InstType::CMP;
+}
+
+void emitOperation(Emitter& e, const ExecInst& inst, AluOp op) {
+    AluEncoding enc = aluEncoding(op);
+    u8 ax = hostReg(u8(RegisterType::AX));
+
+    switch (inst.operands) {
+        case Operands::Register_Register:
+        {
+            u8 dst = hostReg(inst.rm);
+            u8 src = hostReg(inst.reg);
+            e.byte(OPERAND_SIZE_PREFIX); e.byte(rex(false, src, dst)); e.byte(enc.regToRm); e.byte(modrm(0b11, src, dst));
+            break;
+        }
+        case Operands::Register_Immediate:
+        {
+            u8 dst = hostReg(inst.rm);
+            e.byte(OPERAND_SIZE_PREFIX); e.byte(rex(false, 0, dst));
+            e.byte(op == AluOp::Mov ? 0xC7 : 0x81); e.byte(modrm(0b11, enc.immDigit, dst));
+            e.word(inst.imm);
+            break;
+        }
+        case Operands::Accumulator_Immediate:
+            e.byte(OPERAND_SIZE_PREFIX); e.byte(rex(false, 0, ax));
+            e.byte(op == AluOp::Mov ? 0xC7 : 0x81); e.byte(modrm(0b11, enc.immDigit, ax));
+            e.word(inst.imm);
+            break;
+        case Operands::Memory_Register:
+        {
+            u8 dst = hostReg(inst.reg);
+            e.byte(OPERAND_SIZE_PREFIX); e.byte(rex(false, dst, 0)); e.byte(enc.rmToReg);
+            e.byte(modrm(0b00, dst, HOST_RSP)); e.byte(SIB_RSI_PLUS_RAX);
+            break;
+        }
+        case Operands::Register_Memory:
+        {
+            u8 src = hostReg(inst.reg);
+            e.byte(OPERAND_SIZE_PREFIX); e.byte(rex(false, src, 0)); e.byte(enc.regToRm);
+            e.byte(modrm(0b00, src, HOST_RSP)); e.byte(SIB_RSI_PLUS_RAX);
+            break;
+        }
+        case Operands::Memory_Immediate:
+            if (inst.isWord) {
+                e.byte(OPERAND_SIZE_PREFIX);
+                e.byte(op == AluOp::Mov ? 0xC7 : 0x81);
+                e.byte(modrm(0b00, enc.immDigit, HOST_RSP)); e.byte(SIB_RSI_PLUS_RAX);
+                e.word(inst.imm);
+            }
+            else {
+                e.byte(op == AluOp::Mov ? 0xC6 : 0x80);
+                e.byte(modrm(0b00, enc.immDigit, HOST_RSP)); e.byte(SIB_RSI_PLUS_RAX);
+                e.byte(lowPart(inst.imm));
+            }
+            break;
+        case Operands::Memory_Accumulator:
+            e.byte(OPERAND_SIZE_PREFIX); e.byte(rex(false, ax, 0)); e.byte(0x8B);
+            e.byte(modrm(0b00, ax, HOST_RSP)); e.byte(SIB_RSI_PLUS_RAX);
+            break;
+        case Operands::Accumulator_Memory:
+            e.byte(OPERAND_SIZE_PREFIX); e.byte(rex(false, ax, 0)); e.byte(0x89);
+            e.byte(modrm(0b00, ax, HOST_RSP)); e.byte(SIB_RSI_PLUS_RAX);
+            break;
+
+        case Operands::None:              [[fallthrough]];
+        case Operands::ShortLabel:        [[fallthrough]];
+        case Operands::SegReg_Register16: [[fallthrough]];
+        case Operands::SegReg_Memory16:   [[fallthrough]];
+        case Operands::Register16_SegReg: [[fallthrough]];
+        case Operands::Memory_SegReg:     [[fallthrough]];
+        case Operands::SENTINEL:
+            Assert(false, "Operands were not checked by analyzeInstruction.");
+            break;
+    }
+}
+
+// Emits the condition of a short jump and returns the host condition under which the jump is taken. A not taken
+// early out, needed only by LOOPNZ and LOOPE, is returned through notTaken.
+HostCond emitBranchCondition(Emitter& e, const ExecInst& inst, bool flagsLive, u8*& notTaken) {
+    u8 cx = hostReg(u8(RegisterType::CX));
+
+    auto loadFlags = [&]() {
+        if (flagsLive) emitCaptureFlags(e);
+        else emitLoadFlags(e);
+    };
+    auto decrementCx = [&]() {
+        // sub cx, 1
+        e.byte(OPERAND_SIZE_PREFIX); e.byte(rex(false, 0, cx)); e.byte(0x83); e.byte(modrm(0b11, 5, cx)); e.byte(1);
+    };
+
+    if (isConditionalJump(inst.type)) {
+        const JumpPredicate& predicate = JUMP_PREDICATES[inst.cond];
+        loadFlags();
+        if (predicate.mask & JUMP_LESS_FLAG) emitJumpLessFlag(e);
+        emitTestFlag(e, predicate.mask);
+        return predicate.invert ? HOST_COND_E : HOST_COND_NE;
+    }
+    else if (inst.type == InstType::LOOP) {
+        // Decrementing CX must not change the 8086 flags, so pending flags are stored first.
+        if (flagsLive) emitCaptureFlags(e);
+        decrementCx();
+        return HOST_COND_NE;
+    }
+    else if (inst.type == InstType::LOOPNZ || inst.type == InstType::LOOPNE) {
+        loadFlags();
+        decrementCx();
+        notTaken = emitJumpIf(e, HOST_COND_E);
+        emitTestFlag(e, CPU_FLAG_ZERO_FLAG);
+        return HOST_COND_E;
+    }
+    else if (inst.type == InstType::LOOPE || inst.type == InstType::LOOPZ) {
+        loadFlags();
+        decrementCx();
+        notTaken = emitJumpIf(e, HOST_COND_E);
+        emitTestFlag(e, CPU_FLAG_ZERO_FLAG);
+        return HOST_COND_NE;
+    }
+    else if (inst.type == InstType::JCXZ) {
+        // Testing CX must not change the 8086 flags either.
+        if (flagsLive) emitCaptureFlags(e);
+        e.byte(OPERAND_SIZE_PREFIX); e.byte(rex(false, cx, cx)); e.byte(0x85); e.byte(modrm(0b11, cx, cx)); // test cx, cx
+        return HOST_COND_E;
+    }
+
+    Assert(false, "Jump was not checked by analyzeInstruction.");
+    return HOST_COND_NE;
+}
+
+struct SideExit {
+    u8* rel;
+    u16 ip;
+};
+
+#endif
+
+} // namespace
+
+bool jitIsSupported() {
+    return EMULATOR_JIT_SUPPORTED == 1;
+}
+
+JitCodeBuffer::JitCodeBuffer(JitCodeBuffer&& other) : code(other.code), cap(other.cap), used(other.used) {
+    other.code = nullptr;
+    other.cap = 0;
+    other.used = 0;
+}
+
+JitCodeBuffer& JitCodeBuffer::operator=(JitCodeBuffer&& other) {
+    if (this != &other) {
+        this->~JitCodeBuffer();
+        code = other.code;
+        cap = other.cap;
+        used = other.used;
+        other.code = nullptr;
+        other.cap = 0;
+        other.used = 0;
+    }
+    return *this;
+}
+
+JitCodeBuffer::~JitCodeBuffer() {
+#if EMULATOR_JIT_SUPPORTED
+    if (code) munmap(code, cap);
+#endif
+    code = nullptr;
+}
+
+JitBlockFn jitCompileBlock(JitCodeBuffer& buffer, const ExecInst* instructions, i32 instCount, u16 startIp,
+                           addr_size codeStart, addr_size codeEnd) {
+#if EMULATOR_JIT_SUPPORTED
+    u8 usedRegs = 0;
+    u8 writtenRegs = 0;
+    for (i32 i = 0; i < instCount; i++) {
+        if (!analyzeInstruction(instructions[i], usedRegs, writtenRegs)) {
+            return nullptr;
+        }
+    }
+
+    if (buffer.code == nullptr) {
+        void* mem = mmap(nullptr, JIT_CODE_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) return nullptr;
+        buffer.code = reinterpret_cast<u8*>(mem);
+        buffer.cap = JIT_CODE_BUFFER_SIZE;
+        buffer.used = 0;
+    }
+    else if (mprotect(buffer.code, buffer.cap, PROT_READ | PROT_WRITE) != 0) {
+        return nullptr;
+    }
+
+    Emitter e = { buffer.code + buffer.used, buffer.code + buffer.used, buffer.code + buffer.cap, false };
+    core::Arr<SideExit> sideExits;
+    u8* takenRel = nullptr;
+    u8* notTakenRel = nullptr;
+    u16 takenIp = 0;
+
+    emitPrologue(e);
+    for (u8 reg = 0; reg < 8; reg++) {
+        if (usedRegs & (1 << reg)) emitLoadRegister(e, reg);
+    }
+
+    u8* bodyStart = e.curr;
+    bool flagsLive = false; // The host flags hold the result of the last arithmetic operation.
+    u16 ip = startIp;
+    for (i32 i = 0; i < instCount; i++) {
+        const ExecInst& inst = instructions[i];
+        u16 nextIp = u16(ip + inst.byteCount);
+
+        if (inst.operands == Operands::ShortLabel) {
+            u16 target = inst.jumpIp;
+            HostCond taken = emitBranchCondition(e, inst, flagsLive, notTakenRel);
+            flagsLive = false;
+            if (target == startIp) {
+                // A block that jumps to its own start loops natively without leaving the host registers.
+                patchJump(e, emitJumpIf(e, taken), bodyStart);
+            }
+            else {
+                takenRel = emitJumpIf(e, taken);
+                takenIp = target;
+            }
+        }
+        else {
+            AluOp op = AluOp::Mov;
+            toAluOp(inst.type, op);
+
+            if (isMemoryOperation(inst.operands)) {
+                // The address calculation clobbers the host flags.
+                if (flagsLive) emitCaptureFlags(e);
+                flagsLive = false;
+
+                emitEffectiveAddress(e, inst);
+
+                // Out of bounds accesses leave the block before the instruction, and the interpreter reports them.
+                e.byte(rex(true, 0, HOST_RAX)); e.byte(0x3D); e.dword(u32(EMULATOR_MEMORY_SIZE - 1)); // cmp rax, size - 1
+                sideExits.append({ emitJumpIf(e, HOST_COND_AE), ip });
+
+                if (isMemoryStore(inst)) {
+                    // Stores that may reach the loaded program leave the block as well, so the interpreter can drop
+                    // the decoded code they overwrite. Word stores start up to one byte before the program.
+                    i32 disp = 1 - i32(codeStart);
+                    u32 rangeLen = u32(codeEnd - codeStart) + 1;
+                    e.byte(rex(true, HOST_RCX, HOST_RAX)); e.byte(0x8D); e.byte(modrm(0b10, HOST_RCX, HOST_RAX));
+                    e.dword(u32(disp)); // lea rcx, [rax + 1 - codeStart]
+                    e.byte(rex(true, 0, HOST_RCX)); e.byte(0x81); e.byte(modrm(0b11, 7, HOST_RCX));
+                    e.dword(rangeLen); // cmp rcx, rangeLen
+                    sideExits.append({ emitJumpIf(e, HOST_COND_B), ip });
+
+                    // Mark the pages of both bytes the store may touch as dirty.
+                    for (u8 offset = 0; offset < 2; offset++) {
+                        e.byte(rex(true, HOST_RCX, HOST_RAX)); e.byte(0x8D); e.byte(modrm(0b01, HOST_RCX, HOST_RAX));
+                        e.byte(offset); // lea rcx, [rax + offset]
+                        e.byte(rex(true, 0, HOST_RCX)); e.byte(0xC1); e.byte(modrm(0b11, 5, HOST_RCX));
+                        e.byte(MEMORY_PAGE_SHIFT); // shr rcx, MEMORY_PAGE_SHIFT
+                        e.byte(0xC6); e.byte(modrm(0b00, 0, 0b100)); e.byte(u8((HOST_RCX << 3) | HOST_RBX));
+                        e.byte(1); // mov byte [rbx + rcx], 1
+                    }
+                }
+            }
+
+            emitOperation(e, inst, op);
+            if (op != AluOp::Mov) flagsLive = true;
+        }
+
+        ip = nextIp;
+    }
+
+    if (flagsLive) emitCaptureFlags(e);
+    if (notTakenRel) patchJump(e, notTakenRel, e.curr);
+    emitExit(e, ip, writtenRegs, JIT_EXIT_NORMAL);
+
+    if (takenRel) {
+        patchJump(e, takenRel, e.curr);
+        emitExit(e, takenIp, writtenRegs, JIT_EXIT_NORMAL);
+    }
+
+    for (addr_size i = 0; i < sideExits.len(); i++) {
+        patchJump(e, sideExits[i].rel, e.curr);
+        emitExit(e, sideExits[i].ip, writtenRegs, JIT_EXIT_SIDE);
+    }
+
+    bool ok = !e.overflow;
+    if (ok) {
+        addr_size size = addr_size(e.curr - e.start);
+        buffer.used = core::core_min((buffer.used + size + 15) & ~addr_size(15), buffer.cap);
+    }
+
+    if (mprotect(buffer.code, buffer.cap, PROT_READ | PROT_EXEC) != 0 || !ok) {
+        return nullptr;
+    }
+
+    return reinterpret_cast<JitBlockFn>(reinterpret_cast<void*>(e.start));
+#else
+    (void)buffer;
+    (void)instructions;
+    (void)instCount;
+    (void)startIp;
+    (void)codeStart;
+    (void)codeEnd;
+    return nullptr;
+#endif
+}
+
+} // namespace asm8086
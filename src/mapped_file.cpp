@@ -0,0 +1,95 @@
+#include <mapped_file.h>
+
+#if defined(__linux__) || defined(__APPLE__)
+    #define EMULATOR_MMAP_FILES 1
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#else
+    #define EMULATOR_MMAP_FILES 0
+#endif
+
+namespace asm8086 {
+
+namespace {
+
+void unmapFile(MappedFile& file) {
+#if EMULATOR_MMAP_FILES
+    if (file.mapped) munmap(const_cast<u8*>(file.data), file.size);
+#endif
+    file.data = nullptr;
+    file.size = 0;
+    file.mapped = false;
+    file.buffer.clear();
+}
+
+bool readFile(const char* path, MappedFile& out) {
+    if (core::fileReadEntire(path, out.buffer).hasErr()) return false;
+    out.data = out.buffer.data();
+    out.size = out.buffer.len();
+    return true;
+}
+
+} // namespace
+
+MappedFile::MappedFile(MappedFile&& other)
+    : data(other.data), size(other.size), mapped(other.mapped), buffer(core::move(other.buffer)) {
+    other.data = nullptr;
+    other.size = 0;
+    other.mapped = false;
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& other) {
+    if (this != &other) {
+        unmapFile(*this);
+        data = other.data;
+        size = other.size;
+        mapped = other.mapped;
+        buffer = core::move(other.buffer);
+        other.data = nullptr;
+        other.size = 0;
+        other.mapped = false;
+    }
+    return *this;
+}
+
+MappedFile::~MappedFile() {
+    unmapFile(*this);
+}
+
+bool mapFile(const char* path, MappedFile& out) {
+    unmapFile(out);
+
+#if EMULATOR_MMAP_FILES
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) {
+        close(fd);
+        return false;
+    }
+    if (info.st_size == 0) {
+        // Empty files can not be mapped, and have nothing to map.
+        close(fd);
+        return true;
+    }
+
+    addr_size size = addr_size(info.st_size);
+    void* mem = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mem != MAP_FAILED) {
+        // The decoder reads the bytes front to back.
+        madvise(mem, size, MADV_SEQUENTIAL);
+        out.data = reinterpret_cast<const u8*>(mem);
+        out.size = size;
+        out.mapped = true;
+        return true;
+    }
+#endif
+
+    return readFile(path, out);
+}
+
+} // namespace asm8086
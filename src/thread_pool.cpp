@@ -0,0 +1,99 @@
+#include <thread_pool.h>
+
+namespace asm8086 {
+
+namespace {
+
+u32 resolveThreadCount(u32 threadCount) {
+    if (threadCount == 0) threadCount = std::thread::hardware_concurrency();
+    if (threadCount == 0) threadCount = 1;
+    return core::core_min(threadCount, ThreadPool::MAX_THREADS);
+}
+
+} // namespace
+
+ThreadPool::ThreadPool(u32 threadCount) : workerCount(resolveThreadCount(threadCount)) {
+    for (u32 i = 0; i < workerCount; i++) {
+        workers[i] = std::thread([this, i]() { workerLoop(i); });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    wait();
+    {
+        std::lock_guard<std::mutex> lock(stateMutex);
+        stopping = true;
+    }
+    workAvailable.notify_all();
+    for (u32 i = 0; i < workerCount; i++) {
+        workers[i].join();
+    }
+}
+
+void ThreadPool::submit(JobFn fn, void* userData) {
+    {
+        std::lock_guard<std::mutex> lock(stateMutex);
+        // The job is in its queue before any worker can see it counted, so the worker that claims it finds it.
+        WorkQueue& queue = queues[nextQueue];
+        {
+            std::lock_guard<std::mutex> queueLock(queue.mutex);
+            if (queue.tail < queue.jobs.len()) queue.jobs[queue.tail] = Job{ fn, userData };
+            else                               queue.jobs.append(Job{ fn, userData });
+            queue.tail++;
+        }
+        nextQueue = (nextQueue + 1) % workerCount;
+        queuedCount++;
+        pendingCount++;
+    }
+    workAvailable.notify_one();
+}
+
+void ThreadPool::wait() {
+    std::unique_lock<std::mutex> lock(stateMutex);
+    allDone.wait(lock, [this]() { return pendingCount == 0; });
+}
+
+bool ThreadPool::popOwn(u32 workerIdx, Job& job) {
+    WorkQueue& queue = queues[workerIdx];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.head == queue.tail) return false;
+    job = queue.jobs[--queue.tail];
+    if (queue.head == queue.tail) queue.head = queue.tail = 0;
+    return true;
+}
+
+bool ThreadPool::steal(u32 workerIdx, Job& job) {
+    for (u32 i = 1; i < workerCount; i++) {
+        WorkQueue& victim = queues[(workerIdx + i) % workerCount];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (victim.head == victim.tail) continue;
+        job = victim.jobs[victim.head++];
+        if (victim.head == victim.tail) victim.head = victim.tail = 0;
+        return true;
+    }
+    return false;
+}
+
+void ThreadPool::workerLoop(u32 workerIdx) {
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(stateMutex);
+            workAvailable.wait(lock, [this]() { return stopping || queuedCount > 0; });
+            if (queuedCount == 0) return;
+            // Claim one of the queued jobs. Every claimed job is already in a queue.
+            queuedCount--;
+        }
+
+        // Another worker can take the job this worker would have found on a queue it already looked at, but only by
+        // claiming a job that is still queued elsewhere, so looking again finds one.
+        Job job;
+        while (!popOwn(workerIdx, job) && !steal(workerIdx, job)) {}
+        job.fn(job.userData);
+
+        std::lock_guard<std::mutex> lock(stateMutex);
+        pendingCount--;
+        if (pendingCount == 0) allDone.notify_all();
+    }
+}
+
+} // namespace asm8086
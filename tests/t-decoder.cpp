@@ -1,5 +1,7 @@
 #include "t-index.h"
 
+#include <stdexcept>
+
 void assertContextDecodedAsExpected(const DecodingContext& ctx, const asm8086::Instruction* expected, addr_size expectedLen) {
     // FIXME: Uncomment this check !
     // Assert(ctx.instructions.len() == expectedLen);
@@ -1221,12 +1223,255 @@ i32 decodeAddSubCmpJumpInstructionsTest() {
     return 0;
 }
 
+i32 decodeModRMTableTest() {
+    /**
+     * Every ModR/M byte must give the fields and addressing the bit layout describes, with a 16-bit displacement for
+     * direct addressing and none for register operands.
+    */
+    for (u32 byte = 0; byte < 256; byte++) {
+        const ModRM& modrm = decodeModRM(u8(byte));
+        Mod mod = Mod(byte >> 6);
+        u8 rm = u8(byte & 0b111);
+        Assert(modrm.mod == mod);
+        Assert(modrm.reg == ((byte >> 3) & 0b111));
+        Assert(modrm.rm == rm);
+        Assert(&decodeModRM(mod, rm) == &decodeModRM(u8(byte & 0b11000111)));
+
+        if (mod == Mod::REGISTER_TO_REGISTER_NO_DISPLACEMENT) {
+            Assert(modrm.addrForm == AddrForm::REGISTER);
+            Assert(modrm.dispByteCount == 0);
+        }
+        else if (mod == Mod::MEMORY_NO_DISPLACEMENT && rm == 0b110) {
+            Assert(modrm.addrForm == AddrForm::DIRECT);
+            Assert(modrm.dispByteCount == 2);
+        }
+        else {
+            Assert(u8(modrm.addrForm) == rm);
+            if (mod == Mod::MEMORY_8_BIT_DISPLACEMENT) Assert(modrm.dispByteCount == 1);
+            else if (mod == Mod::MEMORY_16_BIT_DISPLACEMENT) Assert(modrm.dispByteCount == 2);
+            else Assert(modrm.dispByteCount == 0);
+        }
+    }
+
+    return 0;
+}
+
+// The decoder test programs from the data directory. Copies of them make large inputs for the chunked and parallel
+// decoders.
+constexpr const char* DECODER_PROGRAMS[] = {
+    "02_multiple_move_inst.asm.o",
+    "03_more_complicated_move_inst.asm.o",
+    "04_challenge_move_inst.asm.o",
+    "05_add_sub_cmp_jnz.asm.o",
+};
+
+i32 decodeScanLengthsTest() {
+    /**
+     * The length scan must find the same instruction offsets as the full decode, and stop at an instruction cut by the
+     * end of the input or at an unsupported opcode.
+    */
+
+    for (const char* name : DECODER_PROGRAMS) {
+        core::Arr<u8> binaryData;
+        readDataFile(name, binaryData);
+
+        DecodingContext ctx;
+        decodeAsm8086(binaryData, ctx);
+
+        core::Arr<addr_size> offsets;
+        Assert(scanInstructionLengths(binaryData.data(), binaryData.len(), offsets) == binaryData.len());
+        Assert(offsets.len() == ctx.instructions.len());
+        addr_size expectedOffset = 0;
+        for (addr_size i = 0; i < offsets.len(); i++) {
+            Assert(offsets[i] == expectedOffset);
+            expectedOffset += ctx.instructions[i].byteCount;
+        }
+
+        // Cutting the last instruction short stops the scan where it starts.
+        addr_size lastOffset = offsets[offsets.len() - 1];
+        core::Arr<addr_size> truncated;
+        Assert(scanInstructionLengths(binaryData.data(), binaryData.len() - 1, truncated) == lastOffset);
+        Assert(truncated.len() == offsets.len() - 1);
+    }
+
+    {
+        // mov cx, bx followed by the unsupported nop.
+        constexpr u8 bytes[] = { 0x89, 0xd9, 0x90, 0x89, 0xd9 };
+        core::Arr<addr_size> offsets;
+        Assert(scanInstructionLengths(bytes, sizeof(bytes), offsets) == 2);
+        Assert(offsets.len() == 1);
+        Assert(offsets[0] == 0);
+    }
+
+    return 0;
+}
+
+i32 decodeStreamInChunksTest() {
+    /**
+     * Feeds copies of the decoder test programs to the stream decoder in chunks of different sizes. It must produce the
+     * same instructions at the same offsets as decoding the whole input at once, and never hold back a whole instruction.
+    */
+    constexpr addr_size copies = 50;
+    constexpr addr_size chunkSizes[] = { 1, 2, 3, 5, 6, 7, 13, 64, 4096 };
+
+    core::Arr<u8> input;
+    for (addr_size c = 0; c < copies; c++) {
+        for (const char* name : DECODER_PROGRAMS) {
+            readDataFile(name, input);
+        }
+    }
+
+    DecodingContext expected;
+    decodeAsm8086(input, expected);
+
+    struct Decoded {
+        core::Arr<Instruction> instructions;
+        core::Arr<addr_size> offsets;
+    };
+
+    for (addr_size chunkSize : chunkSizes) {
+        Decoded decoded;
+        StreamDecoder decoder = createStreamDecoder([](const Instruction& inst, addr_size offset, void* userData) {
+            Decoded& out = *reinterpret_cast<Decoded*>(userData);
+            out.instructions.append(inst);
+            out.offsets.append(offset);
+        }, &decoded);
+
+        for (addr_size start = 0; start < input.len(); start += chunkSize) {
+            addr_size len = core::core_min(chunkSize, input.len() - start);
+            streamDecode(decoder, input.data() + start, len);
+            Assert( decoder.carryLen < MAX_INSTRUCTION_SIZE );
+        }
+        streamDecodeFinish(decoder);
+        Assert( decoder.offset == input.len() );
+
+        Assert( decoded.instructions.len() == expected.instructions.len() );
+        addr_size offset = 0;
+        for (addr_size i = 0; i < expected.instructions.len(); i++) {
+            const Instruction& a = decoded.instructions[i];
+            const Instruction& b = expected.instructions[i];
+            Assert( decoded.offsets[i] == offset );
+            Assert( a.opcode == b.opcode );
+            Assert( a.type == b.type );
+            Assert( a.operands == b.operands );
+            Assert( a.byteCount == b.byteCount );
+            Assert( a.mod == b.mod && a.reg == b.reg && a.rm == b.rm );
+            Assert( a.disp[0] == b.disp[0] && a.disp[1] == b.disp[1] );
+            Assert( a.data[0] == b.data[0] && a.data[1] == b.data[1] );
+            offset += b.byteCount;
+        }
+    }
+
+    return 0;
+}
+
+i32 decodeParallelMatchesSequentialTest() {
+    /**
+     * Decodes copies of the decoder test programs, large enough to be split, in parallel and sequentially. The
+     * instructions and jump labels must be the same, also when the context already holds decoded instructions.
+    */
+
+    core::Arr<u8> input;
+    while (input.len() < PARALLEL_DECODE_MIN_SIZE + 8 * core::KILOBYTE) {
+        for (const char* name : DECODER_PROGRAMS) {
+            readDataFile(name, input);
+        }
+    }
+
+    auto check = [](const DecodingContext& a, const DecodingContext& b) {
+        Assert( a.idx == b.idx );
+        Assert( a.instructions.len() == b.instructions.len() );
+        for (addr_size i = 0; i < a.instructions.len(); i++) {
+            const Instruction& x = a.instructions[i];
+            const Instruction& y = b.instructions[i];
+            Assert( x.opcode == y.opcode && x.d == y.d && x.s == y.s && x.w == y.w );
+            Assert( x.mod == y.mod && x.reg == y.reg && x.rm == y.rm );
+            Assert( x.disp[0] == y.disp[0] && x.disp[1] == y.disp[1] );
+            Assert( x.data[0] == y.data[0] && x.data[1] == y.data[1] );
+            Assert( x.type == y.type && x.byteCount == y.byteCount && x.operands == y.operands );
+        }
+        Assert( a.jmpLabels.len() == b.jmpLabels.len() );
+        for (addr_size i = 0; i < a.jmpLabels.len(); i++) {
+            Assert( a.jmpLabels[i].byteOffset == b.jmpLabels[i].byteOffset );
+            Assert( a.jmpLabels[i].labelIdx == b.jmpLabels[i].labelIdx );
+        }
+    };
+
+    ThreadPool pool(4);
+    {
+        DecodingContext sequential;
+        decodeAsm8086(input, sequential);
+        DecodingContext parallel;
+        decodeAsm8086Parallel(input.data(), input.len(), parallel, pool);
+        check(sequential, parallel);
+    }
+    {
+        // Continue after the first program, whose labels are already collected.
+        DecodingContext sequential;
+        decodeAsm8086(input.data(), 22, sequential);
+        decodeAsm8086(input, sequential);
+        DecodingContext parallel;
+        decodeAsm8086(input.data(), 22, parallel);
+        decodeAsm8086Parallel(input.data(), input.len(), parallel, pool);
+        check(sequential, parallel);
+    }
+    {
+        // A nop, which is not supported, in place of an instruction on the true path of a later segment. The segments
+        // can not be joined past it, so the parallel decode falls back to decoding sequentially and must stop at the
+        // same instruction with the same instructions before it.
+        core::Arr<addr_size> offsets;
+        Assert(scanInstructionLengths(input.data(), input.len(), offsets) == input.len());
+        addr_size badInst = offsets.len() * 3 / 4;
+        core::Arr<u8> broken;
+        broken.append(input.data(), input.len());
+        broken[offsets[badInst]] = 0x90;
+
+        // The assertion handler of the tests prints a trace, decoding errors are expected here.
+        core::setGlobalAssertHandler([](const char*, const char*, i32, const char*, const char*) {
+            throw std::runtime_error("Decoding failed.");
+        });
+        auto decodeFails = [](auto&& decode) {
+            try {
+                decode();
+            }
+            catch (const std::runtime_error&) {
+                return true;
+            }
+            return false;
+        };
+
+        DecodingContext sequential;
+        bool sequentialFailed = decodeFails([&]() { decodeAsm8086(broken, sequential); });
+        DecodingContext parallel;
+        bool parallelFailed = decodeFails([&]() {
+            decodeAsm8086Parallel(broken.data(), broken.len(), parallel, pool);
+        });
+        initCore();
+
+        Assert( sequentialFailed );
+        Assert( parallelFailed );
+        Assert( sequential.instructions.len() == badInst );
+        Assert( parallel.instructions.len() == badInst );
+        for (addr_size i = 0; i < badInst; i++) {
+            const Instruction& x = sequential.instructions[i];
+            const Instruction& y = parallel.instructions[i];
+            Assert( x.opcode == y.opcode && x.byteCount == y.byteCount && x.operands == y.operands );
+        }
+    }
+
+    return 0;
+}
+
 i32 runDecoderTestsSuite() {
     RunTest(decodeOneInstructionsTest);
     RunTest(decodeMultipleInstructionsTest);
     RunTest(decodeComplicatedMoveInstructionsTest);
     RunTest(decodeChallengeMoveInstructonsTest);
     RunTest(decodeAddSubCmpJumpInstructionsTest);
+    RunTest(decodeModRMTableTest);
+    RunTest(decodeScanLengthsTest);
+    RunTest(decodeStreamInChunksTest);
+    RunTest(decodeParallelMatchesSequentialTest);
 
     return 0;
 }
@@ -1,5 +1,24 @@
 #include "t-index.h"
 
+namespace {
+
+// Loads the program at loadBase and runs it to the end with every engine, compiling each block on its first hit, then
+// hands the final context to check.
+template <typename TCheck>
+void runOnEveryEngine(const core::Arr<u8>& binaryData, u16 loadBase, TCheck check) {
+    constexpr asm8086::EmulationOpts engines[] = {
+        asm8086::EMU_OPT_NONE, asm8086::EMU_OPT_BLOCK_ENGINE, asm8086::EMU_OPT_THREADED_ENGINE, asm8086::EMU_OPT_JIT,
+    };
+    for (asm8086::EmulationOpts options : engines) {
+        EmulationContext ectx = asm8086::createEmulationCtx(binaryData.data(), binaryData.len(), options, loadBase);
+        ectx.jitHotThreshold = 1;
+        asm8086::emulate(ectx);
+        check(ectx);
+    }
+}
+
+} // namespace
+
 i32 emulateSimpleMovTest() {
     /**
      * This binary data represents the following assembly code:
@@ -24,11 +43,8 @@ i32 emulateSimpleMovTest() {
         .append(0x00).append(0xbd).append(0x06).append(0x00).append(0xbe).append(0x07).append(0x00)
         .append(0xbf).append(0x08).append(0x00);
 
-    DecodingContext ctx;
-    decodeAsm8086(binaryData, ctx);
-
     asm8086::EmulationOpts options = {};
-    EmulationContext ectx = asm8086::createEmulationCtx(core::move(ctx.instructions), options);
+    EmulationContext ectx = asm8086::createEmulationCtx(binaryData.data(), binaryData.len(), options);
 
     asm8086::emulate(ectx);
 
@@ -83,11 +99,8 @@ i32 emulateMemoryToRegisterMovTest() {
         .append(0xe2).append(0x89).append(0xe9).append(0x89).append(0xf3).append(0x89).append(0xf8);
 
 
-    DecodingContext ctx;
-    decodeAsm8086(binaryData, ctx);
-
     asm8086::EmulationOpts options = {};
-    EmulationContext ectx = asm8086::createEmulationCtx(core::move(ctx.instructions), options);
+    EmulationContext ectx = asm8086::createEmulationCtx(binaryData.data(), binaryData.len(), options);
 
     asm8086::emulate(ectx);
 
@@ -155,11 +168,8 @@ i32 emulateHalfRegisterMovTest() {
         .append(0xc1).append(0x8c).append(0xd4).append(0x8c).append(0xdd).append(0x8c).append(0xc6)
         .append(0x89).append(0xd7);
 
-    DecodingContext ctx;
-    decodeAsm8086(binaryData, ctx);
-
     asm8086::EmulationOpts options = {};
-    EmulationContext ectx = asm8086::createEmulationCtx(core::move(ctx.instructions), options);
+    EmulationContext ectx = asm8086::createEmulationCtx(binaryData.data(), binaryData.len(), options);
 
     asm8086::emulate(ectx);
 
@@ -208,11 +218,8 @@ i32 emulateCarryAndSignFlagInstructionsTest() {
               .append(0x39).append(0xe5).append(0x81).append(0xc5).append(0x03).append(0x04).append(0x81)
               .append(0xed).append(0xea).append(0x07);
 
-    DecodingContext ctx;
-    decodeAsm8086(binaryData, ctx);
-
     asm8086::EmulationOpts options = {};
-    EmulationContext ectx = asm8086::createEmulationCtx(core::move(ctx.instructions), options);
+    EmulationContext ectx = asm8086::createEmulationCtx(binaryData.data(), binaryData.len(), options);
 
     asm8086::emulate(ectx);
 
@@ -275,11 +282,8 @@ i32 emulateMoreFlagsTest() {
         .append(0xa6).append(0xbc).append(0x63).append(0x00).append(0xbd).append(0x62).append(0x00)
         .append(0x39).append(0xe5);
 
-    DecodingContext ctx;
-    decodeAsm8086(binaryData, ctx);
-
     asm8086::EmulationOpts options = {};
-    EmulationContext ectx = asm8086::createEmulationCtx(core::move(ctx.instructions), options);
+    EmulationContext ectx = asm8086::createEmulationCtx(binaryData.data(), binaryData.len(), options);
 
     asm8086::emulate(ectx);
 
@@ -326,11 +330,8 @@ i32 emulateBasicIpChanges() {
         .append(0xb9).append(0xc8).append(0x00).append(0x89).append(0xcb).append(0x81).append(0xc1)
         .append(0xe8).append(0x03).append(0xbb).append(0xd0).append(0x07).append(0x29).append(0xd9);
 
-    DecodingContext ctx;
-    decodeAsm8086(binaryData, ctx);
-
     asm8086::EmulationOpts options = {};
-    EmulationContext ectx = asm8086::createEmulationCtx(core::move(ctx.instructions), options);
+    EmulationContext ectx = asm8086::createEmulationCtx(binaryData.data(), binaryData.len(), options);
 
     asm8086::emulate(ectx);
 
@@ -375,11 +376,8 @@ i32 emulateALoopTest() {
     binaryData.append(0xb9).append(0x03).append(0x00).append(0xbb).append(0xe8).append(0x03).append(0x83)
               .append(0xc3).append(0x0a).append(0x83).append(0xe9).append(0x01).append(0x75).append(0xf8);
 
-    DecodingContext ctx;
-    decodeAsm8086(binaryData, ctx);
-
     asm8086::EmulationOpts options = {};
-    EmulationContext ectx = asm8086::createEmulationCtx(core::move(ctx.instructions), options);
+    EmulationContext ectx = asm8086::createEmulationCtx(binaryData.data(), binaryData.len(), options);
 
     asm8086::emulate(ectx);
 
@@ -441,11 +439,8 @@ i32 emulateCompliatedJumpInstructionsTest() {
         .append(0xc0).append(0x01).append(0x7a).append(0x05).append(0x83).append(0xeb).append(0x05)
         .append(0x72).append(0x03).append(0x83).append(0xe9).append(0x02).append(0xe0).append(0xed);
 
-    DecodingContext ctx;
-    decodeAsm8086(binaryData, ctx);
-
     asm8086::EmulationOpts options = {};
-    EmulationContext ectx = asm8086::createEmulationCtx(core::move(ctx.instructions), options);
+    EmulationContext ectx = asm8086::createEmulationCtx(binaryData.data(), binaryData.len(), options);
 
     asm8086::emulate(ectx);
 
@@ -508,11 +503,8 @@ i32 emulateBasicMemoryAddressingTest() {
         .append(0x03).append(0x8b).append(0x0e).append(0xea).append(0x03).append(0x8b).append(0x16)
         .append(0xec).append(0x03).append(0x8b).append(0x2e).append(0xee).append(0x03);
 
-    DecodingContext ctx;
-    decodeAsm8086(binaryData, ctx);
-
     asm8086::EmulationOpts options = {};
-    EmulationContext ectx = asm8086::createEmulationCtx(core::move(ctx.instructions), options);
+    EmulationContext ectx = asm8086::createEmulationCtx(binaryData.data(), binaryData.len(), options);
 
     asm8086::emulate(ectx);
 
@@ -571,11 +563,8 @@ i32 emulateLoopWithMemoryAddressingTest() {
         .append(0xbe).append(0x00).append(0x00).append(0x8b).append(0x0a).append(0x01).append(0xcb)
         .append(0x83).append(0xc6).append(0x02).append(0x39).append(0xd6).append(0x75).append(0xf5);
 
-    DecodingContext ctx;
-    decodeAsm8086(binaryData, ctx);
-
     asm8086::EmulationOpts options = {};
-    EmulationContext ectx = asm8086::createEmulationCtx(core::move(ctx.instructions), options);
+    EmulationContext ectx = asm8086::createEmulationCtx(binaryData.data(), binaryData.len(), options);
 
     asm8086::emulate(ectx);
 
@@ -641,11 +630,8 @@ i32 emulateChallengeMemoryAddressing() {
         .append(0x89).append(0xd6).append(0x83).append(0xed).append(0x02).append(0x03).append(0x1a)
         .append(0x83).append(0xee).append(0x02).append(0x75).append(0xf9);
 
-    DecodingContext ctx;
-    decodeAsm8086(binaryData, ctx);
-
     asm8086::EmulationOpts options = {};
-    EmulationContext ectx = asm8086::createEmulationCtx(core::move(ctx.instructions), options);
+    EmulationContext ectx = asm8086::createEmulationCtx(binaryData.data(), binaryData.len(), options);
 
     asm8086::emulate(ectx);
 
@@ -714,11 +700,8 @@ i32 emulateImageGenerationTest() {
         .append(0x75).append(0xeb).append(0x83).append(0xc2).append(0x01).append(0x83).append(0xfa)
         .append(0x40).append(0x75).append(0xe0);
 
-    DecodingContext ctx;
-    decodeAsm8086(binaryData, ctx);
-
     asm8086::EmulationOpts options = {};
-    EmulationContext ectx = asm8086::createEmulationCtx(core::move(ctx.instructions), options);
+    EmulationContext ectx = asm8086::createEmulationCtx(binaryData.data(), binaryData.len(), options);
 
     asm8086::emulate(ectx);
 
@@ -795,11 +778,8 @@ i32 emulateImageGenerationWithBoarderTest() {
         .append(0xf5).append(0x00).append(0xff).append(0x83).append(0xc5).append(0x04).append(0x81)
         .append(0xc3).append(0x00).append(0x01).append(0xe2).append(0xe5);
 
-    DecodingContext ctx;
-    decodeAsm8086(binaryData, ctx);
-
     asm8086::EmulationOpts options = {};
-    EmulationContext ectx = asm8086::createEmulationCtx(core::move(ctx.instructions), options);
+    EmulationContext ectx = asm8086::createEmulationCtx(binaryData.data(), binaryData.len(), options);
 
     asm8086::emulate(ectx);
 
@@ -809,6 +789,816 @@ i32 emulateImageGenerationWithBoarderTest() {
     return 0;
 }
 
+i32 emulateBlockEngineTest() {
+    /**
+     * Same program as emulateCompliatedJumpInstructionsTest. Some of the jumps land in the middle of an already cached
+     * block, which must produce a new overlapping block.
+    */
+    core::Arr<u8> binaryData;
+
+    binaryData
+        .append(0xb8).append(0x0a).append(0x00).append(0xbb).append(0x0a).append(0x00).append(0xb9)
+        .append(0x0a).append(0x00).append(0x39).append(0xcb).append(0x74).append(0x05).append(0x83)
+        .append(0xc0).append(0x01).append(0x7a).append(0x05).append(0x83).append(0xeb).append(0x05)
+        .append(0x72).append(0x03).append(0x83).append(0xe9).append(0x02).append(0xe0).append(0xed);
+
+    asm8086::EmulationOpts options = asm8086::EMU_OPT_BLOCK_ENGINE;
+    EmulationContext ectx = asm8086::createEmulationCtx(binaryData.data(), binaryData.len(), options);
+
+    asm8086::emulate(ectx);
+
+    Assert( ectx.registers[i32(RegisterType::AX)].value == 0x000D );
+    Assert( ectx.registers[i32(RegisterType::BX)].value == 0XFFFB );
+    Assert( ectx.registers[i32(RegisterType::CX)].value == 0 );
+    Assert( ectx.registers[i32(RegisterType::IP)].value == binaryData.len() );
+    asm8086::Flags expectedFlags = asm8086::Flags(asm8086::Flags::CPU_FLAG_CARRY_FLAG |
+                                                  asm8086::Flags::CPU_FLAG_AUX_CARRY_FLAG |
+                                                  asm8086::Flags::CPU_FLAG_SIGN_FLAG);
+    Assert( ectx.registers[i32(RegisterType::FLAGS)].value == expectedFlags );
+
+    // The first block starts at 0 and runs up to the first conditional jump.
+    Assert( ectx.blocks.len() > 1 );
+    Assert( ectx.blocks[0].startIp == 0 );
+    Assert( ectx.blocks[0].endIp == 0x0D );
+    Assert( ectx.blocks[0].instCount == 5 );
+    Assert( ectx.blocks[0].hitCount == 1 );
+
+    // Every block is cached by its start address.
+    for (addr_size i = 0; i < ectx.blocks.len(); i++) {
+        const BasicBlock& block = ectx.blocks[i];
+        Assert( ectx.blockIdxByIp.get(block.startIp) == i32(i) );
+        Assert( block.hitCount > 0 );
+    }
+
+    return 0;
+}
+
+i32 emulateThreadedEngineTest() {
+    /**
+     * Runs the challenge memory addressing program (see emulateChallengeMemoryAddressing) with the default and with the
+     * threaded engine and expects identical registers and memory.
+    */
+    auto runProgram = [](asm8086::EmulationOpts options, EmulationContext& out) {
+        core::Arr<u8> binaryData;
+        binaryData
+            .append(0xba).append(0x06).append(0x00).append(0xbd).append(0xe8).append(0x03).append(0xbe)
+            .append(0x00).append(0x00).append(0x89).append(0x32).append(0x83).append(0xc6).append(0x02)
+            .append(0x39).append(0xd6).append(0x75).append(0xf7).append(0xbb).append(0x00).append(0x00)
+            .append(0x89).append(0xd6).append(0x83).append(0xed).append(0x02).append(0x03).append(0x1a)
+            .append(0x83).append(0xee).append(0x02).append(0x75).append(0xf9);
+        out = asm8086::createEmulationCtx(binaryData.data(), binaryData.len(), options);
+        asm8086::emulate(out);
+    };
+
+    EmulationContext expected;
+    runProgram(asm8086::EMU_OPT_NONE, expected);
+
+    EmulationContext actual;
+    runProgram(asm8086::EMU_OPT_THREADED_ENGINE, actual);
+
+    Assert( actual.handlers.len() == actual.instructions.len() );
+    for (addr_size i = 0; i < addr_size(RegisterType::SENTINEL); i++) {
+        Assert( actual.registers[i].value == expected.registers[i].value );
+    }
+    for (addr_size i = 0; i < 2048; i++) {
+        Assert( actual.memory[i] == expected.memory[i] );
+    }
+
+    return 0;
+}
+
+i32 emulateLazyFlagsTest() {
+    /**
+     * This binary data represents the following assembly code:
+     *
+     * bits 16
+     *
+     * mov bx, 1
+     * add bx, 0xFFFF
+     * sub bx, 1
+     *
+    */
+    core::Arr<u8> binaryData;
+    binaryData
+        .append(0xbb).append(0x01).append(0x00).append(0x83).append(0xc3).append(0xff).append(0x83)
+        .append(0xeb).append(0x01);
+
+    asm8086::EmulationOpts options = {};
+    EmulationContext ectx = asm8086::createEmulationCtx(binaryData.data(), binaryData.len(), options);
+
+    asm8086::emulate(ectx);
+
+    // Only the last arithmetic operation matters and emulation must end with materialized flags.
+    Assert( ectx.lazyFlags.op == LazyFlagsOp::None );
+    Assert( ectx.registers[i32(RegisterType::BX)].value == 0xFFFF );
+    asm8086::Flags expectedFlags = asm8086::Flags(asm8086::Flags::CPU_FLAG_CARRY_FLAG |
+                                                  asm8086::Flags::CPU_FLAG_PARITY_FLAG |
+                                                  asm8086::Flags::CPU_FLAG_AUX_CARRY_FLAG |
+                                                  asm8086::Flags::CPU_FLAG_SIGN_FLAG);
+    Assert( ectx.registers[i32(RegisterType::FLAGS)].value == expectedFlags );
+
+    // A pending byte operation replaces only the arithmetic flags.
+    ectx.lazyFlags = { LazyFlagsOp::Add, false, 0x7F, 0x01, 0x80 };
+    expectedFlags = asm8086::Flags(asm8086::Flags::CPU_FLAG_AUX_CARRY_FLAG |
+                                   asm8086::Flags::CPU_FLAG_SIGN_FLAG |
+                                   asm8086::Flags::CPU_FLAG_OVERFLOW_FLAG);
+    Assert( asm8086::materializeFlags(ectx) == expectedFlags );
+    Assert( ectx.registers[i32(RegisterType::FLAGS)].value == expectedFlags );
+    Assert( ectx.lazyFlags.op == LazyFlagsOp::None );
+
+    return 0;
+}
+
+i32 emulateFusedInstructionsTest() {
+    /**
+     * This binary data represents the following assembly code:
+     *
+     * bits 16
+     *
+     * mov cx, 3
+     * mov bx, 1000
+     * add_loop:
+     * add bx, 10
+     * loop add_loop
+     *
+     * mov dx, 2
+     * sub_loop:
+     * sub dx, 1
+     * jnz sub_loop
+     *
+     * cmp bx, 1030
+     * je skip
+     * mov ax, 1
+     * skip:
+     *
+    */
+    auto runProgram = [](asm8086::EmulationOpts options) {
+        core::Arr<u8> binaryData;
+        binaryData
+            .append(0xb9).append(0x03).append(0x00).append(0xbb).append(0xe8).append(0x03).append(0x83)
+            .append(0xc3).append(0x0a).append(0xe2).append(0xfb).append(0xba).append(0x02).append(0x00)
+            .append(0x83).append(0xea).append(0x01).append(0x75).append(0xfb).append(0x81).append(0xfb)
+            .append(0x06).append(0x04).append(0x74).append(0x03).append(0xb8).append(0x01).append(0x00);
+        EmulationContext ectx = asm8086::createEmulationCtx(binaryData.data(), binaryData.len(), options);
+        asm8086::emulate(ectx);
+
+        // add + loop, sub + jnz and cmp + je are fused, nothing else is. The skipped mov is never decoded.
+        Assert( ectx.instructions.len() == 9 );
+        Assert( ectx.fusedHandlers.len() == ectx.instructions.len() );
+        for (addr_size i = 0; i < ectx.fusedHandlers.len(); i++) {
+            bool isFused = i == 2 || i == 5 || i == 7;
+            Assert( (ectx.fusedHandlers[i] != nullptr) == isFused );
+        }
+
+        Assert( ectx.registers[i32(RegisterType::AX)].value == 0 );
+        Assert( ectx.registers[i32(RegisterType::BX)].value == 1030 );
+        Assert( ectx.registers[i32(RegisterType::CX)].value == 0 );
+        Assert( ectx.registers[i32(RegisterType::DX)].value == 0 );
+        Assert( ectx.registers[i32(RegisterType::IP)].value == 0x1C );
+        Assert( ectx.registers[i32(RegisterType::FLAGS)].value == (CPU_FLAG_ZERO_FLAG | CPU_FLAG_PARITY_FLAG) );
+    };
+
+    runProgram(asm8086::EMU_OPT_NONE);
+    runProgram(asm8086::EMU_OPT_BLOCK_ENGINE);
+    runProgram(asm8086::EMU_OPT_THREADED_ENGINE);
+
+    return 0;
+}
+
+i32 emulateJitDifferentialTest() {
+    /**
+     * Runs every program in RUNNABLE_PROGRAMS with the interpreter and with the JIT, compiling every block on its
+     * first hit, and expects identical registers and memory.
+    */
+    auto runProgram = [](const char* name, asm8086::EmulationOpts options, EmulationContext& out) {
+        core::Arr<u8> binaryData;
+        readDataFile(name, binaryData);
+        out = asm8086::createEmulationCtx(binaryData.data(), binaryData.len(), options);
+        out.jitHotThreshold = 1;
+        asm8086::emulate(out);
+    };
+
+    addr_size compiledBlocks = 0;
+    for (const char* name : RUNNABLE_PROGRAMS) {
+        EmulationContext expected;
+        runProgram(name, asm8086::EMU_OPT_NONE, expected);
+
+        EmulationContext actual;
+        runProgram(name, asm8086::EMU_OPT_JIT, actual);
+
+        for (addr_size i = 0; i < addr_size(RegisterType::SENTINEL); i++) {
+            Assert( actual.registers[i].value == expected.registers[i].value );
+        }
+        for (addr_size i = 0; i < EMULATOR_MEMORY_SIZE; i++) {
+            Assert( actual.memory[i] == expected.memory[i] );
+        }
+        for (addr_size i = 0; i < actual.blocks.len(); i++) {
+            if (actual.blocks[i].jitFn) compiledBlocks++;
+        }
+    }
+
+    if (jitIsSupported()) {
+        Assert( compiledBlocks > 0 );
+    }
+
+    return 0;
+}
+
+i32 emulateJitRecompileTest() {
+    /**
+     * This binary data represents the following assembly code:
+     *
+     * bits 16
+     *
+     * mov cx, 30000
+     * store:
+     * mov word [store + 4], 1
+     * loop store
+     *
+     * Every store rewrites its own immediate, so the block is invalidated and compiled again on each iteration. The native
+     * code of all the compiles together is much larger than the code buffer, which must be reclaimed for the compiles to
+     * keep succeeding.
+    */
+    core::Arr<u8> binaryData;
+    binaryData.append(0xb9).append(0x30).append(0x75).append(0xc7).append(0x06).append(0x07).append(0x00).append(0x01)
+              .append(0x00).append(0xe2).append(0xf8);
+
+    EmulationContext ectx = asm8086::createEmulationCtx(binaryData.data(), binaryData.len(), asm8086::EMU_OPT_JIT);
+    ectx.jitHotThreshold = 1;
+    asm8086::emulate(ectx);
+
+    Assert( ectx.registers[i32(RegisterType::CX)].value == 0 );
+    Assert( ectx.registers[i32(RegisterType::IP)].value == binaryData.len() );
+    Assert( ectx.memory[7] == 1 );
+    Assert( ectx.jitCode.used <= ectx.jitCode.cap );
+
+    if (jitIsSupported()) {
+        for (addr_size i = 0; i < ectx.blocks.len(); i++) {
+            if (ectx.blocks[i].jitAttempted) Assert( ectx.blocks[i].jitFn != nullptr );
+        }
+    }
+
+    return 0;
+}
+
+i32 emulateLoadProgramTest() {
+    /**
+     * Runs the program from emulateALoopTest loaded at a non-zero base address with every engine. The code bytes must be
+     * in memory, execution must start at the base and every jump must stay relative to it.
+    */
+    constexpr u16 loadBase = 0x100;
+    core::Arr<u8> binaryData;
+    binaryData.append(0xb9).append(0x03).append(0x00).append(0xbb).append(0xe8).append(0x03).append(0x83)
+              .append(0xc3).append(0x0a).append(0x83).append(0xe9).append(0x01).append(0x75).append(0xf8);
+
+    EmulationContext loaded = asm8086::createEmulationCtx(binaryData.data(), binaryData.len(), asm8086::EMU_OPT_NONE,
+                                                          loadBase);
+    Assert( loaded.registers[i32(RegisterType::IP)].value == loadBase );
+    for (addr_size i = 0; i < binaryData.len(); i++) {
+        Assert( loaded.memory[loadBase + i] == binaryData[i] );
+    }
+    // Nothing is decoded before the first fetch.
+    Assert( loaded.instructions.len() == 0 );
+
+    runOnEveryEngine(binaryData, loadBase, [&binaryData](const EmulationContext& ectx) {
+        Assert( ectx.registers[i32(RegisterType::BX)].value == 0x0406 );
+        Assert( ectx.registers[i32(RegisterType::CX)].value == 0 );
+        Assert( ectx.registers[i32(RegisterType::IP)].value == loadBase + binaryData.len() );
+        Assert( ectx.instructions.len() == 5 );
+        Assert( ectx.instIdxByIp.get(loadBase) == 0 );
+        Assert( ectx.instIdxByIp.get(0) == -1 );
+    });
+
+    return 0;
+}
+
+i32 emulateSelfModifyingCodeTest() {
+    /**
+     * This binary data represents the following assembly code:
+     *
+     * bits 16
+     *
+     * mov word [7], 7
+     * mov bx, 5
+     * mov cx, 2
+     * loop_start:
+     * mov si, 5
+     * add dx, si
+     * mov word [13], 9
+     * loop loop_start
+     *
+     * The first store overwrites the immediate of the next instruction in the same run. The second one overwrites an
+     * instruction that already ran, so the second iteration must see the new immediate.
+    */
+    core::Arr<u8> binaryData;
+    binaryData
+        .append(0xc7).append(0x06).append(0x07).append(0x00).append(0x07).append(0x00).append(0xbb)
+        .append(0x05).append(0x00).append(0xb9).append(0x02).append(0x00).append(0xbe).append(0x05)
+        .append(0x00).append(0x01).append(0xf2).append(0xc7).append(0x06).append(0x0d).append(0x00)
+        .append(0x09).append(0x00).append(0xe2).append(0xf3);
+
+    runOnEveryEngine(binaryData, 0, [&binaryData](const EmulationContext& ectx) {
+        Assert( ectx.registers[i32(RegisterType::BX)].value == 7 );
+        Assert( ectx.registers[i32(RegisterType::CX)].value == 0 );
+        Assert( ectx.registers[i32(RegisterType::DX)].value == 14 );
+        Assert( ectx.registers[i32(RegisterType::SI)].value == 9 );
+        Assert( ectx.registers[i32(RegisterType::IP)].value == binaryData.len() );
+        Assert( ectx.memory[7] == 7 );
+        Assert( ectx.memory[13] == 9 );
+    });
+
+    return 0;
+}
+
+i32 emulateStoresNextToCodeTest() {
+    /**
+     * This binary data represents the following assembly code:
+     *
+     * bits 16
+     *
+     * mov dx, 4
+     * outer:
+     * mov cx, 1000
+     * inner:
+     * mov word [target], 1
+     * loop inner
+     * sub dx, 1
+     * jnz outer
+     *
+     * With target 0x80 the stores hit data in the page of the code, which must keep its decoded instructions. With target
+     * 10 every store rewrites the immediate of the store itself, and the instructions decoded again each time must not
+     * pile up.
+    */
+    auto buildProgram = [](u8 target, core::Arr<u8>& binaryData) {
+        binaryData
+            .append(0xba).append(0x04).append(0x00).append(0xb9).append(0xe8).append(0x03).append(0xc7)
+            .append(0x06).append(target).append(0x00).append(0x01).append(0x00).append(0xe2).append(0xf8)
+            .append(0x83).append(0xea).append(0x01).append(0x75).append(0xf0);
+    };
+
+    auto checkStores = [](const core::Arr<u8>& binaryData, const EmulationContext& ectx, u8 target) {
+        Assert( ectx.registers[i32(RegisterType::CX)].value == 0 );
+        Assert( ectx.registers[i32(RegisterType::DX)].value == 0 );
+        Assert( ectx.registers[i32(RegisterType::IP)].value == binaryData.len() );
+        Assert( ectx.memory[target] == 1 );
+    };
+
+    core::Arr<u8> dataStores;
+    buildProgram(0x80, dataStores);
+    runOnEveryEngine(dataStores, 0, [&](const EmulationContext& ectx) {
+        checkStores(dataStores, ectx, 0x80);
+        // Every instruction is decoded exactly once.
+        Assert( ectx.instructions.len() == 6 );
+    });
+
+    core::Arr<u8> codeStores;
+    buildProgram(10, codeStores);
+    runOnEveryEngine(codeStores, 0, [&](const EmulationContext& ectx) {
+        checkStores(codeStores, ectx, 10);
+        // The 4000 stores would leave twice as many decoded instructions behind if the stale ones were kept.
+        Assert( ectx.instructions.len() < 1000 );
+    });
+
+    return 0;
+}
+
+i32 emulateJumpLinkInvalidationTest() {
+    /**
+     * This binary data represents the following assembly code, loaded so that the loop body starts 5 bytes before a
+     * 256 byte page boundary:
+     *
+     * bits 16
+     *
+     * mov cx, 3
+     * loop_start:
+     * mov si, 5
+     * add dx, si
+     * cmp cx, 2
+     * jne skip
+     * mov word [0xfc], 9
+     * skip:
+     * loop loop_start
+     *
+     * The loop is linked to loop_start during the first iteration. The store in the second iteration overwrites the
+     * immediate at loop_start, in the page before the one holding the loop, so the cached loop instruction is reused but
+     * must not follow its old link.
+    */
+    constexpr u16 loadBase = 0xf8;
+    core::Arr<u8> binaryData;
+    binaryData
+        .append(0xb9).append(0x03).append(0x00).append(0xbe).append(0x05).append(0x00).append(0x01)
+        .append(0xf2).append(0x83).append(0xf9).append(0x02).append(0x75).append(0x06).append(0xc7)
+        .append(0x06).append(0xfc).append(0x00).append(0x09).append(0x00).append(0xe2).append(0xee);
+
+    runOnEveryEngine(binaryData, loadBase, [&binaryData](const EmulationContext& ectx) {
+        Assert( ectx.registers[i32(RegisterType::CX)].value == 0 );
+        Assert( ectx.registers[i32(RegisterType::DX)].value == 19 );
+        Assert( ectx.registers[i32(RegisterType::SI)].value == 9 );
+        Assert( ectx.registers[i32(RegisterType::IP)].value == loadBase + binaryData.len() );
+        Assert( ectx.memory[0xfc] == 9 );
+    });
+
+    return 0;
+}
+
+i32 emulateAccumulatorAddressingTest() {
+    /**
+     * This binary data represents the following assembly code:
+     *
+     * bits 16
+     *
+     * mov bx, 4
+     * mov si, 2
+     * mov word [100], 0x1234
+     * mov ax, [100]
+     * mov [102], ax
+     * add bx, -2
+     *
+     * The accumulator forms address memory directly, so bx and si must not move the address. The add carries a single
+     * data byte that is sign extended.
+    */
+    core::Arr<u8> binaryData;
+    binaryData
+        .append(0xbb).append(0x04).append(0x00).append(0xbe).append(0x02).append(0x00).append(0xc7)
+        .append(0x06).append(0x64).append(0x00).append(0x34).append(0x12).append(0xa1).append(0x64)
+        .append(0x00).append(0xa3).append(0x66).append(0x00).append(0x83).append(0xc3).append(0xfe);
+
+    runOnEveryEngine(binaryData, 0, [&binaryData](const EmulationContext& ectx) {
+        Assert( ectx.registers[i32(RegisterType::AX)].value == 0x1234 );
+        Assert( ectx.registers[i32(RegisterType::BX)].value == 2 );
+        Assert( ectx.registers[i32(RegisterType::IP)].value == binaryData.len() );
+        Assert( ectx.memory[102] == 0x34 );
+        Assert( ectx.memory[103] == 0x12 );
+    });
+
+    return 0;
+}
+
+i32 emulateAllConditionalJumpsTest() {
+    /**
+     * For every condition code, in opcode order JO, JNO, JB, JNB, JE, JNE, JBE, JA, JS, JNS, JP, JNP, JL, JGE, JLE, JG,
+     * the program runs:
+     *
+     * mov ax, a
+     * cmp ax, b
+     * j<cond> skip
+     * add dx, 1 << cond
+     * skip:
+     *
+     * DX ends with a bit for every jump that was not taken. The comparisons cover unsigned and signed overflow. After
+     * that comes:
+     *
+     * mov cx, 5
+     * first_loop:
+     * add si, 1
+     * cmp si, 1
+     * loope first_loop
+     * jcxz first_skip
+     * add di, 1
+     * first_skip:
+     * mov cx, 2
+     * second_loop:
+     * add bx, 1
+     * cmp ax, ax
+     * loope second_loop
+     * jcxz second_skip
+     * add di, 2
+     * second_skip:
+     *
+     * The first loope stops on the zero flag and the second one on CX.
+    */
+    struct Comparison { u16 a; u16 b; };
+    constexpr Comparison comparisons[16] = {
+        { 0x8000, 1 }, { 5, 3 }, { 5, 7 }, { 5, 7 }, { 5, 5 }, { 5, 5 }, { 5, 5 }, { 5, 3 },
+        { 5, 7 }, { 0x7fff, 0xffff }, { 5, 5 }, { 5, 3 }, { 0x8000, 1 }, { 0x7fff, 0xffff }, { 5, 3 }, { 0xfffe, 1 },
+    };
+    constexpr u16 notTakenJumps = 0b1100001000101000; // JNB, JNE, JNS, JLE and JG.
+
+    core::Arr<u8> binaryData;
+    for (u8 cond = 0; cond < 16; cond++) {
+        const Comparison& c = comparisons[cond];
+        u16 bit = u16(1 << cond);
+        binaryData.append(0xb8).append(u8(c.a)).append(u8(c.a >> 8));
+        binaryData.append(0x3d).append(u8(c.b)).append(u8(c.b >> 8));
+        binaryData.append(u8(0x70 | cond)).append(0x04);
+        binaryData.append(0x81).append(0xc2).append(u8(bit)).append(u8(bit >> 8));
+    }
+    binaryData
+        .append(0xb9).append(0x05).append(0x00).append(0x83).append(0xc6).append(0x01).append(0x83)
+        .append(0xfe).append(0x01).append(0xe1).append(0xf8).append(0xe3).append(0x03).append(0x83)
+        .append(0xc7).append(0x01).append(0xb9).append(0x02).append(0x00).append(0x83).append(0xc3)
+        .append(0x01).append(0x39).append(0xc0).append(0xe1).append(0xf9).append(0xe3).append(0x03)
+        .append(0x83).append(0xc7).append(0x02);
+
+    runOnEveryEngine(binaryData, 0, [&binaryData](const EmulationContext& ectx) {
+        Assert( ectx.registers[i32(RegisterType::DX)].value == notTakenJumps );
+        Assert( ectx.registers[i32(RegisterType::SI)].value == 2 );
+        Assert( ectx.registers[i32(RegisterType::BX)].value == 2 );
+        Assert( ectx.registers[i32(RegisterType::CX)].value == 0 );
+        Assert( ectx.registers[i32(RegisterType::DI)].value == 1 );
+        Assert( ectx.registers[i32(RegisterType::IP)].value == binaryData.len() );
+    });
+
+    return 0;
+}
+
+i32 emulateByteRegisterOperandsTest() {
+    /**
+     * mov bp, 256
+     * mov cx, 4660
+     * mov dx, 22136
+     * mov [bp], cl
+     * mov [bp + 1], ch
+     * mov [bp + 2], dh
+     * mov ah, [bp]
+     * mov bh, dl
+     * add bh, ch
+     * sub dh, 16
+     *
+     * The high byte registers must not alias SP, BP, SI or DI, and a byte store must write exactly one byte.
+    */
+    core::Arr<u8> binaryData;
+    binaryData
+        .append(0xbd).append(0x00).append(0x01).append(0xb9).append(0x34).append(0x12).append(0xba)
+        .append(0x78).append(0x56).append(0x88).append(0x4e).append(0x00).append(0x88).append(0x6e)
+        .append(0x01).append(0x88).append(0x76).append(0x02).append(0x8a).append(0x66).append(0x00)
+        .append(0x88).append(0xd7).append(0x00).append(0xef).append(0x80).append(0xee).append(0x10);
+
+    runOnEveryEngine(binaryData, 0, [&binaryData](const EmulationContext& ectx) {
+        Assert( ectx.registers[i32(RegisterType::AX)].value == 0x3400 );
+        Assert( ectx.registers[i32(RegisterType::BX)].value == 0x8a00 );
+        Assert( ectx.registers[i32(RegisterType::CX)].value == 0x1234 );
+        Assert( ectx.registers[i32(RegisterType::DX)].value == 0x4678 );
+        Assert( ectx.registers[i32(RegisterType::SP)].value == 0 );
+        Assert( ectx.registers[i32(RegisterType::BP)].value == 0x100 );
+        Assert( ectx.registers[i32(RegisterType::SI)].value == 0 );
+        Assert( ectx.registers[i32(RegisterType::DI)].value == 0 );
+        Assert( ectx.memory[0x100] == 0x34 );
+        Assert( ectx.memory[0x101] == 0x12 );
+        Assert( ectx.memory[0x102] == 0x56 );
+        Assert( ectx.memory[0x103] == 0 );
+    });
+
+    return 0;
+}
+
+i32 emulateArithmeticFlagsTableTest() {
+    /**
+     * Compares the table driven flags with flags computed bit by bit, for every pair of byte operands of add and sub, and
+     * for a spread of word operands.
+    */
+    auto referenceFlags = [](const LazyFlags& lf) -> u16 {
+        u32 signBit = lf.isWord ? 0x8000 : 0x80;
+        u32 mask = lf.isWord ? 0xFFFF : 0xFF;
+        u32 original = lf.dst & mask;
+        u32 srcVal = lf.src & mask;
+        u32 next = lf.result & mask;
+        bool originalSign = original & signBit;
+        bool srcSign = srcVal & signBit;
+        bool nextSign = next & signBit;
+        bool carryFlag, overflowFlag, auxCarryFlag;
+        if (lf.op == LazyFlagsOp::Add) {
+            carryFlag = next < original;
+            overflowFlag = srcSign == originalSign && srcSign != nextSign;
+            auxCarryFlag = ((original & 0xF) + (srcVal & 0xF)) > 0xF;
+        }
+        else {
+            carryFlag = original < next;
+            overflowFlag = originalSign != srcSign && originalSign != nextSign;
+            auxCarryFlag = i32(original & 0xF) - i32(srcVal & 0xF) < 0;
+        }
+        i32 setBitsCount = i32(core::intrin_numberOfSetBits(next & 0xFF));
+
+        u16 flags = CPU_FLAG_NONE;
+        if (nextSign)                 flags |= CPU_FLAG_SIGN_FLAG;
+        if (next == 0)                flags |= CPU_FLAG_ZERO_FLAG;
+        if (carryFlag)                flags |= CPU_FLAG_CARRY_FLAG;
+        if (overflowFlag)             flags |= CPU_FLAG_OVERFLOW_FLAG;
+        if ((setBitsCount & 1) == 0)  flags |= CPU_FLAG_PARITY_FLAG;
+        if (auxCarryFlag)             flags |= CPU_FLAG_AUX_CARRY_FLAG;
+        return flags;
+    };
+
+    auto check = [&referenceFlags](bool isWord, u16 a, u16 b) {
+        LazyFlags add = { LazyFlagsOp::Add, isWord, a, b, u16(a + b) };
+        LazyFlags sub = { LazyFlagsOp::Sub, isWord, a, b, u16(a - b) };
+        if (!isWord) {
+            add.result &= 0xFF;
+            sub.result &= 0xFF;
+        }
+        Assert( asm8086::computeArithmeticFlags(add) == referenceFlags(add) );
+        Assert( asm8086::computeArithmeticFlags(sub) == referenceFlags(sub) );
+    };
+
+    for (u32 a = 0; a < 256; a++) {
+        for (u32 b = 0; b < 256; b++) {
+            check(false, u16(a), u16(b));
+        }
+    }
+
+    // Operands 0x0101 apart cover every low byte and every high byte, the xor moves the sign bit between them.
+    for (u32 a = 0; a <= 0xFFFF; a += 0x0101) {
+        for (u32 b = 0; b <= 0xFFFF; b += 0x0101) {
+            check(true, u16(a), u16(b));
+            check(true, u16(a ^ 0x7f00), u16(b + 1));
+        }
+    }
+
+    return 0;
+}
+
+i32 emulateContextMemoryTest() {
+    /**
+     * Runs the program from emulateSimpleMovTest twice through an allocator that counts its calls. Each context must get
+     * its own memory, return it exactly once and leave the memory of the other context alone.
+    */
+    core::Arr<u8> binaryData;
+    binaryData
+        .append(0xb8).append(0x01).append(0x00).append(0xbb).append(0x02).append(0x00).append(0xb9)
+        .append(0x03).append(0x00).append(0xba).append(0x04).append(0x00).append(0xbc).append(0x05)
+        .append(0x00).append(0xbd).append(0x06).append(0x00).append(0xbe).append(0x07).append(0x00)
+        .append(0xbf).append(0x08).append(0x00);
+
+    struct Counters {
+        i32 allocs;
+        i32 frees;
+    };
+    Counters counters = {};
+
+    EmulatorMemoryAllocator allocator = {};
+    allocator.userData = &counters;
+    allocator.alloc = [](addr_size size, void* userData) -> u8* {
+        reinterpret_cast<Counters*>(userData)->allocs++;
+        EmulatorMemoryAllocator heap = asm8086::defaultMemoryAllocator();
+        return heap.alloc(size, heap.userData);
+    };
+    allocator.free = [](u8* memory, addr_size size, void* userData) {
+        reinterpret_cast<Counters*>(userData)->frees++;
+        EmulatorMemoryAllocator heap = asm8086::defaultMemoryAllocator();
+        heap.free(memory, size, heap.userData);
+    };
+
+    {
+        EmulationContext a = asm8086::createEmulationCtx(binaryData.data(), binaryData.len(), {}, 0, allocator);
+        EmulationContext b = asm8086::createEmulationCtx(binaryData.data(), binaryData.len(), {}, 0x100, allocator);
+        Assert( counters.allocs == 2 );
+        Assert( a.memory != b.memory );
+
+        asm8086::emulate(a);
+        asm8086::emulate(b);
+
+        // Each memory holds only its own copy of the program.
+        Assert( a.memory[0] == 0xb8 );
+        Assert( a.memory[0x100] == 0 );
+        Assert( b.memory[0] == 0 );
+        Assert( b.memory[0x100] == 0xb8 );
+        Assert( a.registers[i32(RegisterType::DI)].value == 8 );
+        Assert( b.registers[i32(RegisterType::DI)].value == 8 );
+
+        // Moving a context moves the ownership of its memory.
+        EmulationContext moved = core::move(a);
+        Assert( moved.memory[0] == 0xb8 );
+        Assert( a.ownedMemory.data == nullptr );
+    }
+    Assert( counters.frees == 2 );
+
+    return 0;
+}
+
+i32 emulateSnapshotRestoreTest() {
+    /**
+     * Runs the image generation program, restores the snapshot taken before the run and runs it again. Both runs must
+     * end in the same state, and restoring must bring back the exact memory the program started with.
+    */
+    auto runProgram = [](asm8086::EmulationOpts options) {
+        core::Arr<u8> binaryData;
+        readDataFile("17_image_gen_program.asm.o", binaryData);
+
+        EmulationContext ectx = asm8086::createEmulationCtx(binaryData.data(), binaryData.len(), options);
+        ectx.jitHotThreshold = 1;
+        EmulationSnapshot start = asm8086::snapshot(ectx);
+        // Only the page with the program was copied.
+        Assert( start.memory.pages[0] != nullptr );
+        for (addr_size i = 1; i < MEMORY_PAGE_COUNT; i++) {
+            Assert( start.memory.pages[i] == nullptr );
+        }
+
+        asm8086::emulate(ectx);
+        EmulationSnapshot end = asm8086::snapshot(ectx);
+
+        // Nothing ran since the last snapshot, so the next one shares every page.
+        EmulationSnapshot same = asm8086::snapshot(ectx);
+        for (addr_size i = 0; i < MEMORY_PAGE_COUNT; i++) {
+            Assert( same.memory.pages[i] == end.memory.pages[i] );
+        }
+
+        asm8086::restore(ectx, start);
+        Assert( ectx.registers[i32(RegisterType::IP)].value == 0 );
+        Assert( ectx.registers[i32(RegisterType::BP)].value == 0 );
+        for (addr_size i = 0; i < EMULATOR_MEMORY_SIZE; i++) {
+            u8 expected = i < binaryData.len() ? binaryData[i] : 0;
+            Assert( ectx.memory[i] == expected );
+        }
+
+        asm8086::emulate(ectx);
+        for (addr_size i = 0; i < addr_size(RegisterType::SENTINEL); i++) {
+            Assert( ectx.registers[i].value == end.registers[i].value );
+        }
+
+        // The end state can be restored into a separate context, and it matches the memory of the second run.
+        EmulationContext other = asm8086::createEmulationCtx(binaryData.data(), binaryData.len(), options);
+        asm8086::restore(other, end);
+        for (addr_size i = 0; i < addr_size(RegisterType::SENTINEL); i++) {
+            Assert( other.registers[i].value == end.registers[i].value );
+        }
+        for (addr_size i = 0; i < EMULATOR_MEMORY_SIZE; i++) {
+            Assert( other.memory[i] == ectx.memory[i] );
+        }
+    };
+
+    runProgram(asm8086::EMU_OPT_NONE);
+    runProgram(asm8086::EMU_OPT_THREADED_ENGINE);
+    runProgram(asm8086::EMU_OPT_JIT);
+
+    return 0;
+}
+
+i32 emulateRestoreDropsModifiedCodeTest() {
+    /**
+     * Runs the program from emulateSelfModifyingCodeTest, which overwrites two of its instructions, and restores the
+     * snapshot taken before the run. The second run must decode the original bytes again and end with the same result.
+    */
+    core::Arr<u8> binaryData;
+    binaryData
+        .append(0xc7).append(0x06).append(0x07).append(0x00).append(0x07).append(0x00).append(0xbb)
+        .append(0x05).append(0x00).append(0xb9).append(0x02).append(0x00).append(0xbe).append(0x05)
+        .append(0x00).append(0x01).append(0xf2).append(0xc7).append(0x06).append(0x0d).append(0x00)
+        .append(0x09).append(0x00).append(0xe2).append(0xf3);
+
+    EmulationContext ectx = asm8086::createEmulationCtx(binaryData.data(), binaryData.len(),
+                                                        asm8086::EMU_OPT_THREADED_ENGINE);
+    EmulationSnapshot start = asm8086::snapshot(ectx);
+    for (i32 run = 0; run < 2; run++) {
+        asm8086::restore(ectx, start);
+        asm8086::emulate(ectx);
+        Assert( ectx.registers[i32(RegisterType::BX)].value == 7 );
+        Assert( ectx.registers[i32(RegisterType::DX)].value == 14 );
+        Assert( ectx.registers[i32(RegisterType::SI)].value == 9 );
+    }
+
+    return 0;
+}
+
+i32 emulateResetContextTest() {
+    /**
+     * Runs the image generation program with a border, resets the context and runs it again. The reset must bring back
+     * the memory and registers the program was loaded with, keep the decoded instructions and report exactly the pages
+     * the program wrote.
+    */
+    core::Arr<u8> binaryData;
+    readDataFile("18_image_gen_with_boarder.asm.o", binaryData);
+
+    EmulationContext ectx = asm8086::createEmulationCtx(binaryData.data(), binaryData.len(),
+                                                        asm8086::EMU_OPT_THREADED_ENGINE);
+    core::Arr<addr_size> pages;
+    asm8086::changedPages(ectx, ectx.initialState, pages);
+    Assert( pages.len() == 0 );
+
+    asm8086::emulate(ectx);
+    Register firstRun[i32(RegisterType::SENTINEL)];
+    for (addr_size i = 0; i < addr_size(RegisterType::SENTINEL); i++) firstRun[i] = ectx.registers[i];
+    addr_size decodedCount = ectx.instructions.len();
+
+    // The image is 64x64 pixels of 4 bytes starting at 256, which spans the first five pages.
+    asm8086::changedPages(ectx, ectx.initialState, pages);
+    Assert( pages.len() == 5 );
+    for (addr_size i = 0; i < pages.len(); i++) {
+        Assert( pages[i] == i );
+    }
+
+    for (i32 run = 0; run < 2; run++) {
+        asm8086::resetEmulationCtx(ectx);
+        pages.clear();
+        asm8086::changedPages(ectx, ectx.initialState, pages);
+        Assert( pages.len() == 0 );
+        Assert( ectx.instructions.len() == decodedCount );
+        for (addr_size i = 0; i < addr_size(RegisterType::SENTINEL); i++) {
+            Assert( ectx.registers[i].value == 0 );
+        }
+        for (addr_size i = 0; i < EMULATOR_MEMORY_SIZE; i++) {
+            u8 expected = i < binaryData.len() ? binaryData[i] : 0;
+            Assert( ectx.memory[i] == expected );
+        }
+
+        asm8086::emulate(ectx);
+        for (addr_size i = 0; i < addr_size(RegisterType::SENTINEL); i++) {
+            Assert( ectx.registers[i].value == firstRun[i].value );
+        }
+    }
+
+    return 0;
+}
+
 i32 runEmulatorTestsSuite() {
     RunTest(emulateSimpleMovTest);
     RunTest(emulateMemoryToRegisterMovTest);
@@ -823,6 +1613,24 @@ i32 runEmulatorTestsSuite() {
     RunTest(emulateChallengeMemoryAddressing);
     RunTest(emulateImageGenerationTest);
     RunTest(emulateImageGenerationWithBoarderTest);
+    RunTest(emulateBlockEngineTest);
+    RunTest(emulateThreadedEngineTest);
+    RunTest(emulateLazyFlagsTest);
+    RunTest(emulateFusedInstructionsTest);
+    RunTest(emulateJitDifferentialTest);
+    RunTest(emulateJitRecompileTest);
+    RunTest(emulateLoadProgramTest);
+    RunTest(emulateSelfModifyingCodeTest);
+    RunTest(emulateStoresNextToCodeTest);
+    RunTest(emulateJumpLinkInvalidationTest);
+    RunTest(emulateAccumulatorAddressingTest);
+    RunTest(emulateAllConditionalJumpsTest);
+    RunTest(emulateByteRegisterOperandsTest);
+    RunTest(emulateArithmeticFlagsTableTest);
+    RunTest(emulateContextMemoryTest);
+    RunTest(emulateSnapshotRestoreTest);
+    RunTest(emulateRestoreDropsModifiedCodeTest);
+    RunTest(emulateResetContextTest);
 
     return 0;
 }
@@ -5,6 +5,8 @@ i32 runAllTests() {
 
     RunTestSuite(runDecoderTestsSuite);
     RunTestSuite(runEmulatorTestsSuite);
+    RunTestSuite(runThreadPoolTestsSuite);
+    RunTestSuite(runMappedFileTestsSuite);
 
     return 0;
 }
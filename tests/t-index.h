@@ -4,11 +4,32 @@
 #include <logger.h>
 #include <decoder.h>
 #include <emulator.h>
+#include <jit.h>
+#include <thread_pool.h>
+#include <mapped_file.h>
+#include <runnable_programs.h>
 
 #include <iostream>
 
 using namespace asm8086;
 
+// Builds the path of a file in the data directory.
+inline void dataFilePath(const char* name, core::StrBuilder<>& out) {
+    out.append(EMULATOR_DATA_PATH);
+    out.append(name);
+}
+
+// Appends the contents of a file in the data directory to out.
+inline void readDataFile(const char* name, core::Arr<u8>& out) {
+    core::StrBuilder<> path;
+    dataFilePath(name, path);
+    core::Arr<u8> contents;
+    Assert(!core::fileReadEntire(path.view().data(), contents).hasErr());
+    out.append(contents.data(), contents.len());
+}
+
 i32 runDecoderTestsSuite();
 i32 runEmulatorTestsSuite();
+i32 runThreadPoolTestsSuite();
+i32 runMappedFileTestsSuite();
 i32 runAllTests();
@@ -0,0 +1,77 @@
+#include "t-index.h"
+
+i32 mapFileMatchesReadTest() {
+    /**
+     * Maps programs from the data directory and expects the same bytes as reading them, and the same instructions when
+     * decoding straight from the mapping.
+    */
+    constexpr const char* programs[] = {
+        "01_one_move_inst.asm.o",
+        "05_add_sub_cmp_jnz.asm.o",
+        "17_image_gen_program.asm.o",
+    };
+
+    for (const char* name : programs) {
+        core::StrBuilder<> path;
+        dataFilePath(name, path);
+
+        core::Arr<u8> binaryData;
+        readDataFile(name, binaryData);
+        MappedFile file;
+        Assert( mapFile(path.view().data(), file) );
+#if defined(__linux__) || defined(__APPLE__)
+        Assert( file.mapped );
+        Assert( file.buffer.len() == 0 );
+#endif
+
+        Assert( file.size == binaryData.len() );
+        for (addr_size i = 0; i < file.size; i++) {
+            Assert( file.data[i] == binaryData[i] );
+        }
+
+        DecodingContext fromRead;
+        decodeAsm8086(binaryData, fromRead);
+        DecodingContext fromMapping;
+        decodeAsm8086(file.data, file.size, fromMapping);
+        Assert( fromMapping.instructions.len() == fromRead.instructions.len() );
+        Assert( fromMapping.jmpLabels.len() == fromRead.jmpLabels.len() );
+        for (addr_size i = 0; i < fromRead.instructions.len(); i++) {
+            Assert( fromMapping.instructions[i].type == fromRead.instructions[i].type );
+            Assert( fromMapping.instructions[i].byteCount == fromRead.instructions[i].byteCount );
+        }
+    }
+
+    return 0;
+}
+
+i32 mapFileOwnershipTest() {
+    core::StrBuilder<> path;
+    dataFilePath("12_ip_loop.asm.o", path);
+
+    MappedFile file;
+    Assert( mapFile(path.view().data(), file) );
+    const u8* data = file.data;
+    addr_size size = file.size;
+    Assert( size > 0 );
+
+    // Moving hands over the contents without copying them.
+    MappedFile moved = core::move(file);
+    Assert( moved.data == data );
+    Assert( moved.size == size );
+    Assert( file.data == nullptr );
+    Assert( file.size == 0 );
+
+    // A failed open leaves the file empty.
+    Assert( !mapFile("this/file/does/not/exist.o", moved) );
+    Assert( moved.data == nullptr );
+    Assert( moved.size == 0 );
+
+    return 0;
+}
+
+i32 runMappedFileTestsSuite() {
+    RunTest(mapFileMatchesReadTest);
+    RunTest(mapFileOwnershipTest);
+
+    return 0;
+}
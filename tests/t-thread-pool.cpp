@@ -0,0 +1,129 @@
+#include "t-index.h"
+
+#include <atomic>
+
+namespace {
+
+void incrementCounter(void* userData) {
+    (*reinterpret_cast<std::atomic<i32>*>(userData))++;
+}
+
+void runProgram(const char* name, EmulationContext& out) {
+    core::Arr<u8> binaryData;
+    readDataFile(name, binaryData);
+    out = asm8086::createEmulationCtx(binaryData.data(), binaryData.len(), asm8086::EMU_OPT_THREADED_ENGINE);
+    asm8086::emulate(out);
+}
+
+} // namespace
+
+i32 threadPoolRunsEveryJobTest() {
+    constexpr addr_size jobCount = 1000;
+    std::atomic<i32> counter = 0;
+
+    struct Slot {
+        i32 index;
+        i32 result;
+        std::atomic<i32>* counter;
+    };
+    core::Arr<Slot> slots;
+    for (addr_size i = 0; i < jobCount; i++) slots.append(Slot{ i32(i), 0, &counter });
+
+    ThreadPool pool(4);
+    Assert( pool.threadCount() == 4 );
+
+    // Every job writes only its own slot.
+    for (addr_size i = 0; i < jobCount; i++) {
+        pool.submit([](void* userData) {
+            Slot& slot = *reinterpret_cast<Slot*>(userData);
+            slot.result = slot.index * 2;
+            (*slot.counter)++;
+        }, &slots[i]);
+    }
+    pool.wait();
+
+    Assert( counter == i32(jobCount) );
+    for (addr_size i = 0; i < jobCount; i++) {
+        Assert( slots[i].result == i32(i) * 2 );
+    }
+
+    // The pool can be reused after waiting.
+    pool.submit(incrementCounter, &counter);
+    pool.wait();
+    Assert( counter == i32(jobCount) + 1 );
+
+    return 0;
+}
+
+i32 threadPoolFinishesJobsOnDestructionTest() {
+    std::atomic<i32> counter = 0;
+    {
+        ThreadPool pool(2);
+        for (i32 i = 0; i < 100; i++) {
+            pool.submit(incrementCounter, &counter);
+        }
+    }
+    Assert( counter == 100 );
+
+    return 0;
+}
+
+i32 threadPoolParallelEmulationTest() {
+    /**
+     * Emulates the same programs on a thread pool, one context per job, and expects the same registers and memory as a
+     * sequential run.
+    */
+    constexpr const char* programs[] = {
+        "12_ip_loop.asm.o",
+        "15_loop_memory_addressing.asm.o",
+        "16_challange_memory_addressing.asm.o",
+        "17_image_gen_program.asm.o",
+        "my_examples/03_memory_addressing.asm.o",
+    };
+    constexpr addr_size programCount = sizeof(programs) / sizeof(programs[0]);
+    constexpr addr_size copiesPerProgram = 4;
+
+    struct Job {
+        const char* name;
+        EmulationContext* out;
+    };
+
+    EmulationContext expected[programCount];
+    for (addr_size i = 0; i < programCount; i++) {
+        runProgram(programs[i], expected[i]);
+    }
+
+    EmulationContext actual[programCount * copiesPerProgram];
+    Job jobs[programCount * copiesPerProgram];
+    {
+        ThreadPool pool(4);
+        for (addr_size i = 0; i < programCount * copiesPerProgram; i++) {
+            jobs[i] = { programs[i % programCount], &actual[i] };
+            pool.submit([](void* userData) {
+                Job& job = *reinterpret_cast<Job*>(userData);
+                runProgram(job.name, *job.out);
+            }, &jobs[i]);
+        }
+        pool.wait();
+    }
+
+    for (addr_size i = 0; i < programCount * copiesPerProgram; i++) {
+        const EmulationContext& e = expected[i % programCount];
+        for (addr_size r = 0; r < addr_size(RegisterType::SENTINEL); r++) {
+            Assert( actual[i].registers[r].value == e.registers[r].value );
+        }
+        for (addr_size m = 0; m < EMULATOR_MEMORY_SIZE; m++) {
+            Assert( actual[i].memory[m] == e.memory[m] );
+        }
+    }
+
+    return 0;
+}
+
+i32 runThreadPoolTestsSuite() {
+    RunTest(threadPoolRunsEveryJobTest);
+    RunTest(threadPoolFinishesJobsOnDestructionTest);
+    RunTest(threadPoolParallelEmulationTest);
+
+    return 0;
+}